@@ -4,6 +4,8 @@
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
 #include "chunk_utils.h"
+#include "chunk_pipeline.h"
+#include "chunk_prefetch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,10 +15,102 @@ typedef struct bup_odb_backend {
     git_odb_backend parent;
     char *path;
     git_odb *odb;
-    bup_chunk *chunk_pool;
+    bup_chunk_pool chunk_pool;
+    /* guards chunk_pool and chunk_index, so write() may be called from
+     * several threads at once */
+    pthread_mutex_t pool_lock;
+    bup_chunk_index chunk_index;
+    bup_fp_cache fingerprints;
+    bup_chunk_cache chunk_cache;
+    bup_list_cache list_cache;
+    /* loose object backend of the repository, written to directly */
+    git_odb_backend *loose;
+    /* pack new chunks and list nodes go into, if bup.packWrites is on */
+    bup_pack_writer *pack;
+    bup_split_params split;
+    const bup_chunker_engine *chunker;
+    unsigned fanout_bits;
+    unsigned list_flags;
+    bup_pipeline_params pipeline;
+    bup_prefetch_params prefetch;
 } bup_odb_backend;
 
 int bup_odb_backend_new(git_odb_backend **out, const char *path);
+/* Size to pass to the backend's writestream() when the length of a blob
+ * is not known up front, as for a pipe; the written length is not
+ * checked then */
+#define BUP_STREAM_SIZE_UNKNOWN UINT64_MAX
+/* Copy up to len bytes of the blob at offset into buf, reading only the
+ * chunks and list nodes that overlap the range. *read_len is less than
+ * len only where the blob ends. */
+int bup_odb_read_range(git_odb_backend *backend, const git_oid *oid,
+                       uint64_t offset, size_t len, void *buf,
+                       size_t *read_len);
+/* Reassemble the object straight into buf, which holds size bytes.
+ * *len is set to the object's size; GIT_EBUFS if it does not fit. */
+int bup_odb_read_into(git_odb_backend *backend, const git_oid *oid,
+                      void *buf, size_t size, size_t *len);
+/* Write the object to fd in order, from each inflated chunk as it comes
+ * in, without assembling it in memory */
+int bup_odb_read_to_fd(git_odb_backend *backend, const git_oid *oid, int fd);
+
+/* Chunking policy recorded in the repository config as bup.minChunk,
+ * bup.avgChunk and bup.maxChunk. A repository without these keys uses
+ * BUP_SPLIT_PARAMS_LEGACY. */
+int bup_odb_read_split_params(bup_split_params *out, git_repository *repo);
+int bup_odb_write_split_params(git_repository *repo,
+                               const bup_split_params *params);
+/* Chunker engine recorded as bup.chunker; rollsum when unset */
+int bup_odb_read_chunker(const bup_chunker_engine **out, git_repository *repo);
+int bup_odb_write_chunker(git_repository *repo,
+                          const bup_chunker_engine *engine);
+/* Chunk list fanout recorded as bup.fanoutBits; flat lists when unset */
+int bup_odb_read_fanout(unsigned *bits, git_repository *repo);
+/* Parse flags for chunk lists; text lists are only recognized while
+ * bup.textLists is unset or true, as in repositories that predate the
+ * binary format */
+int bup_odb_read_list_flags(unsigned *flags, git_repository *repo);
+/* Bloom filter false positive rate recorded as bup.bloomFpRate (a
+ * decimal fraction); BUP_BLOOM_FP_DEFAULT when unset */
+int bup_odb_read_bloom_fp(double *fp_rate, git_repository *repo);
+/* Write pipeline limits recorded as bup.threads (0 or unset for one per
+ * CPU) and bup.maxInflight (bytes) */
+int bup_odb_read_pipeline(bup_pipeline_params *out, git_repository *repo);
+/* Read parallelism recorded as bup.readThreads (0 or unset for one per
+ * CPU) and bup.readAhead (chunks a stream may prefetch) */
+int bup_odb_read_prefetch(bup_prefetch_params *out, git_repository *repo);
+/* Byte budget of the inflated chunk cache recorded as bup.chunkCache;
+ * 0 disables it, BUP_CHUNK_CACHE_DEFAULT when unset */
+int bup_odb_read_chunk_cache(size_t *budget, git_repository *repo);
+/* Byte budget of the parsed chunk list cache recorded as bup.listCache;
+ * 0 disables it, BUP_LIST_CACHE_DEFAULT when unset */
+int bup_odb_read_list_cache(size_t *budget, git_repository *repo);
+/* Budget of the chunk fingerprint map recorded as bup.fingerprintCache
+ * (BUP_FP_CACHE_DEFAULT when unset, 0 disables it), and
+ * bup.fingerprintVerify, confirming one hit in that many with SHA-1 (0
+ * never) */
+int bup_odb_read_fingerprint(size_t *budget, unsigned *verify,
+                             git_repository *repo);
+void bup_odb_fingerprint_stats(git_odb_backend *backend, bup_fp_stats *out);
+/* Whether new chunks and list nodes are packed as they are written,
+ * recorded as bup.packWrites (default true), and the size at which a pack
+ * is finished, bup.packSize (BUP_PACK_SIZE_DEFAULT when unset). Objects
+ * are deflated at zlib level bup.compression (0 to 9, loose ones too),
+ * except that packed objects with at least bup.storeEntropy bits per byte
+ * (a decimal with a dot in any locale; above 8 never) are stored at
+ * level 0. */
+int bup_odb_read_pack(bup_pack_params *out, git_repository *repo);
+/* Objects packed so far, how many were stored at level 0, bytes before
+ * and after compression and the CPU time it took */
+void bup_odb_compress_stats(git_odb_backend *backend, bup_compress_stats *out);
+/* Finish the pack being written, so that other processes find its
+ * objects; freeing the backend does this as well */
+int bup_odb_flush(git_odb_backend *backend);
+/* Hits, misses and current size of the backend's caches */
+void bup_odb_chunk_cache_stats(git_odb_backend *backend, bup_cache_stats *out);
+void bup_odb_list_cache_stats(git_odb_backend *backend, bup_cache_stats *out);
+/* Record the default policy in a new repository */
+int bup_odb_init_config(git_repository *repo);
 
 /* Test helpers to verify backend callbacks are invoked */
 int bup_backend_read_calls(void);
@@ -0,0 +1,104 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <git2.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chunk_utils.h"
+
+/* Values kept in memory by oid, up to a byte budget, evicted in CLOCK
+ * order. Entries hold a reference on their value which is dropped with
+ * release() on eviction; readers take their own reference under the
+ * cache lock, so an evicted value stays valid until they drop it. Safe
+ * to share between threads. */
+#define BUP_CHUNK_CACHE_DEFAULT ((size_t)64 << 20)
+#define BUP_LIST_CACHE_DEFAULT ((size_t)16 << 20)
+/* Expected bytes per entry, used to size the hash buckets */
+#define BUP_CACHE_BUCKET_BYTES 8192
+
+typedef struct {
+    git_oid oid;
+    void *value;
+    size_t size;
+    int referenced;
+    /* next entry in the bucket, or of the free list; -1 ends */
+    int next;
+} bup_cache_entry;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    size_t bytes;
+    size_t entries;
+} bup_cache_stats;
+
+typedef struct bup_oid_cache {
+    size_t budget;
+    size_t used;
+    bup_cache_entry *entries;
+    size_t capacity;
+    size_t count;
+    int free_list;
+    int *buckets;
+    size_t nbuckets;
+    size_t hand;
+    uint64_t hits;
+    uint64_t misses;
+    void (*release)(void *value);
+    pthread_mutex_t lock;
+} bup_oid_cache;
+
+/* A budget of 0 disables the cache */
+int bup_oid_cache_init(bup_oid_cache *cache, size_t budget,
+                       void (*release)(void *value));
+void bup_oid_cache_free(bup_oid_cache *cache);
+/* Find oid, calling hold(value) before the lock is dropped. Counts a hit
+ * or a miss. */
+void *bup_oid_cache_get(bup_oid_cache *cache, const git_oid *oid,
+                        void (*hold)(void *value));
+/* Add value, which the cache takes a reference to with hold(). Does
+ * nothing if oid is present or size exceeds the budget. */
+void bup_oid_cache_put(bup_oid_cache *cache, const git_oid *oid, void *value,
+                       size_t size, void (*hold)(void *value));
+void bup_oid_cache_get_stats(bup_oid_cache *cache, bup_cache_stats *out);
+
+/* Inflated chunks; entries are git_odb_object references, so a hit
+ * hands out the same payload without copying or inflating it again */
+typedef bup_oid_cache bup_chunk_cache;
+
+int bup_chunk_cache_init(bup_chunk_cache *cache, size_t budget);
+/* Read a chunk through the cache; the caller frees *out as usual.
+ * cache may be NULL. */
+int bup_chunk_cache_read(git_odb_object **out, bup_chunk_cache *cache,
+                         git_odb *odb, const git_oid *oid);
+
+/* A chunk list resolved to its data chunks. starts[i] is the blob offset
+ * of chunk i; nodes are the interior list nodes below the root. */
+typedef struct {
+    git_oid *oids;
+    size_t *lens;
+    uint64_t *starts;
+    size_t count;
+    uint64_t total;
+    git_oid *nodes;
+    size_t nnodes;
+    int refs;
+} bup_chunk_list;
+
+/* Parsed chunk lists keyed by the oid of their root node */
+typedef bup_oid_cache bup_list_cache;
+
+int bup_list_cache_init(bup_list_cache *cache, size_t budget);
+/* Resolve blob oid through the cache. Returns 0 with *list held, 1 if
+ * oid is not a chunk list (with the object in *obj when obj is not NULL),
+ * GIT_ENOTFOUND or -1. cache may be NULL. */
+int bup_list_cache_get(bup_chunk_list **list, git_odb_object **obj,
+                       bup_list_cache *cache, git_odb *odb, unsigned flags,
+                       const git_oid *oid);
+/* The cached list for oid, held, or NULL without reading anything */
+bup_chunk_list *bup_list_cache_lookup(bup_list_cache *cache,
+                                      const git_oid *oid);
+void bup_chunk_list_release(bup_chunk_list *list);
+
+#endif /* CHUNK_CACHE_H */
@@ -0,0 +1,73 @@
+#ifndef CHUNK_FINGERPRINT_H
+#define CHUNK_FINGERPRINT_H
+
+#include <git2.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent map from a fast fingerprint of a chunk to its oid, so that
+ * chunks seen before are recognised without SHA-1. The fingerprint is
+ * SipHash-2-4 with 128-bit output over the data and its length, keyed
+ * with a random per-repository seed; being a keyed PRF, it leaves no way
+ * to craft chunks that collide without reading the seed. The map is kept
+ * in <gitdir>/bup/chunks.fp, memory mapped and updated in place, all
+ * integers little endian:
+ *   magic[8] version:u32 ways:u32 nbuckets:u64 seed[2]:u64, padded to
+ *   64 bytes, then nbuckets buckets of BUP_FP_WAYS entries
+ *   fp[16] oid[20] len:u32 check:u64
+ * check covers the rest of its entry and the seed, so an entry torn by a
+ * concurrent writer reads as empty. Like the chunk index it is a cache:
+ * a lost entry costs one SHA-1, a damaged file is recreated. */
+#define BUP_FP_FILE "chunks.fp"
+#define BUP_FP_MAGIC "BUPFPMAP"
+#define BUP_FP_VERSION 2
+#define BUP_FP_HEADER_SIZE 64
+#define BUP_FP_SIZE 16
+#define BUP_FP_ENTRY_SIZE 48
+#define BUP_FP_WAYS 4
+#define BUP_FP_CACHE_DEFAULT ((size_t)32 << 20)
+/* One hit in this many is confirmed with SHA-1 */
+#define BUP_FP_VERIFY_DEFAULT 256
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t verified;
+    uint64_t mismatches;
+} bup_fp_stats;
+
+typedef struct bup_fp_cache {
+    unsigned char *map;
+    size_t map_size;
+    unsigned char *buckets;
+    uint64_t nbuckets;
+    uint64_t seed[2];
+    int writable;
+    unsigned verify;
+    bup_fp_stats stats;
+    pthread_mutex_t lock;
+} bup_fp_cache;
+
+/* Open the map of the repository at gitdir with about budget bytes of
+ * entries; a budget of 0 disables it. A map built for another size is
+ * recreated. One hit in verify (none for 0) is reported as due for
+ * verification. Failing to create the file only disables the cache. */
+int bup_fp_cache_open(bup_fp_cache *c, const char *gitdir, size_t budget,
+                      unsigned verify);
+void bup_fp_cache_close(bup_fp_cache *c);
+int bup_fp_cache_enabled(const bup_fp_cache *c);
+void bup_fingerprint(const bup_fp_cache *c, const void *data, size_t len,
+                     unsigned char *fp);
+/* Return 1 with the recorded oid if fp is known for a chunk of len bytes,
+ * setting *verify when the caller should confirm it with SHA-1 */
+int bup_fp_cache_find(bup_fp_cache *c, const unsigned char *fp, size_t len,
+                      git_oid *oid, int *verify);
+void bup_fp_cache_add(bup_fp_cache *c, const unsigned char *fp, size_t len,
+                      const git_oid *oid);
+/* Replace an entry that failed verification */
+void bup_fp_cache_correct(bup_fp_cache *c, const unsigned char *fp,
+                          size_t len, const git_oid *oid);
+void bup_fp_cache_get_stats(bup_fp_cache *c, bup_fp_stats *out);
+
+#endif /* CHUNK_FINGERPRINT_H */
@@ -0,0 +1,89 @@
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include <git2.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent index of the chunks stored in a repository, kept in
+ * <gitdir>/bup/:
+ *   chunks.idx  sorted and memory mapped, all integers little endian:
+ *               magic[8] version:u32 reserved:u32 count:u64
+ *               fanout[256]:u32 oid[count][20] len[count]:u64
+ *   chunks.log  entries appended since the last merge, oid[20] len:u64
+ *   chunks.bloom  blocked bloom filter over both, updated in place:
+ *               magic[8] version:u32 k:u32 nblocks:u64 capacity:u64
+ *               fp_ppb:u32, padded to 64 bytes, then 64-byte blocks
+ * The index is a cache: a missing entry costs a rewrite of the chunk, a
+ * damaged file is ignored. Tools that prune chunk objects must remove
+ * all three files. */
+#define BUP_INDEX_DIR "bup"
+#define BUP_INDEX_FILE "chunks.idx"
+#define BUP_INDEX_LOG "chunks.log"
+#define BUP_INDEX_MAGIC "BUPCIDX\0"
+#define BUP_INDEX_MAGIC_SIZE 8
+#define BUP_INDEX_VERSION 1
+#define BUP_INDEX_HEADER_SIZE 24
+#define BUP_INDEX_ENTRY_SIZE (GIT_OID_RAWSZ + 8)
+/* chunks.log is merged on close once it has this many entries and at
+ * least an eighth of the size of chunks.idx */
+#define BUP_INDEX_MERGE_MIN 8192
+
+#define BUP_BLOOM_FILE "chunks.bloom"
+#define BUP_BLOOM_MAGIC "BUPBLOOM"
+#define BUP_BLOOM_VERSION 1
+#define BUP_BLOOM_HEADER_SIZE 64
+#define BUP_BLOOM_BLOCK_BITS 512
+#define BUP_BLOOM_MAX_K 16
+#define BUP_BLOOM_MIN_CAPACITY (1 << 16)
+#define BUP_BLOOM_FP_DEFAULT 0.01
+
+typedef struct bup_chunk_index {
+    char *idx_path;
+    char *log_path;
+    unsigned char *map;
+    size_t map_size;
+    size_t count;
+    uint32_t fanout[256];
+    const unsigned char *oids;
+    const unsigned char *lens;
+    /* chunks.log as of open, sorted */
+    unsigned char *journal;
+    size_t journal_count;
+    /* entries not yet appended to chunks.log */
+    unsigned char *pending;
+    size_t npending;
+    int log_fd;
+    /* every oid in the index sets bloom_k bits of one 64-byte block */
+    char *bloom_path;
+    unsigned char *bloom_map;
+    size_t bloom_size;
+    unsigned char *bloom;
+    uint64_t bloom_blocks;
+    uint64_t bloom_capacity;
+    unsigned bloom_k;
+    int bloom_writable;
+    double fp_rate;
+} bup_chunk_index;
+
+/* Open the index of the repository at gitdir, creating its directory when
+ * possible. An index that cannot be written still answers lookups. The
+ * bloom filter is (re)built for fp_rate, or BUP_BLOOM_FP_DEFAULT if 0,
+ * when it is missing, built for another rate or over capacity. */
+int bup_chunk_index_open(bup_chunk_index *idx, const char *gitdir,
+                         double fp_rate);
+/* Return 0 if oid is certainly not indexed, 1 if it may be */
+int bup_chunk_index_maybe(const bup_chunk_index *idx, const git_oid *oid);
+/* Return 1 and the chunk length if oid is indexed, 0 if not. Negative
+ * answers usually come from the bloom filter alone. */
+int bup_chunk_index_find(const bup_chunk_index *idx, const git_oid *oid,
+                         size_t *len);
+int bup_chunk_index_add(bup_chunk_index *idx, const git_oid *oid, size_t len);
+int bup_chunk_index_flush(bup_chunk_index *idx);
+/* Fold chunks.log into chunks.idx. Skipped (returning 0) while another
+ * process holds chunks.idx.lock. */
+int bup_chunk_index_merge(bup_chunk_index *idx);
+/* Flush, merge if the log has grown large, and release the index */
+void bup_chunk_index_close(bup_chunk_index *idx);
+
+#endif /* CHUNK_INDEX_H */
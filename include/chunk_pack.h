@@ -0,0 +1,84 @@
+#ifndef CHUNK_PACK_H
+#define CHUNK_PACK_H
+
+#include <git2.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chunk_index.h"
+
+/* Whether new chunks and list nodes go into packs rather than one loose
+ * object each, and the size at which a pack is finished and another one
+ * started. Objects are deflated at level, except that those whose byte
+ * entropy reaches store_entropy bits per byte, which deflate would barely
+ * shrink, are stored at level 0. */
+typedef struct {
+    int enabled;
+    uint64_t max_size;
+    int level;
+    double store_entropy;
+} bup_pack_params;
+
+#define BUP_PACK_SIZE_DEFAULT ((uint64_t)1 << 30)
+#define BUP_PACK_LEVEL_DEFAULT 1
+#define BUP_PACK_LEVEL_MAX 9
+#define BUP_STORE_ENTROPY_DEFAULT 7.5
+#define BUP_PACK_PARAMS_DEFAULT \
+    { 1, BUP_PACK_SIZE_DEFAULT, BUP_PACK_LEVEL_DEFAULT, \
+      BUP_STORE_ENTROPY_DEFAULT }
+#define BUP_PACK_TMP_PREFIX "tmp_pack_"
+/* Temporary packs not modified for this many seconds were left by a
+ * session that died or failed; git2 repack removes them */
+#define BUP_PACK_TMP_EXPIRE (24 * 60 * 60)
+/* Objects larger than this have their entropy estimated from evenly
+ * spaced windows adding up to this many bytes */
+#define BUP_ENTROPY_SAMPLE (64u << 10)
+#define BUP_ENTROPY_WINDOW (4u << 10)
+
+/* What the compression policy did with the objects a writer packed.
+ * bytes_out counts the zlib streams; the times are thread CPU time. */
+typedef struct {
+    uint64_t objects;
+    uint64_t stored;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t estimate_ns;
+    uint64_t deflate_ns;
+} bup_compress_stats;
+
+/* Shannon entropy of the bytes of data, in bits per byte (0 to 8) */
+double bup_byte_entropy(const void *data, size_t len);
+
+/* Appends objects, deflated, to objects/pack/tmp_pack_* as they are
+ * written, and on finish writes the trailer and a version 2 .idx and
+ * renames both to pack-<checksum>.{pack,idx}. Until then the objects are
+ * served to readers of odb by a backend the writer adds to it, so the
+ * session that wrote them can read them back. Entries added with indexed
+ * set go into the chunk index only once their pack is in place, so a
+ * crash never leaves the index listing chunks that were lost. Once an
+ * add or a finish fails, the open pack is deleted with every object in
+ * it and all later adds and flushes fail, so a caller that was told an
+ * object is stored cannot go on to reference it. Safe to share between
+ * threads; objects are deflated outside the lock. */
+typedef struct bup_pack_writer bup_pack_writer;
+
+/* index_lock, if set, is taken around updates of index */
+int bup_pack_writer_new(bup_pack_writer **out, git_odb *odb,
+                        const char *objects_dir,
+                        const bup_pack_params *params,
+                        bup_chunk_index *index, pthread_mutex_t *index_lock);
+/* Add an object unless this writer already has it */
+int bup_pack_writer_add(bup_pack_writer *w, const git_oid *oid,
+                        git_object_t type, const void *data, size_t len,
+                        int indexed);
+/* Finish the current pack, if it has any object */
+int bup_pack_writer_flush(bup_pack_writer *w);
+/* Return 1 once the writer has failed and lost its open pack */
+int bup_pack_writer_failed(bup_pack_writer *w);
+/* Number of packs finished so far */
+size_t bup_pack_writer_packs(bup_pack_writer *w);
+void bup_pack_writer_stats(bup_pack_writer *w, bup_compress_stats *out);
+/* Flush and release the writer; -1 if it has failed */
+int bup_pack_writer_free(bup_pack_writer *w);
+
+#endif /* CHUNK_PACK_H */
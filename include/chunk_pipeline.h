@@ -0,0 +1,43 @@
+#ifndef CHUNK_PIPELINE_H
+#define CHUNK_PIPELINE_H
+
+#include "chunk_utils.h"
+#include <stddef.h>
+
+/* Worker threads and the bytes of chunk data queued or being stored at
+ * once. threads 0 uses one thread per online CPU, up to
+ * BUP_PIPELINE_MAX_THREADS. */
+typedef struct {
+    unsigned threads;
+    size_t max_inflight;
+} bup_pipeline_params;
+
+#define BUP_PIPELINE_MAX_THREADS 64
+#define BUP_PIPELINE_INFLIGHT_DEFAULT ((size_t)64 << 20)
+#define BUP_PIPELINE_PARAMS_DEFAULT { 0, BUP_PIPELINE_INFLIGHT_DEFAULT }
+/* Blobs smaller than this many maximum-size chunks are written serially */
+#define BUP_PIPELINE_MIN_CHUNKS 8
+
+/* Hashes and stores chunks on a pool of worker threads while the caller
+ * keeps finding boundaries. Chunks enter the pool's chunk list writer in
+ * the order they were pushed; the caller's thread does that as workers
+ * finish, so the list writer is never shared. */
+typedef struct bup_pipeline bup_pipeline;
+
+/* Number of worker threads params resolve to on this machine */
+unsigned bup_pipeline_threads(const bup_pipeline_params *params);
+/* The workers call chunk_pool_put() on pool at once, so pool must have
+ * its lock set; a pool without one is refused with -1 */
+int bup_pipeline_start(bup_pipeline **out, git_odb *odb, bup_chunk_pool *pool,
+                       bup_list_writer *list,
+                       const bup_pipeline_params *params);
+/* Queue one chunk, blocking while the in-flight limit is reached. data must
+ * stay valid until bup_pipeline_finish() returns; with owned set the
+ * pipeline takes it and free()s it once the chunk is listed. */
+int bup_pipeline_push(bup_pipeline *p, const void *data, size_t len,
+                      int owned);
+/* Wait for every queued chunk, stop the workers and release the pipeline.
+ * Returns -1 if any chunk could not be stored or listed. */
+int bup_pipeline_finish(bup_pipeline *p);
+
+#endif /* CHUNK_PIPELINE_H */
@@ -0,0 +1,47 @@
+#ifndef CHUNK_PREFETCH_H
+#define CHUNK_PREFETCH_H
+
+#include "chunk_cache.h"
+#include <git2.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Worker threads reading chunks of one blob and, for streams, how many
+ * chunks they may run ahead of the reader. threads 0 uses one thread per
+ * online CPU, up to BUP_PREFETCH_MAX_THREADS. */
+typedef struct {
+    unsigned threads;
+    size_t read_ahead;
+} bup_prefetch_params;
+
+#define BUP_PREFETCH_MAX_THREADS 64
+#define BUP_PREFETCH_READ_AHEAD_DEFAULT 32
+#define BUP_PREFETCH_PARAMS_DEFAULT { 0, BUP_PREFETCH_READ_AHEAD_DEFAULT }
+/* Each extra thread needs at least this many chunks to be worth starting */
+#define BUP_PREFETCH_CHUNKS_PER_THREAD 8
+
+/* Number of threads params resolve to for a blob of count chunks */
+unsigned bup_prefetch_threads(const bup_prefetch_params *params, size_t count);
+
+/* Inflate every chunk straight to its offset in dest (sum of the
+ * preceding lengths). The caller's thread works as one of the readers.
+ * Fails if a chunk is missing or its size differs from its length.
+ * Chunks are read through cache, which may be NULL. */
+int bup_prefetch_fill(git_odb *odb, bup_chunk_cache *cache,
+                      const git_oid *oids, const size_t *lens, size_t count,
+                      char *dest, const bup_prefetch_params *params);
+
+/* Reads chunks in the background for a reader consuming them in order */
+typedef struct bup_prefetch bup_prefetch;
+
+/* oids and lens must outlive the prefetch */
+int bup_prefetch_start(bup_prefetch **out, git_odb *odb,
+                       bup_chunk_cache *cache, const git_oid *oids,
+                       const size_t *lens, size_t count,
+                       const bup_prefetch_params *params);
+/* Wait for the next chunk in order; the caller frees it */
+int bup_prefetch_next(bup_prefetch *p, git_odb_object **obj);
+/* Stop the readers, dropping chunks not consumed, and release p */
+void bup_prefetch_free(bup_prefetch *p);
+
+#endif /* CHUNK_PREFETCH_H */
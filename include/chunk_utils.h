@@ -2,19 +2,44 @@
 #define CHUNK_UTILS_H
 
 #include <git2.h>
+#include <pthread.h>
+#include "chunk_index.h"
+#include "chunk_fingerprint.h"
+#include "chunk_pack.h"
 #include <stddef.h>
 #include <stdint.h>
 
 #define BUP_WINDOWBITS 6
 #define BUP_WINDOWSIZE (1 << BUP_WINDOWBITS)
-#define BUP_BLOBBITS 12
-#define BUP_MAX_EXTRA_BITS 0
+#define BUP_BLOBBITS 13
+#define BUP_MAX_EXTRA_BITS 2
 #define BUP_CHUNK_MASK ((1 << BUP_BLOBBITS) - 1)
 #define BUP_MIN_CHUNK (1 << (BUP_BLOBBITS - BUP_MAX_EXTRA_BITS))
 #define BUP_MAX_CHUNK (1 << (BUP_BLOBBITS + BUP_MAX_EXTRA_BITS))
 #define BUP_ROLL_BASE 31
 #define BUP_ROLL_SHIFT 16
 #define BUP_ROLL_MASK 0xffff
+/* Chunk lists split into a tree once an entry's oid has BUP_FANOUT_BITS
+ * low zero bits; nodes never exceed BUP_FANOUT_MAX entries. */
+#define BUP_FANOUT_BITS 7
+#define BUP_FANOUT_MAX(bits) (4u << (bits))
+#define BUP_FANOUT_HEADER "bup-fanout "
+#define BUP_FANOUT_MAX_LEVEL 32
+
+/* Binary chunk list node, all integers little endian:
+ *   magic[8] version level flags reserved count:u32 total:u64
+ *   oid[count][20]
+ *   lengths as varints, or with BUP_LIST_OFFSETS start offsets as u64[count]
+ * Older repositories hold text lists ("<hex> <len>\n" per entry, interior
+ * nodes prefixed by a BUP_FANOUT_HEADER line). */
+#define BUP_LIST_MAGIC "\x89" "BUP\r\n\x1a\n"
+#define BUP_LIST_MAGIC_SIZE 8
+#define BUP_LIST_VERSION 1
+#define BUP_LIST_HEADER_SIZE 24
+#define BUP_LIST_OFFSETS 0x01
+
+/* parse flags */
+#define BUP_LIST_ACCEPT_TEXT 0x01
 
 typedef struct {
     unsigned s1, s2;
@@ -22,22 +47,229 @@ typedef struct {
     int wofs;
 } Rollsum;
 
+/* Boundary rule: cut once a chunk holds min_chunk bytes and the rollsum
+ * digest has no bits set under mask, or unconditionally at max_chunk. */
+typedef struct {
+    size_t min_chunk;
+    size_t max_chunk;
+    uint32_t mask;
+} bup_split_params;
+
+#define BUP_SPLIT_PARAMS_DEFAULT { BUP_MIN_CHUNK, BUP_MAX_CHUNK, BUP_CHUNK_MASK }
+
+/* Fixed 4 KiB split used by repositories without a recorded policy */
+#define BUP_LEGACY_CHUNK 4096
+#define BUP_SPLIT_PARAMS_LEGACY \
+    { BUP_LEGACY_CHUNK, BUP_LEGACY_CHUNK, BUP_LEGACY_CHUNK - 1 }
+
+typedef struct bup_chunker_engine bup_chunker_engine;
+
+/* Incremental boundary finder. The engine's state and the length of the
+ * current, unfinished chunk carry over between bup_chunker_feed() calls. */
+typedef struct {
+    const bup_chunker_engine *engine;
+    bup_split_params params;
+    size_t chunk_len;
+    union {
+        Rollsum rollsum;
+        uint64_t gear;
+    } u;
+} bup_chunker;
+
+struct bup_chunker_engine {
+    const char *name;
+    void (*init)(bup_chunker *c);
+    size_t (*feed)(bup_chunker *c, const uint8_t *buf, size_t len,
+                   size_t *cuts, size_t ncuts);
+};
+
+/* bup's rollsum, the default and the only engine of older repositories */
+extern const bup_chunker_engine bup_chunker_rollsum;
+/* FastCDC: gear hash with normalized chunking around the average size */
+extern const bup_chunker_engine bup_chunker_fastcdc;
+
 typedef struct bup_chunk {
     git_oid oid;
     size_t len;
-    struct bup_chunk *next;
 } bup_chunk;
 
+/* Chunks written through one backend. Entries are stored contiguously in
+ * insertion order; slots is an open-addressing (linear probing) index of
+ * entry numbers + 1 keyed on the oid's leading bytes, 0 marking a free
+ * slot. A zeroed pool is empty. With an index set, chunks it already
+ * lists are not written again and new chunks are added to it. With a
+ * store set (a loose object backend), new chunks are handed to its write()
+ * with the oid already computed instead of to git_odb_write(), which
+ * would hash them a second time. With pack set, new chunks are appended
+ * to its pack instead and reach the index only once the pack is
+ * finished; once the pack writer has failed, chunk_pool_put() fails too,
+ * since the pool may list chunks lost with the pack. With fingerprints
+ * set, chunk_pool_put() looks chunks up by fingerprint before hashing
+ * them and records the oids of the rest. With a lock set,
+ * chunk_pool_put(), chunk_pool_wanted() and chunk_pool_add() take it, so
+ * writers on several threads can share the pool and its index. */
+typedef struct {
+    bup_chunk *chunks;
+    size_t count, cap;
+    uint32_t *slots;
+    size_t nslots;
+    size_t total;
+    bup_chunk_index *index;
+    git_odb_backend *store;
+    bup_pack_writer *pack;
+    bup_fp_cache *fingerprints;
+    pthread_mutex_t *lock;
+} bup_chunk_pool;
+
 void rollsum_init(Rollsum *r);
 void rollsum_roll(Rollsum *r, uint8_t c);
 uint32_t rollsum_digest(const Rollsum *r);
 
-bup_chunk *chunk_get_or_create(git_odb *odb, bup_chunk **pool,
+/* Find chunk boundaries in buf. The rollsum and *chunk_len (bytes of the
+ * current, unfinished chunk) carry over between calls, so a stream may be
+ * fed in pieces. Up to ncuts cut offsets (relative to buf, one past the
+ * last byte of each chunk) are stored in cuts and their number returned.
+ * If ncuts cuts were found, scanning stopped right after the last one.
+ * Cuts are identical to rolling every byte through rollsum_roll(). */
+size_t bup_find_cuts(Rollsum *r, size_t *chunk_len,
+                     const bup_split_params *params,
+                     const uint8_t *buf, size_t len,
+                     size_t *cuts, size_t ncuts);
+const bup_chunker_engine *bup_chunker_engine_by_name(const char *name);
+void bup_chunker_init(bup_chunker *c, const bup_chunker_engine *engine,
+                      const bup_split_params *params);
+/* Same contract as bup_find_cuts() for the chunker's engine */
+size_t bup_chunker_feed(bup_chunker *c, const uint8_t *buf, size_t len,
+                        size_t *cuts, size_t ncuts);
+
+/* Name of the boundary kernel in use ("scalar", "sse2" or "avx2") */
+const char *rollsum_kernel_name(void);
+/* Select a kernel by name; returns -1 if it is not supported here */
+int rollsum_set_kernel(const char *name);
+
+/* Pending chunk list node of one tree level */
+typedef struct {
+    git_oid *oids;
+    size_t *lens;
+    size_t count, cap;
+    size_t total;
+} bup_list_node;
+
+/* Builds a (possibly multi-level) chunk list while data chunks arrive.
+ * Level 0 nodes list data chunks, level n nodes list level n-1 nodes; an
+ * entry's length is the number of blob bytes below it. With fanout_bits 0
+ * the list stays flat. Nodes are written to pack if set, else to odb. */
+typedef struct {
+    git_odb *odb;
+    bup_pack_writer *pack;
+    unsigned fanout_bits;
+    bup_list_node *levels;
+    size_t nlevels;
+} bup_list_writer;
+
+int bup_list_writer_init(bup_list_writer *w, git_odb *odb,
+                         unsigned fanout_bits);
+int bup_list_writer_add(bup_list_writer *w, const git_oid *oid, size_t len);
+/* Write the remaining nodes and return the root list oid */
+int bup_list_writer_finish(bup_list_writer *w, git_oid *out);
+void bup_list_writer_free(bup_list_writer *w);
+
+typedef int (*bup_list_node_cb)(const git_oid *node, void *payload);
+
+/* The returned chunk is owned by the pool and only valid until the next
+ * insertion */
+bup_chunk *chunk_get_or_create(git_odb *odb, bup_chunk_pool *pool,
                                const void *data, size_t len);
-void chunk_pool_free(bup_chunk **pool);
+/* chunk_get_or_create() for pools shared between threads: the chunk's oid
+ * is returned in *oid instead of a pointer into the pool */
+int chunk_pool_put(git_odb *odb, bup_chunk_pool *pool, const void *data,
+                   size_t len, git_oid *oid);
+void chunk_pool_free(bup_chunk_pool *pool);
+/* Return 1 if neither the pool nor its index has the chunk, so it has to
+ * be stored */
+int chunk_pool_wanted(bup_chunk_pool *pool, const git_oid *oid, size_t len);
+/* chunk_pool_insert() under the pool's lock; 0 or -1 */
+int chunk_pool_add(bup_chunk_pool *pool, const git_oid *oid, size_t len,
+                   int stored);
+/* The steps of chunk_get_or_create() for callers that hash and store
+ * chunks on several threads. Only chunk_pool_store() may run
+ * concurrently; the other calls on one pool must be serialized. */
+bup_chunk *chunk_pool_find(const bup_chunk_pool *pool, const git_oid *oid);
+/* Return 1 if the pool's index lists oid with this length */
+int chunk_pool_indexed(const bup_chunk_pool *pool, const git_oid *oid,
+                       size_t len);
+int chunk_pool_store(git_odb *odb, const bup_chunk_pool *pool,
+                     const git_oid *oid, const void *data, size_t len);
+/* Add a chunk (to the index as well if it was stored); returns the
+ * existing entry if another thread added it first */
+bup_chunk *chunk_pool_insert(bup_chunk_pool *pool, const git_oid *oid,
+                             size_t len, int stored);
 int chunk_pool_count(void);
 size_t chunk_pool_total_size(void);
+/* Serialize one binary chunk list node into a malloc'ed buffer */
+int bup_list_encode(char **out, size_t *out_len, unsigned level,
+                    const git_oid *oids, const size_t *lengths, size_t count,
+                    unsigned flags);
+/* Parse a list of data chunks in either format */
 int parse_chunk_list(const char *data, size_t size, git_oid **oids,
                      size_t **lengths, size_t *count);
+/* Parse one node of a chunk list tree. Text nodes are only recognized
+ * with BUP_LIST_ACCEPT_TEXT; text lists without a fanout header are
+ * level 0. */
+int parse_chunk_node(const char *data, size_t size, unsigned flags,
+                     unsigned *level, git_oid **oids, size_t **lengths,
+                     size_t *count);
+/* Size of the blob a chunk list describes, from its root node alone:
+ * the total in a binary node's header, which is checked against the
+ * node's size but not decoded, or the sum of a text node's entries.
+ * Returns 1 if data is not a chunk list. */
+int bup_chunk_list_size(const char *data, size_t size, unsigned flags,
+                        size_t *total);
+/* Resolve a chunk list to its data chunks, reading interior nodes from odb
+ * and passing each one to cb when set. Returns 1 if data is not a chunk
+ * list, 0 on success and -1 on error. */
+int bup_chunk_list_expand(git_odb *odb, unsigned flags, const char *data,
+                          size_t size, git_oid **oids, size_t **lengths,
+                          size_t *count, bup_list_node_cb cb, void *payload);
+
+/* Called in blob order for each data chunk, with the blob offset it
+ * starts at; returning -1 stops the walk */
+typedef int (*bup_chunk_range_cb)(const git_oid *oid, uint64_t start,
+                                  size_t len, void *payload);
+/* Visit the data chunks of a chunk list that overlap [offset, offset+len),
+ * descending only into the list nodes that do. Returns 1 if data is not a
+ * chunk list, -1 on error. */
+int bup_chunk_list_walk(git_odb *odb, unsigned flags, const char *data,
+                        size_t size, uint64_t offset, uint64_t len,
+                        bup_chunk_range_cb cb, void *payload);
+
+/* Decoded list node of one tree level, and the next entry to descend into */
+typedef struct {
+    git_oid *oids;
+    size_t *lens;
+    size_t count;
+    size_t next;
+} bup_list_reader_node;
+
+/* Reads a chunk list tree one level 0 node at a time, holding one decoded
+ * node per level: memory depends on the tree's depth and fanout, not on
+ * the size of the blob. A flat list is a single node. */
+typedef struct {
+    git_odb *odb;
+    unsigned flags;
+    bup_list_reader_node *levels;
+    size_t nlevels;
+    uint64_t total;
+} bup_list_reader;
+
+/* Parse the root node in data and sum its entries into total. Returns 1
+ * if data is not a chunk list, 0 or -1. */
+int bup_list_reader_init(bup_list_reader *r, git_odb *odb, unsigned flags,
+                         const char *data, size_t size);
+/* The data chunks of the next level 0 node in blob order, valid until the
+ * next call. Returns 1 after the last node, 0 or -1. */
+int bup_list_reader_next(bup_list_reader *r, const git_oid **oids,
+                         const size_t **lens, size_t *count);
+void bup_list_reader_free(bup_list_reader *r);
 
 #endif /* CHUNK_UTILS_H */
@@ -5,13 +5,34 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 
-
+/* Cut offsets gathered per bup_find_cuts() call */
+#define BUP_CUT_BATCH 256
 
 static int read_calls = 0;
 static int write_calls = 0;
 static int free_calls = 0;
 
+/* Read oid and, if it is a chunk list, resolve it through the list
+ * cache. Returns 1 with *obj set for ordinary objects, 0 with *list held
+ * for lists, or an error. */
+static int open_object(bup_odb_backend *b, const git_oid *oid,
+                       git_odb_object **obj, bup_chunk_list **list)
+{
+    return bup_list_cache_get(list, obj, &b->list_cache, b->odb,
+                              b->list_flags, oid);
+}
+
+/* Inflate the chunks of list straight into buf, which holds list->total */
+static int fill_list(bup_odb_backend *b, const bup_chunk_list *list, char *buf)
+{
+    return bup_prefetch_fill(b->odb, &b->chunk_cache, list->oids, list->lens,
+                             list->count, buf, &b->prefetch);
+}
+
 static int bup_backend_read(void **buffer, size_t *len, git_object_t *type,
                            git_odb_backend *backend, const git_oid *oid)
 {
@@ -19,17 +40,12 @@ static int bup_backend_read(void **buffer, size_t *len, git_object_t *type,
     read_calls++;
 
     git_odb_object *obj = NULL;
-    if (git_odb_read(&obj, b->odb, oid) < 0)
-        return GIT_ENOTFOUND;
-
-    const char *data = git_odb_object_data(obj);
-    size_t size = git_odb_object_size(obj);
-
-    git_oid *oids = NULL;
-    size_t *lens = NULL;
-    size_t count = 0;
-    if (git_odb_object_type(obj) != GIT_OBJECT_BLOB ||
-        parse_chunk_list(data, size, &oids, &lens, &count) < 0 || count == 0) {
+    bup_chunk_list *list = NULL;
+    int parsed = open_object(b, oid, &obj, &list);
+    if (parsed < 0)
+        return parsed;
+    if (parsed > 0) {
+        size_t size = git_odb_object_size(obj);
         *type = git_odb_object_type(obj);
         *len = size;
         *buffer = malloc(size);
@@ -37,110 +53,1027 @@ static int bup_backend_read(void **buffer, size_t *len, git_object_t *type,
             git_odb_object_free(obj);
             return -1;
         }
-        memcpy(*buffer, data, size);
+        memcpy(*buffer, git_odb_object_data(obj), size);
         git_odb_object_free(obj);
         return 0;
     }
 
+    size_t total = (size_t)list->total;
+    char *buf = malloc(total ? total : 1);
+    if (!buf || fill_list(b, list, buf) < 0) {
+        free(buf);
+        bup_chunk_list_release(list);
+        return -1;
+    }
+    bup_chunk_list_release(list);
+
+    *type = GIT_OBJECT_BLOB;
+    *len = total;
+    *buffer = buf;
+    return 0;
+}
+
+static int bup_backend_read_header(size_t *len, git_object_t *type,
+                                   git_odb_backend *backend, const git_oid *oid)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    if (git_odb_read_header(len, type, b->odb, oid) < 0)
+        return GIT_ENOTFOUND;
+    if (*type != GIT_OBJECT_BLOB || *len < BUP_LIST_HEADER_SIZE)
+        return 0;
+
+    /* only the root list node is read; no chunk data is touched */
+    git_odb_object *obj = NULL;
+    if (git_odb_read(&obj, b->odb, oid) < 0)
+        return -1;
+    size_t total;
+    if (bup_chunk_list_size(git_odb_object_data(obj), git_odb_object_size(obj),
+                            b->list_flags, &total) == 0)
+        *len = total;
     git_odb_object_free(obj);
+    return 0;
+}
 
+static int bup_backend_exists(git_odb_backend *backend, const git_oid *oid)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    return git_odb_exists(b->odb, oid);
+}
+
+/* Prefixes are resolved from the loose object directories and pack
+ * indexes of the repository and the pack being written; nothing is read */
+static int bup_backend_exists_prefix(git_oid *out, git_odb_backend *backend,
+                                     const git_oid *short_id, size_t len)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    return git_odb_exists_prefix(out, b->odb, short_id, len);
+}
+
+static int bup_backend_read_prefix(git_oid *out, void **buffer, size_t *len,
+                                   git_object_t *type, git_odb_backend *backend,
+                                   const git_oid *short_id, size_t short_len)
+{
+    git_oid oid;
+    int ret = bup_backend_exists_prefix(&oid, backend, short_id, short_len);
+    if (ret < 0)
+        return ret;
+    ret = bup_backend_read(buffer, len, type, backend, &oid);
+    if (ret == 0)
+        git_oid_cpy(out, &oid);
+    return ret;
+}
+
+/* Reads an object one chunk at a time. A chunk list the list cache has
+ * resolved already is read from there; any other list is walked one
+ * level 0 node at a time by reader, so only one node per level is held,
+ * with the current chunk and up to read_ahead chunks being prefetched
+ * when that is enabled. oids, lens and count are the chunks being read,
+ * the whole list or the current node. Ordinary objects are served from
+ * obj with count 0. */
+typedef struct {
+    git_odb_stream parent;
+    git_odb *odb;
+    bup_chunk_cache *cache;
+    const bup_prefetch_params *params;
+    bup_prefetch *prefetch;
+    git_odb_object *obj;
+    size_t ofs;
+    bup_chunk_list *list;
+    bup_list_reader reader;
+    const git_oid *oids;
+    const size_t *lens;
+    size_t count, next;
+} bup_read_stream;
+
+/* Prefetch the chunks in oids, when that is worth it */
+static int read_stream_prefetch(bup_read_stream *s)
+{
+    bup_prefetch_free(s->prefetch);
+    s->prefetch = NULL;
+    s->next = 0;
+    if (bup_prefetch_threads(s->params, s->count) > 1 &&
+        bup_prefetch_start(&s->prefetch, s->odb, s->cache, s->oids, s->lens,
+                           s->count, s->params) < 0)
+        return -1;
+    return 0;
+}
+
+/* Move on to the next level 0 node with chunks; 1 at the end */
+static int read_stream_next_node(bup_read_stream *s)
+{
+    if (!s->reader.levels)
+        return 1;
+    do {
+        int ret = bup_list_reader_next(&s->reader, &s->oids, &s->lens,
+                                       &s->count);
+        if (ret != 0)
+            return ret;
+    } while (!s->count);
+    return read_stream_prefetch(s);
+}
+
+static int read_stream_read(git_odb_stream *stream, char *buffer, size_t len)
+{
+    bup_read_stream *s = (bup_read_stream *)stream;
+    if (len > INT_MAX)
+        len = INT_MAX;
+    size_t done = 0;
+    while (done < len) {
+        if (s->obj && s->ofs == git_odb_object_size(s->obj)) {
+            git_odb_object_free(s->obj);
+            s->obj = NULL;
+        }
+        if (!s->obj) {
+            if (s->next == s->count) {
+                int ret = read_stream_next_node(s);
+                if (ret < 0)
+                    return -1;
+                if (ret > 0)
+                    break;
+            }
+            if (s->prefetch ? bup_prefetch_next(s->prefetch, &s->obj) < 0 :
+                bup_chunk_cache_read(&s->obj, s->cache, s->odb,
+                                     &s->oids[s->next]) < 0)
+                return -1;
+            if (git_odb_object_size(s->obj) != s->lens[s->next])
+                return -1;
+            s->next++;
+            s->ofs = 0;
+        }
+        size_t n = git_odb_object_size(s->obj) - s->ofs;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buffer + done, (const char *)git_odb_object_data(s->obj) + s->ofs,
+               n);
+        s->ofs += n;
+        done += n;
+    }
+    s->parent.received_bytes += done;
+    return (int)done;
+}
+
+static void read_stream_free(git_odb_stream *stream)
+{
+    bup_read_stream *s = (bup_read_stream *)stream;
+    bup_prefetch_free(s->prefetch);
+    git_odb_object_free(s->obj);
+    bup_chunk_list_release(s->list);
+    bup_list_reader_free(&s->reader);
+    free(s);
+}
+
+static int bup_backend_readstream(git_odb_stream **out, size_t *len,
+                                  git_object_t *type, git_odb_backend *backend,
+                                  const git_oid *oid)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    bup_read_stream *s = calloc(1, sizeof(*s));
+    if (!s)
+        return -1;
+    s->odb = b->odb;
+    s->cache = &b->chunk_cache;
+    s->params = &b->prefetch;
+    s->parent.backend = backend;
+    s->parent.mode = GIT_STREAM_RDONLY;
+    s->parent.read = read_stream_read;
+    s->parent.free = read_stream_free;
+
+    /* a list is not resolved for the stream; only the root is read */
     size_t total = 0;
-    for (size_t i = 0; i < count; i++)
-        total += lens[i];
+    int ret = 0;
+    s->list = bup_list_cache_lookup(&b->list_cache, oid);
+    if (s->list) {
+        total = (size_t)s->list->total;
+        *type = GIT_OBJECT_BLOB;
+        s->oids = s->list->oids;
+        s->lens = s->list->lens;
+        s->count = s->list->count;
+        ret = read_stream_prefetch(s);
+    } else if (git_odb_read(&s->obj, b->odb, oid) < 0) {
+        free(s);
+        return GIT_ENOTFOUND;
+    } else {
+        ret = 1;
+        if (git_odb_object_type(s->obj) == GIT_OBJECT_BLOB)
+            ret = bup_list_reader_init(&s->reader, b->odb, b->list_flags,
+                                       git_odb_object_data(s->obj),
+                                       git_odb_object_size(s->obj));
+        if (ret == 0) {
+            git_odb_object_free(s->obj);
+            s->obj = NULL;
+            total = (size_t)s->reader.total;
+            *type = GIT_OBJECT_BLOB;
+        } else if (ret > 0) {
+            total = git_odb_object_size(s->obj);
+            *type = git_odb_object_type(s->obj);
+            ret = 0;
+        }
+    }
+    if (ret < 0) {
+        read_stream_free(&s->parent);
+        return -1;
+    }
+    s->parent.declared_size = total;
+    *len = total;
+    *out = &s->parent;
+    return 0;
+}
+
+typedef struct {
+    git_odb *odb;
+    bup_chunk_cache *cache;
+    uint64_t offset;
+    size_t len;
+    unsigned char *buf;
+    size_t copied;
+} range_read;
 
-    char *buf = malloc(total);
-    if (!buf) {
-        free(oids);
-        free(lens);
+static int copy_chunk_range(const git_oid *oid, uint64_t start, size_t len,
+                            void *payload)
+{
+    range_read *r = payload;
+    git_odb_object *obj = NULL;
+    if (bup_chunk_cache_read(&obj, r->cache, r->odb, oid) < 0)
+        return -1;
+    if (git_odb_object_size(obj) != len) {
+        git_odb_object_free(obj);
         return -1;
     }
+    uint64_t from = start > r->offset ? start : r->offset;
+    uint64_t to = start + len < r->offset + r->len ? start + len :
+                                                     r->offset + r->len;
+    memcpy(r->buf + (from - r->offset),
+           (const char *)git_odb_object_data(obj) + (from - start),
+           (size_t)(to - from));
+    r->copied = (size_t)(to - r->offset);
+    git_odb_object_free(obj);
+    return 0;
+}
 
-    size_t ofs = 0;
-    for (size_t i = 0; i < count; i++) {
-        git_odb_object *chunk_obj = NULL;
-        if (git_odb_read(&chunk_obj, b->odb, &oids[i]) < 0) {
-            free(buf);
-            free(oids);
-            free(lens);
+/* The visit of bup_chunk_list_walk() over an already resolved list */
+static int copy_list_range(const bup_chunk_list *list, range_read *r)
+{
+    size_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->starts[mid] + list->lens[mid] <= r->offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (size_t i = lo;
+         i < list->count && list->starts[i] < r->offset + r->len; i++)
+        if (copy_chunk_range(&list->oids[i], list->starts[i], list->lens[i],
+                             r) < 0)
             return -1;
-        }
-        memcpy(buf + ofs, git_odb_object_data(chunk_obj),
-               git_odb_object_size(chunk_obj));
-        ofs += git_odb_object_size(chunk_obj);
-        git_odb_object_free(chunk_obj);
+    return 0;
+}
+
+int bup_odb_read_range(git_odb_backend *backend, const git_oid *oid,
+                       uint64_t offset, size_t len, void *buf,
+                       size_t *read_len)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    range_read r = { b->odb, &b->chunk_cache, offset, len, buf, 0 };
+
+    /* a list resolved earlier is searched directly; otherwise only the
+     * nodes overlapping the range are read, without caching the list */
+    bup_chunk_list *list = len ? bup_list_cache_lookup(&b->list_cache, oid) :
+                                 NULL;
+    if (list) {
+        int ret = copy_list_range(list, &r);
+        bup_chunk_list_release(list);
+        if (ret < 0)
+            return -1;
+        *read_len = r.copied;
+        return 0;
     }
 
-    free(oids);
-    free(lens);
+    git_odb_object *obj = NULL;
+    if (git_odb_read(&obj, b->odb, oid) < 0)
+        return GIT_ENOTFOUND;
+    const char *data = git_odb_object_data(obj);
+    size_t size = git_odb_object_size(obj);
+    int ret = 1;
+    if (len && git_odb_object_type(obj) == GIT_OBJECT_BLOB)
+        ret = bup_chunk_list_walk(b->odb, b->list_flags, data, size, offset,
+                                  len, copy_chunk_range, &r);
+    if (ret > 0 && offset < size) {
+        r.copied = size - offset < len ? size - (size_t)offset : len;
+        memcpy(buf, data + offset, r.copied);
+    }
+    git_odb_object_free(obj);
+    if (ret < 0)
+        return -1;
+    *read_len = r.copied;
+    return 0;
+}
 
-    *type = GIT_OBJECT_BLOB;
-    *len = total;
-    *buffer = buf;
+int bup_odb_read_into(git_odb_backend *backend, const git_oid *oid,
+                      void *buf, size_t size, size_t *len)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    git_odb_object *obj = NULL;
+    bup_chunk_list *list = NULL;
+    int parsed = open_object(b, oid, &obj, &list);
+    if (parsed < 0)
+        return parsed;
+    if (parsed > 0) {
+        *len = git_odb_object_size(obj);
+        int ret = *len > size ? GIT_EBUFS : 0;
+        if (ret == 0)
+            memcpy(buf, git_odb_object_data(obj), *len);
+        git_odb_object_free(obj);
+        return ret;
+    }
+    *len = (size_t)list->total;
+    int ret = *len > size ? GIT_EBUFS : 0;
+    if (ret == 0 && fill_list(b, list, buf) < 0)
+        ret = -1;
+    bup_chunk_list_release(list);
+    return ret;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int bup_odb_read_to_fd(git_odb_backend *backend, const git_oid *oid, int fd)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    git_odb_object *obj = NULL;
+    bup_chunk_list *list = NULL;
+    int parsed = open_object(b, oid, &obj, &list);
+    if (parsed < 0)
+        return parsed;
+    if (parsed > 0) {
+        int ret = write_all(fd, git_odb_object_data(obj),
+                            git_odb_object_size(obj));
+        git_odb_object_free(obj);
+        return ret;
+    }
+
+    bup_prefetch *prefetch = NULL;
+    if (bup_prefetch_threads(&b->prefetch, list->count) > 1 &&
+        bup_prefetch_start(&prefetch, b->odb, &b->chunk_cache, list->oids,
+                           list->lens, list->count, &b->prefetch) < 0) {
+        bup_chunk_list_release(list);
+        return -1;
+    }
+    int ret = 0;
+    for (size_t i = 0; i < list->count && ret == 0; i++) {
+        git_odb_object *chunk = NULL;
+        ret = prefetch ? bup_prefetch_next(prefetch, &chunk) :
+                         bup_chunk_cache_read(&chunk, &b->chunk_cache, b->odb,
+                                              &list->oids[i]);
+        if (ret < 0)
+            break;
+        if (git_odb_object_size(chunk) != list->lens[i] ||
+            write_all(fd, git_odb_object_data(chunk), list->lens[i]) < 0)
+            ret = -1;
+        git_odb_object_free(chunk);
+    }
+    bup_prefetch_free(prefetch);
+    bup_chunk_list_release(list);
+    return ret < 0 ? -1 : 0;
+}
+
+/* Chunks a blob as its bytes arrive. Data handed to blob_writer_feed()
+ * with stable set stays valid until blob_writer_finish(), so the pipeline
+ * may hash it in place; other chunks are copied before being queued. The
+ * chunk still open at the end of a feed is kept in carry. */
+typedef struct {
+    bup_odb_backend *b;
+    bup_list_writer list;
+    bup_pipeline *pipe;
+    bup_chunker chunker;
+    int stable;
+    unsigned char *carry;
+    size_t carry_len, carry_cap;
+} blob_writer;
+
+/* size is the expected blob length; it only picks serial or pipelined */
+static int blob_writer_init(blob_writer *w, bup_odb_backend *b,
+                            uint64_t size, int stable)
+{
+    memset(w, 0, sizeof(*w));
+    w->b = b;
+    w->stable = stable;
+    if (bup_list_writer_init(&w->list, b->odb, b->fanout_bits) < 0)
+        return -1;
+    w->list.pack = b->pack;
+    /* hashing and deflating dominate; spread them over the workers */
+    if (bup_pipeline_threads(&b->pipeline) > 1 &&
+        size >= (uint64_t)BUP_PIPELINE_MIN_CHUNKS * b->split.max_chunk &&
+        bup_pipeline_start(&w->pipe, b->odb, &b->chunk_pool, &w->list,
+                           &b->pipeline) < 0) {
+        bup_list_writer_free(&w->list);
+        return -1;
+    }
+    bup_chunker_init(&w->chunker, b->chunker, &b->split);
     return 0;
 }
 
+static void blob_writer_free(blob_writer *w)
+{
+    if (w->pipe)
+        bup_pipeline_finish(w->pipe);
+    w->pipe = NULL;
+    bup_list_writer_free(&w->list);
+    free(w->carry);
+    w->carry = NULL;
+}
+
+static int write_chunk(blob_writer *w, const void *data, size_t len,
+                       int transient)
+{
+    bup_odb_backend *b = w->b;
+    if (w->pipe && transient) {
+        void *copy = malloc(len);
+        if (!copy)
+            return -1;
+        memcpy(copy, data, len);
+        return bup_pipeline_push(w->pipe, copy, len, 1);
+    }
+    if (w->pipe)
+        return bup_pipeline_push(w->pipe, data, len, 0);
+    git_oid oid;
+    if (chunk_pool_put(b->odb, &b->chunk_pool, data, len, &oid) < 0)
+        return -1;
+    return bup_list_writer_add(&w->list, &oid, len);
+}
+
+static int carry_append(blob_writer *w, const unsigned char *data, size_t len)
+{
+    if (w->carry_len + len > w->carry_cap) {
+        size_t cap = w->carry_cap ? w->carry_cap : w->b->split.max_chunk;
+        while (cap < w->carry_len + len)
+            cap *= 2;
+        unsigned char *tmp = realloc(w->carry, cap);
+        if (!tmp)
+            return -1;
+        w->carry = tmp;
+        w->carry_cap = cap;
+    }
+    memcpy(w->carry + w->carry_len, data, len);
+    w->carry_len += len;
+    return 0;
+}
+
+static int blob_writer_feed(blob_writer *w, const unsigned char *data,
+                            size_t len)
+{
+    size_t cuts[BUP_CUT_BATCH];
+    while (len) {
+        size_t n = bup_chunker_feed(&w->chunker, data, len, cuts,
+                                    BUP_CUT_BATCH);
+        size_t start = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t end = cuts[k];
+            int ret;
+            if (w->carry_len) {
+                ret = carry_append(w, data + start, end - start);
+                if (ret == 0)
+                    ret = write_chunk(w, w->carry, w->carry_len, 1);
+                w->carry_len = 0;
+            } else if (end == start) {
+                continue;
+            } else {
+                ret = write_chunk(w, data + start, end - start, !w->stable);
+            }
+            if (ret < 0)
+                return -1;
+            start = end;
+        }
+        /* a short batch consumed everything; the rest stays open */
+        if (n < BUP_CUT_BATCH)
+            return carry_append(w, data + start, len - start);
+        data += start;
+        len -= start;
+    }
+    return 0;
+}
+
+static int blob_writer_finish(blob_writer *w, git_oid *oid)
+{
+    int ret = 0;
+    if (w->carry_len)
+        ret = write_chunk(w, w->carry, w->carry_len, 1);
+    if (w->pipe && bup_pipeline_finish(w->pipe) < 0)
+        ret = -1;
+    w->pipe = NULL;
+    if (ret == 0)
+        ret = bup_list_writer_finish(&w->list, oid);
+    blob_writer_free(w);
+    return ret;
+}
+
 static int bup_backend_write(git_odb_backend *backend, const git_oid *oid,
                              const void *data, size_t len, git_object_t type)
 {
     bup_odb_backend *b = (bup_odb_backend *)backend;
-    write_calls++;
+    __atomic_add_fetch(&write_calls, 1, __ATOMIC_RELAXED);
 
     if (type != GIT_OBJECT_BLOB)
         return git_odb_write((git_oid *)oid, b->odb, data, len, type);
 
-    size_t est_count = len / BUP_MIN_CHUNK + 1;
-    size_t est_size = est_count * (GIT_OID_HEXSZ + 1 + 20 + 1);
-    char *list = malloc(est_size);
-    if (!list)
-        return -1;
-    size_t pos = 0;
-    const unsigned char *buf = data;
-    Rollsum r;
-    rollsum_init(&r);
-
-    size_t chunk_start = 0;
-    size_t chunk_len = 0;
-
-    for (size_t i = 0; i < len; i++) {
-        rollsum_roll(&r, buf[i]);
-        chunk_len++;
-
-        int at_end = (i == len - 1);
-        int boundary = chunk_len >= BUP_MIN_CHUNK &&
-                       ((rollsum_digest(&r) & BUP_CHUNK_MASK) == 0 ||
-                        chunk_len >= BUP_MAX_CHUNK);
-        if (boundary || at_end) {
-            bup_chunk *c = chunk_get_or_create(b->odb, &b->chunk_pool,
-                                               buf + chunk_start, chunk_len);
-            if (!c) {
-                free(list);
-                return -1;
+    blob_writer w;
+    if (blob_writer_init(&w, b, len, 1) < 0)
+        return -1;
+    if (blob_writer_feed(&w, data, len) < 0) {
+        blob_writer_free(&w);
+        return -1;
+    }
+    return blob_writer_finish(&w, (git_oid *)oid);
+}
+
+/* Blobs are chunked as they are written, holding at most one open chunk
+ * plus what the pipeline has in flight. Other types are small and are
+ * buffered whole. */
+typedef struct {
+    git_odb_stream parent;
+    bup_odb_backend *b;
+    git_object_t type;
+    blob_writer w;
+    char *buf;
+    size_t len, cap;
+    uint64_t written;
+    int failed, done;
+} bup_write_stream;
+
+static int write_stream_write(git_odb_stream *stream, const char *buffer,
+                              size_t len)
+{
+    bup_write_stream *s = (bup_write_stream *)stream;
+    if (s->failed || s->done ||
+        (s->parent.declared_size != BUP_STREAM_SIZE_UNKNOWN &&
+         s->written + len > s->parent.declared_size))
+        return -1;
+    s->written += len;
+    if (s->type == GIT_OBJECT_BLOB) {
+        if (blob_writer_feed(&s->w, (const unsigned char *)buffer, len) < 0)
+            s->failed = 1;
+    } else {
+        if (s->len + len > s->cap) {
+            size_t cap = s->cap ? s->cap * 2 : len;
+            while (cap < s->len + len)
+                cap *= 2;
+            char *tmp = realloc(s->buf, cap);
+            if (!tmp)
+                s->failed = 1;
+            else {
+                s->buf = tmp;
+                s->cap = cap;
             }
-            char hex[GIT_OID_HEXSZ + 1];
-            git_oid_tostr(hex, sizeof(hex), &c->oid);
-            int n = snprintf(list + pos, est_size - pos, "%s %zu\n", hex, c->len);
-            pos += (size_t)n;
-            chunk_start = i + 1;
-            chunk_len = 0;
+        }
+        if (!s->failed) {
+            memcpy(s->buf + s->len, buffer, len);
+            s->len += len;
         }
     }
+    return s->failed ? -1 : 0;
+}
 
-    int ret = git_odb_write((git_oid *)oid, b->odb, list, pos,
-                            GIT_OBJECT_BLOB);
-    free(list);
-    return ret;
+/* Like write(), stores the oid the object was written under in *oid */
+static int write_stream_finalize(git_odb_stream *stream, const git_oid *oid)
+{
+    bup_write_stream *s = (bup_write_stream *)stream;
+    if (s->failed || s->done ||
+        (s->parent.declared_size != BUP_STREAM_SIZE_UNKNOWN &&
+         s->written != s->parent.declared_size))
+        return -1;
+    s->done = 1;
+    __atomic_add_fetch(&write_calls, 1, __ATOMIC_RELAXED);
+    if (s->type != GIT_OBJECT_BLOB)
+        return git_odb_write((git_oid *)oid, s->b->odb, s->buf, s->len,
+                             s->type);
+    return blob_writer_finish(&s->w, (git_oid *)oid);
+}
+
+static void write_stream_free(git_odb_stream *stream)
+{
+    bup_write_stream *s = (bup_write_stream *)stream;
+    if (s->type == GIT_OBJECT_BLOB && !s->done)
+        blob_writer_free(&s->w);
+    free(s->buf);
+    free(s);
+}
+
+static int bup_backend_writestream(git_odb_stream **out,
+                                   git_odb_backend *backend,
+                                   git_object_size_t size, git_object_t type)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    bup_write_stream *s = calloc(1, sizeof(*s));
+    if (!s)
+        return -1;
+    s->b = b;
+    s->type = type;
+    if (type == GIT_OBJECT_BLOB && blob_writer_init(&s->w, b, size, 0) < 0) {
+        free(s);
+        return -1;
+    }
+    s->parent.backend = backend;
+    s->parent.mode = GIT_STREAM_WRONLY;
+    s->parent.declared_size = size;
+    s->parent.write = write_stream_write;
+    s->parent.finalize_write = write_stream_finalize;
+    s->parent.free = write_stream_free;
+    *out = &s->parent;
+    return 0;
 }
 
 static void bup_backend_free(git_odb_backend *backend)
 {
     bup_odb_backend *b = (bup_odb_backend *)backend;
     free_calls++;
+    /* before the odb, which owns the writer's pending object backend */
+    bup_pack_writer_free(b->pack);
     chunk_pool_free(&b->chunk_pool);
+    pthread_mutex_destroy(&b->pool_lock);
+    bup_oid_cache_free(&b->chunk_cache);
+    bup_oid_cache_free(&b->list_cache);
+    bup_fp_cache_close(&b->fingerprints);
+    bup_chunk_index_close(&b->chunk_index);
+    if (b->loose)
+        b->loose->free(b->loose);
     git_odb_free(b->odb);
     free(b->path);
     free(b);
 }
 
+static int split_params_valid(const bup_split_params *p)
+{
+    uint32_t avg = p->mask + 1;
+    return p->min_chunk > 0 && p->min_chunk <= p->max_chunk &&
+           avg > 1 && (avg & p->mask) == 0;
+}
+
+int bup_odb_read_split_params(bup_split_params *out, git_repository *repo)
+{
+    static const char *keys[] = { "bup.minChunk", "bup.avgChunk",
+                                  "bup.maxChunk" };
+    const bup_split_params legacy = BUP_SPLIT_PARAMS_LEGACY;
+    const bup_split_params def = BUP_SPLIT_PARAMS_DEFAULT;
+    int64_t vals[3] = { (int64_t)def.min_chunk, (int64_t)def.mask + 1,
+                        (int64_t)def.max_chunk };
+    int found = 0;
+
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    for (int i = 0; i < 3; i++) {
+        int64_t v;
+        int ret = git_config_get_int64(&v, cfg, keys[i]);
+        if (ret == GIT_ENOTFOUND)
+            continue;
+        if (ret < 0 || v <= 0 || v > UINT32_MAX) {
+            git_config_free(cfg);
+            return -1;
+        }
+        vals[i] = v;
+        found++;
+    }
+    git_config_free(cfg);
+
+    if (!found) {
+        *out = legacy;
+        return 0;
+    }
+    bup_split_params p = { (size_t)vals[0], (size_t)vals[2],
+                           (uint32_t)(vals[1] - 1) };
+    if (!split_params_valid(&p))
+        return -1;
+    *out = p;
+    return 0;
+}
+
+int bup_odb_write_split_params(git_repository *repo,
+                               const bup_split_params *params)
+{
+    if (!split_params_valid(params))
+        return -1;
+    git_config *cfg = NULL;
+    int ret = git_repository_config(&cfg, repo);
+    if (ret < 0)
+        return ret;
+    ret = git_config_set_int64(cfg, "bup.minChunk", (int64_t)params->min_chunk);
+    if (ret == 0)
+        ret = git_config_set_int64(cfg, "bup.avgChunk",
+                                   (int64_t)params->mask + 1);
+    if (ret == 0)
+        ret = git_config_set_int64(cfg, "bup.maxChunk",
+                                   (int64_t)params->max_chunk);
+    git_config_free(cfg);
+    return ret;
+}
+
+int bup_odb_read_chunker(const bup_chunker_engine **out, git_repository *repo)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    const char *name = NULL;
+    int ret = git_config_get_string(&name, cfg, "bup.chunker");
+    if (ret == GIT_ENOTFOUND) {
+        *out = &bup_chunker_rollsum;
+        ret = 0;
+    } else if (ret == 0) {
+        *out = bup_chunker_engine_by_name(name);
+        if (!*out)
+            ret = -1;
+    }
+    git_config_free(cfg);
+    return ret;
+}
+
+int bup_odb_write_chunker(git_repository *repo,
+                          const bup_chunker_engine *engine)
+{
+    git_config *cfg = NULL;
+    int ret = git_repository_config(&cfg, repo);
+    if (ret < 0)
+        return ret;
+    ret = git_config_set_string(cfg, "bup.chunker", engine->name);
+    git_config_free(cfg);
+    return ret;
+}
+
+int bup_odb_read_fanout(unsigned *bits, git_repository *repo)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int32_t v = 0;
+    int ret = git_config_get_int32(&v, cfg, "bup.fanoutBits");
+    git_config_free(cfg);
+    if (ret == GIT_ENOTFOUND) {
+        *bits = 0;
+        return 0;
+    }
+    if (ret < 0 || v < 0 || v > 16)
+        return -1;
+    *bits = (unsigned)v;
+    return 0;
+}
+
+int bup_odb_read_list_flags(unsigned *flags, git_repository *repo)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int text = 1;
+    int ret = git_config_get_bool(&text, cfg, "bup.textLists");
+    git_config_free(cfg);
+    if (ret < 0 && ret != GIT_ENOTFOUND)
+        return -1;
+    *flags = text ? BUP_LIST_ACCEPT_TEXT : 0;
+    return 0;
+}
+
+/* A plain decimal such as "7.5". strtod() follows LC_NUMERIC and would
+ * stop at the dot where the decimal separator is a comma. */
+static int parse_decimal(const char *s, double *out)
+{
+    double v = 0, scale = 1;
+    int digits = 0, point = 0;
+    for (; *s; s++) {
+        if (*s == '.' && !point) {
+            point = 1;
+            continue;
+        }
+        if (*s < '0' || *s > '9')
+            return -1;
+        v = v * 10 + (*s - '0');
+        if (point)
+            scale *= 10;
+        digits++;
+    }
+    if (!digits)
+        return -1;
+    *out = v / scale;
+    return 0;
+}
+
+int bup_odb_read_bloom_fp(double *fp_rate, git_repository *repo)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    const char *str = NULL;
+    int ret = git_config_get_string(&str, cfg, "bup.bloomFpRate");
+    if (ret == GIT_ENOTFOUND) {
+        git_config_free(cfg);
+        *fp_rate = BUP_BLOOM_FP_DEFAULT;
+        return 0;
+    }
+    double v = 0;
+    int valid = ret == 0 && parse_decimal(str, &v) == 0 && v > 0 && v < 0.5;
+    git_config_free(cfg);
+    if (!valid)
+        return -1;
+    *fp_rate = v;
+    return 0;
+}
+
+int bup_odb_read_pipeline(bup_pipeline_params *out, git_repository *repo)
+{
+    const bup_pipeline_params def = BUP_PIPELINE_PARAMS_DEFAULT;
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int32_t threads = 0;
+    int64_t inflight = (int64_t)def.max_inflight;
+    int ret = git_config_get_int32(&threads, cfg, "bup.threads");
+    if (ret == GIT_ENOTFOUND)
+        ret = 0;
+    if (ret == 0) {
+        ret = git_config_get_int64(&inflight, cfg, "bup.maxInflight");
+        if (ret == GIT_ENOTFOUND)
+            ret = 0;
+    }
+    git_config_free(cfg);
+    if (ret < 0 || threads < 0 || inflight <= 0)
+        return -1;
+    out->threads = (unsigned)threads;
+    out->max_inflight = (size_t)inflight;
+    return 0;
+}
+
+int bup_odb_read_prefetch(bup_prefetch_params *out, git_repository *repo)
+{
+    const bup_prefetch_params def = BUP_PREFETCH_PARAMS_DEFAULT;
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int32_t threads = 0;
+    int32_t ahead = (int32_t)def.read_ahead;
+    int ret = git_config_get_int32(&threads, cfg, "bup.readThreads");
+    if (ret == GIT_ENOTFOUND)
+        ret = 0;
+    if (ret == 0) {
+        ret = git_config_get_int32(&ahead, cfg, "bup.readAhead");
+        if (ret == GIT_ENOTFOUND)
+            ret = 0;
+    }
+    git_config_free(cfg);
+    if (ret < 0 || threads < 0 || ahead <= 0)
+        return -1;
+    out->threads = (unsigned)threads;
+    out->read_ahead = (size_t)ahead;
+    return 0;
+}
+
+static int read_cache_budget(size_t *budget, git_repository *repo,
+                             const char *key, size_t def)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int64_t v = (int64_t)def;
+    int ret = git_config_get_int64(&v, cfg, key);
+    if (ret == GIT_ENOTFOUND)
+        ret = 0;
+    git_config_free(cfg);
+    if (ret < 0 || v < 0)
+        return -1;
+    *budget = (size_t)v;
+    return 0;
+}
+
+int bup_odb_read_chunk_cache(size_t *budget, git_repository *repo)
+{
+    return read_cache_budget(budget, repo, "bup.chunkCache",
+                             BUP_CHUNK_CACHE_DEFAULT);
+}
+
+int bup_odb_read_list_cache(size_t *budget, git_repository *repo)
+{
+    return read_cache_budget(budget, repo, "bup.listCache",
+                             BUP_LIST_CACHE_DEFAULT);
+}
+
+int bup_odb_read_fingerprint(size_t *budget, unsigned *verify,
+                             git_repository *repo)
+{
+    if (read_cache_budget(budget, repo, "bup.fingerprintCache",
+                          BUP_FP_CACHE_DEFAULT) < 0)
+        return -1;
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    int32_t v = BUP_FP_VERIFY_DEFAULT;
+    int ret = git_config_get_int32(&v, cfg, "bup.fingerprintVerify");
+    if (ret == GIT_ENOTFOUND)
+        ret = 0;
+    git_config_free(cfg);
+    if (ret < 0 || v < 0)
+        return -1;
+    *verify = (unsigned)v;
+    return 0;
+}
+
+void bup_odb_fingerprint_stats(git_odb_backend *backend, bup_fp_stats *out)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    bup_fp_cache_get_stats(&b->fingerprints, out);
+}
+
+int bup_odb_read_pack(bup_pack_params *out, git_repository *repo)
+{
+    git_config *cfg = NULL;
+    if (git_repository_config_snapshot(&cfg, repo) < 0)
+        return -1;
+    bup_pack_params p = BUP_PACK_PARAMS_DEFAULT;
+    int64_t size = (int64_t)p.max_size;
+    int32_t level = p.level;
+    const char *entropy = NULL;
+    int ret = git_config_get_bool(&p.enabled, cfg, "bup.packWrites");
+    if (ret == GIT_ENOTFOUND)
+        ret = 0;
+    if (ret == 0) {
+        ret = git_config_get_int64(&size, cfg, "bup.packSize");
+        if (ret == GIT_ENOTFOUND)
+            ret = 0;
+    }
+    if (ret == 0) {
+        ret = git_config_get_int32(&level, cfg, "bup.compression");
+        if (ret == GIT_ENOTFOUND)
+            ret = 0;
+    }
+    if (ret == 0) {
+        ret = git_config_get_string(&entropy, cfg, "bup.storeEntropy");
+        if (ret == GIT_ENOTFOUND)
+            ret = 0;
+        else if (ret == 0 &&
+                 (parse_decimal(entropy, &p.store_entropy) < 0 ||
+                  !(p.store_entropy > 0)))
+            ret = -1;
+    }
+    git_config_free(cfg);
+    if (ret < 0 || size <= 0 || level < 0 || level > BUP_PACK_LEVEL_MAX)
+        return -1;
+    p.max_size = (uint64_t)size;
+    p.level = level;
+    *out = p;
+    return 0;
+}
+
+void bup_odb_compress_stats(git_odb_backend *backend, bup_compress_stats *out)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    if (b->pack)
+        bup_pack_writer_stats(b->pack, out);
+    else
+        memset(out, 0, sizeof(*out));
+}
+
+int bup_odb_flush(git_odb_backend *backend)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    return b->pack ? bup_pack_writer_flush(b->pack) : 0;
+}
+
+void bup_odb_chunk_cache_stats(git_odb_backend *backend, bup_cache_stats *out)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    bup_oid_cache_get_stats(&b->chunk_cache, out);
+}
+
+void bup_odb_list_cache_stats(git_odb_backend *backend, bup_cache_stats *out)
+{
+    bup_odb_backend *b = (bup_odb_backend *)backend;
+    bup_oid_cache_get_stats(&b->list_cache, out);
+}
+
+int bup_odb_init_config(git_repository *repo)
+{
+    const bup_split_params def = BUP_SPLIT_PARAMS_DEFAULT;
+    int ret = bup_odb_write_split_params(repo, &def);
+    if (ret == 0)
+        ret = bup_odb_write_chunker(repo, &bup_chunker_rollsum);
+    if (ret == 0) {
+        git_config *cfg = NULL;
+        ret = git_repository_config(&cfg, repo);
+        if (ret == 0)
+            ret = git_config_set_int32(cfg, "bup.fanoutBits", BUP_FANOUT_BITS);
+        if (ret == 0)
+            ret = git_config_set_bool(cfg, "bup.textLists", 0);
+        git_config_free(cfg);
+    }
+    return ret;
+}
+
 int bup_odb_backend_new(git_odb_backend **out, const char *path)
 {
     bup_odb_backend *backend = calloc(1, sizeof(*backend));
@@ -157,13 +1090,80 @@ int bup_odb_backend_new(git_odb_backend **out, const char *path)
         git_repository_free(repo);
         goto error;
     }
+    double fp_rate;
+    size_t cache_budget, list_budget, fp_budget;
+    unsigned fp_verify;
+    bup_pack_params pack;
+    if (bup_odb_read_split_params(&backend->split, repo) < 0 ||
+        bup_odb_read_chunker(&backend->chunker, repo) < 0 ||
+        bup_odb_read_fanout(&backend->fanout_bits, repo) < 0 ||
+        bup_odb_read_list_flags(&backend->list_flags, repo) < 0 ||
+        bup_odb_read_bloom_fp(&fp_rate, repo) < 0 ||
+        bup_odb_read_pipeline(&backend->pipeline, repo) < 0 ||
+        bup_odb_read_prefetch(&backend->prefetch, repo) < 0 ||
+        bup_odb_read_chunk_cache(&cache_budget, repo) < 0 ||
+        bup_odb_read_list_cache(&list_budget, repo) < 0 ||
+        bup_odb_read_fingerprint(&fp_budget, &fp_verify, repo) < 0 ||
+        bup_odb_read_pack(&pack, repo) < 0 ||
+        bup_chunk_index_open(&backend->chunk_index,
+                             git_repository_path(repo), fp_rate) < 0) {
+        git_odb_free(backend->odb);
+        git_repository_free(repo);
+        goto error;
+    }
+    if (bup_fp_cache_open(&backend->fingerprints, git_repository_path(repo),
+                          fp_budget, fp_verify) < 0) {
+        bup_chunk_index_close(&backend->chunk_index);
+        git_odb_free(backend->odb);
+        git_repository_free(repo);
+        goto error;
+    }
+    /* new objects go where git puts them: the common directory, which a
+     * linked worktree shares with the main one. Alternates are only ever
+     * read, through odb. */
+    char objects[4096];
+    snprintf(objects, sizeof(objects), "%sobjects",
+             git_repository_commondir(repo));
     git_repository_free(repo);
+    if (git_odb_backend_loose(&backend->loose, objects, pack.level, 0, 0,
+                              0) < 0) {
+        bup_fp_cache_close(&backend->fingerprints);
+        bup_chunk_index_close(&backend->chunk_index);
+        git_odb_free(backend->odb);
+        goto error;
+    }
+    /* last, since the odb takes over its pending object backend */
+    if (bup_chunk_cache_init(&backend->chunk_cache, cache_budget) < 0 ||
+        bup_list_cache_init(&backend->list_cache, list_budget) < 0 ||
+        (pack.enabled &&
+         bup_pack_writer_new(&backend->pack, backend->odb, objects, &pack,
+                             &backend->chunk_index,
+                             &backend->pool_lock) < 0)) {
+        bup_oid_cache_free(&backend->list_cache);
+        bup_oid_cache_free(&backend->chunk_cache);
+        backend->loose->free(backend->loose);
+        bup_fp_cache_close(&backend->fingerprints);
+        bup_chunk_index_close(&backend->chunk_index);
+        git_odb_free(backend->odb);
+        goto error;
+    }
 
     backend->parent.version = GIT_ODB_BACKEND_VERSION;
     backend->parent.read = bup_backend_read;
     backend->parent.write = bup_backend_write;
+    backend->parent.read_prefix = bup_backend_read_prefix;
+    backend->parent.read_header = bup_backend_read_header;
+    backend->parent.readstream = bup_backend_readstream;
+    backend->parent.writestream = bup_backend_writestream;
+    backend->parent.exists = bup_backend_exists;
+    backend->parent.exists_prefix = bup_backend_exists_prefix;
     backend->parent.free = bup_backend_free;
-    backend->chunk_pool = NULL;
+    backend->chunk_pool.index = &backend->chunk_index;
+    backend->chunk_pool.store = backend->loose;
+    backend->chunk_pool.pack = backend->pack;
+    backend->chunk_pool.fingerprints = &backend->fingerprints;
+    pthread_mutex_init(&backend->pool_lock, NULL);
+    backend->chunk_pool.lock = &backend->pool_lock;
 
     *out = (git_odb_backend *)backend;
     return 0;
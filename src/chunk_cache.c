@@ -0,0 +1,301 @@
+#include "chunk_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_MAX_BUCKETS (1u << 20)
+#define CACHE_MIN_ENTRIES 64
+
+static size_t cache_bucket(const bup_oid_cache *cache, const git_oid *oid)
+{
+    uint32_t h;
+    memcpy(&h, oid->id, sizeof(h));
+    return h & (cache->nbuckets - 1);
+}
+
+int bup_oid_cache_init(bup_oid_cache *cache, size_t budget,
+                       void (*release)(void *value))
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
+    cache->free_list = -1;
+    cache->release = release;
+    if (!budget)
+        return 0;
+    size_t n = CACHE_MIN_BUCKETS;
+    while (n < CACHE_MAX_BUCKETS && n < budget / BUP_CACHE_BUCKET_BYTES)
+        n <<= 1;
+    cache->buckets = malloc(n * sizeof(*cache->buckets));
+    if (!cache->buckets)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        cache->buckets[i] = -1;
+    cache->nbuckets = n;
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+}
+
+void bup_oid_cache_free(bup_oid_cache *cache)
+{
+    if (!cache->budget)
+        return;
+    for (size_t i = 0; i < cache->capacity; i++)
+        if (cache->entries[i].value)
+            cache->release(cache->entries[i].value);
+    free(cache->entries);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static int cache_find(bup_oid_cache *cache, const git_oid *oid)
+{
+    int i = cache->buckets[cache_bucket(cache, oid)];
+    while (i >= 0 && git_oid_cmp(&cache->entries[i].oid, oid) != 0)
+        i = cache->entries[i].next;
+    return i;
+}
+
+static void cache_remove(bup_oid_cache *cache, int idx)
+{
+    bup_cache_entry *e = &cache->entries[idx];
+    int *link = &cache->buckets[cache_bucket(cache, &e->oid)];
+    while (*link != idx)
+        link = &cache->entries[*link].next;
+    *link = e->next;
+    cache->used -= e->size;
+    cache->count--;
+    cache->release(e->value);
+    e->value = NULL;
+    e->next = cache->free_list;
+    cache->free_list = idx;
+}
+
+/* Sweep the hand, giving referenced entries a second chance, until size
+ * more bytes fit */
+static void cache_evict(bup_oid_cache *cache, size_t size)
+{
+    while (cache->count && cache->used + size > cache->budget) {
+        if (cache->hand >= cache->capacity)
+            cache->hand = 0;
+        bup_cache_entry *e = &cache->entries[cache->hand];
+        if (e->value && e->referenced)
+            e->referenced = 0;
+        else if (e->value)
+            cache_remove(cache, (int)cache->hand);
+        cache->hand++;
+    }
+}
+
+static int cache_grow(bup_oid_cache *cache)
+{
+    size_t cap = cache->capacity ? cache->capacity * 2 : CACHE_MIN_ENTRIES;
+    if (cap > INT32_MAX)
+        return -1;
+    bup_cache_entry *entries = realloc(cache->entries, cap * sizeof(*entries));
+    if (!entries)
+        return -1;
+    for (size_t i = cap; i-- > cache->capacity;) {
+        entries[i].value = NULL;
+        entries[i].next = cache->free_list;
+        cache->free_list = (int)i;
+    }
+    cache->entries = entries;
+    cache->capacity = cap;
+    return 0;
+}
+
+void *bup_oid_cache_get(bup_oid_cache *cache, const git_oid *oid,
+                        void (*hold)(void *value))
+{
+    if (!cache || !cache->budget)
+        return NULL;
+    void *value = NULL;
+    pthread_mutex_lock(&cache->lock);
+    int idx = cache_find(cache, oid);
+    if (idx >= 0) {
+        bup_cache_entry *e = &cache->entries[idx];
+        e->referenced = 1;
+        cache->hits++;
+        value = e->value;
+        hold(value);
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return value;
+}
+
+void bup_oid_cache_put(bup_oid_cache *cache, const git_oid *oid, void *value,
+                       size_t size, void (*hold)(void *value))
+{
+    if (!cache || !cache->budget || size > cache->budget)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    if (cache_find(cache, oid) < 0) {
+        cache_evict(cache, size);
+        if (cache->free_list >= 0 || cache_grow(cache) == 0) {
+            int idx = cache->free_list;
+            bup_cache_entry *e = &cache->entries[idx];
+            cache->free_list = e->next;
+            hold(value);
+            git_oid_cpy(&e->oid, oid);
+            e->value = value;
+            e->size = size;
+            e->referenced = 0;
+            size_t b = cache_bucket(cache, oid);
+            e->next = cache->buckets[b];
+            cache->buckets[b] = idx;
+            cache->used += size;
+            cache->count++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void bup_oid_cache_get_stats(bup_oid_cache *cache, bup_cache_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!cache->budget)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    out->hits = cache->hits;
+    out->misses = cache->misses;
+    out->bytes = cache->used;
+    out->entries = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void object_release(void *value)
+{
+    git_odb_object_free(value);
+}
+
+/* git_odb_object_dup only takes a reference; it cannot fail */
+static void object_hold(void *value)
+{
+    git_odb_object *ref;
+    git_odb_object_dup(&ref, value);
+}
+
+int bup_chunk_cache_init(bup_chunk_cache *cache, size_t budget)
+{
+    return bup_oid_cache_init(cache, budget, object_release);
+}
+
+int bup_chunk_cache_read(git_odb_object **out, bup_chunk_cache *cache,
+                         git_odb *odb, const git_oid *oid)
+{
+    git_odb_object *obj = bup_oid_cache_get(cache, oid, object_hold);
+    if (obj) {
+        *out = obj;
+        return 0;
+    }
+    /* inflate outside the lock so other readers are not held up */
+    int ret = git_odb_read(out, odb, oid);
+    if (ret == 0)
+        bup_oid_cache_put(cache, oid, *out, git_odb_object_size(*out),
+                          object_hold);
+    return ret;
+}
+
+void bup_chunk_list_release(bup_chunk_list *list)
+{
+    if (!list || __atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free(list->oids);
+    free(list->lens);
+    free(list->starts);
+    free(list->nodes);
+    free(list);
+}
+
+static void list_release(void *value)
+{
+    bup_chunk_list_release(value);
+}
+
+static void list_hold(void *value)
+{
+    bup_chunk_list *list = value;
+    __atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED);
+}
+
+int bup_list_cache_init(bup_list_cache *cache, size_t budget)
+{
+    return bup_oid_cache_init(cache, budget, list_release);
+}
+
+bup_chunk_list *bup_list_cache_lookup(bup_list_cache *cache,
+                                      const git_oid *oid)
+{
+    return bup_oid_cache_get(cache, oid, list_hold);
+}
+
+static int collect_node(const git_oid *node, void *payload)
+{
+    bup_chunk_list *list = payload;
+    if ((list->nnodes & (list->nnodes - 1)) == 0) {
+        size_t cap = list->nnodes ? list->nnodes * 2 : 1;
+        git_oid *tmp = realloc(list->nodes, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        list->nodes = tmp;
+    }
+    git_oid_cpy(&list->nodes[list->nnodes++], node);
+    return 0;
+}
+
+int bup_list_cache_get(bup_chunk_list **out, git_odb_object **obj,
+                       bup_list_cache *cache, git_odb *odb, unsigned flags,
+                       const git_oid *oid)
+{
+    bup_chunk_list *list = bup_list_cache_lookup(cache, oid);
+    if (list) {
+        *out = list;
+        return 0;
+    }
+
+    git_odb_object *o = NULL;
+    if (git_odb_read(&o, odb, oid) < 0)
+        return GIT_ENOTFOUND;
+    list = calloc(1, sizeof(*list));
+    if (!list) {
+        git_odb_object_free(o);
+        return -1;
+    }
+    list->refs = 1;
+    int ret = 1;
+    if (git_odb_object_type(o) == GIT_OBJECT_BLOB)
+        ret = bup_chunk_list_expand(odb, flags, git_odb_object_data(o),
+                                    git_odb_object_size(o), &list->oids,
+                                    &list->lens, &list->count, collect_node,
+                                    list);
+    if (ret == 0) {
+        list->starts = malloc((list->count ? list->count : 1) *
+                              sizeof(*list->starts));
+        if (!list->starts)
+            ret = -1;
+    }
+    if (ret != 0) {
+        bup_chunk_list_release(list);
+        if (ret > 0 && obj)
+            *obj = o;
+        else
+            git_odb_object_free(o);
+        return ret;
+    }
+    git_odb_object_free(o);
+
+    for (size_t i = 0; i < list->count; i++) {
+        list->starts[i] = list->total;
+        list->total += list->lens[i];
+    }
+    size_t size = sizeof(*list) +
+                  list->count * (sizeof(git_oid) + sizeof(size_t) +
+                                 sizeof(uint64_t)) +
+                  list->nnodes * sizeof(git_oid);
+    bup_oid_cache_put(cache, oid, list, size, list_hold);
+    *out = list;
+    return 0;
+}
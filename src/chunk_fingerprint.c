@@ -0,0 +1,313 @@
+#include "chunk_fingerprint.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUCKET_SIZE (BUP_FP_WAYS * BUP_FP_ENTRY_SIZE)
+#define ENTRY_OID (BUP_FP_SIZE)
+#define ENTRY_LEN (ENTRY_OID + GIT_OID_RAWSZ)
+#define ENTRY_CHECK (ENTRY_LEN + 4)
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static uint64_t load64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+#define SIPROUND \
+    do { \
+        v0 += v1; \
+        v1 = rotl64(v1, 13); \
+        v1 ^= v0; \
+        v0 = rotl64(v0, 32); \
+        v2 += v3; \
+        v3 = rotl64(v3, 16); \
+        v3 ^= v2; \
+        v0 += v3; \
+        v3 = rotl64(v3, 21); \
+        v3 ^= v0; \
+        v2 += v1; \
+        v1 = rotl64(v1, 17); \
+        v1 ^= v2; \
+        v2 = rotl64(v2, 32); \
+    } while (0)
+
+/* SipHash-2-4 with 128-bit output, keyed with the seed. Unlike a plain
+ * hash it is a PRF: without the key, colliding chunks cannot be built. */
+void bup_fingerprint(const bup_fp_cache *c, const void *data, size_t len,
+                     unsigned char *fp)
+{
+    const unsigned char *p = data;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ c->seed[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ c->seed[1] ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ c->seed[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ c->seed[1];
+    for (size_t n = len / 8; n; n--, p += 8) {
+        uint64_t m = load64(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    unsigned char tail[8] = {0};
+    memcpy(tail, p, len & 7);
+    uint64_t m = load64(tail) | (uint64_t)len << 56;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    v2 ^= 0xee;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    put_le(fp, v0 ^ v1 ^ v2 ^ v3, 8);
+    v1 ^= 0xdd;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    put_le(fp + 8, v0 ^ v1 ^ v2 ^ v3, 8);
+}
+
+/* Never 0, which marks an empty entry */
+static uint64_t entry_check(const bup_fp_cache *c, const unsigned char *e)
+{
+    uint64_t h = c->seed[0];
+    for (size_t i = 0; i < ENTRY_CHECK; i += 8)
+        h = fmix64(h ^ load64(e + i));
+    return h | 1;
+}
+
+static int entry_valid(const bup_fp_cache *c, const unsigned char *e)
+{
+    return get_le(e + ENTRY_CHECK, 8) == entry_check(c, e);
+}
+
+static unsigned char *bucket(const bup_fp_cache *c, const unsigned char *fp)
+{
+    return c->buckets + (load64(fp) & (c->nbuckets - 1)) * BUCKET_SIZE;
+}
+
+static void make_seed(uint64_t seed[2])
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, seed, 2 * sizeof(uint64_t));
+        close(fd);
+        if (n == (ssize_t)(2 * sizeof(uint64_t)))
+            return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed[0] = fmix64((uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 32));
+    seed[1] = fmix64(seed[0] ^ (uint64_t)ts.tv_sec);
+}
+
+static int header_valid(const unsigned char *map, uint64_t nbuckets)
+{
+    return memcmp(map, BUP_FP_MAGIC, 8) == 0 &&
+           get_le(map + 8, 4) == BUP_FP_VERSION &&
+           get_le(map + 12, 4) == BUP_FP_WAYS &&
+           get_le(map + 16, 8) == nbuckets;
+}
+
+/* Truncate the file to size and write a header with a fresh seed */
+static int create_map(int fd, size_t size, uint64_t nbuckets)
+{
+    unsigned char header[BUP_FP_HEADER_SIZE] = {0};
+    uint64_t seed[2];
+    make_seed(seed);
+    memcpy(header, BUP_FP_MAGIC, 8);
+    put_le(header + 8, BUP_FP_VERSION, 4);
+    put_le(header + 12, BUP_FP_WAYS, 4);
+    put_le(header + 16, nbuckets, 8);
+    put_le(header + 24, seed[0], 8);
+    put_le(header + 32, seed[1], 8);
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0)
+        return -1;
+    return pwrite(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header) ?
+           0 : -1;
+}
+
+int bup_fp_cache_open(bup_fp_cache *c, const char *gitdir, size_t budget,
+                      unsigned verify)
+{
+    memset(c, 0, sizeof(*c));
+    c->verify = verify;
+    pthread_mutex_init(&c->lock, NULL);
+    if (budget < BUCKET_SIZE)
+        return 0;
+    uint64_t nbuckets = 1;
+    while (nbuckets * 2 * BUCKET_SIZE <= budget)
+        nbuckets *= 2;
+    size_t size = BUP_FP_HEADER_SIZE + (size_t)nbuckets * BUCKET_SIZE;
+
+    size_t dlen = strlen(gitdir);
+    int slash = dlen && gitdir[dlen - 1] == '/';
+    char *path = malloc(dlen + sizeof("/bup/") + sizeof(BUP_FP_FILE));
+    if (!path)
+        return -1;
+    sprintf(path, slash ? "%sbup" : "%s/bup", gitdir);
+    if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+        free(path);
+        return 0;
+    }
+    strcat(path, "/" BUP_FP_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    c->writable = fd >= 0;
+    if (fd < 0)
+        fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    unsigned char header[BUP_FP_HEADER_SIZE];
+    int valid = fstat(fd, &st) == 0 && (size_t)st.st_size == size &&
+                pread(fd, header, sizeof(header), 0) ==
+                (ssize_t)sizeof(header) &&
+                header_valid(header, nbuckets);
+    if (!valid && (!c->writable || create_map(fd, size, nbuckets) < 0)) {
+        close(fd);
+        return 0;
+    }
+    int prot = PROT_READ | (c->writable ? PROT_WRITE : 0);
+    unsigned char *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    c->map = map;
+    c->map_size = size;
+    c->buckets = map + BUP_FP_HEADER_SIZE;
+    c->nbuckets = nbuckets;
+    c->seed[0] = get_le(map + 24, 8);
+    c->seed[1] = get_le(map + 32, 8);
+    return 0;
+}
+
+void bup_fp_cache_close(bup_fp_cache *c)
+{
+    if (c->map)
+        munmap(c->map, c->map_size);
+    pthread_mutex_destroy(&c->lock);
+    memset(c, 0, sizeof(*c));
+}
+
+int bup_fp_cache_enabled(const bup_fp_cache *c)
+{
+    return c->map != NULL;
+}
+
+static unsigned char *find_entry(const bup_fp_cache *c,
+                                 const unsigned char *fp, size_t len)
+{
+    unsigned char *b = bucket(c, fp);
+    for (int i = 0; i < BUP_FP_WAYS; i++) {
+        unsigned char *e = b + i * BUP_FP_ENTRY_SIZE;
+        if (memcmp(e, fp, BUP_FP_SIZE) == 0 &&
+            get_le(e + ENTRY_LEN, 4) == (uint32_t)len && entry_valid(c, e))
+            return e;
+    }
+    return NULL;
+}
+
+int bup_fp_cache_find(bup_fp_cache *c, const unsigned char *fp, size_t len,
+                      git_oid *oid, int *verify)
+{
+    *verify = 0;
+    if (!c->map || len > UINT32_MAX)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    unsigned char *e = find_entry(c, fp, len);
+    if (e) {
+        git_oid_fromraw(oid, e + ENTRY_OID);
+        c->stats.hits++;
+        if (c->verify && c->stats.hits % c->verify == 0) {
+            *verify = 1;
+            c->stats.verified++;
+        }
+    } else {
+        c->stats.misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return e != NULL;
+}
+
+void bup_fp_cache_add(bup_fp_cache *c, const unsigned char *fp, size_t len,
+                      const git_oid *oid)
+{
+    if (!c->map || !c->writable || len > UINT32_MAX)
+        return;
+    pthread_mutex_lock(&c->lock);
+    unsigned char *b = bucket(c, fp);
+    unsigned char *e = NULL;
+    for (int i = 0; i < BUP_FP_WAYS && !e; i++) {
+        unsigned char *w = b + i * BUP_FP_ENTRY_SIZE;
+        if (memcmp(w, fp, BUP_FP_SIZE) == 0 || !entry_valid(c, w))
+            e = w;
+    }
+    /* a full bucket gives up the way the fingerprint picks */
+    if (!e)
+        e = b + (fp[BUP_FP_SIZE - 1] % BUP_FP_WAYS) * BUP_FP_ENTRY_SIZE;
+    memcpy(e, fp, BUP_FP_SIZE);
+    memcpy(e + ENTRY_OID, oid->id, GIT_OID_RAWSZ);
+    put_le(e + ENTRY_LEN, len, 4);
+    put_le(e + ENTRY_CHECK, entry_check(c, e), 8);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void bup_fp_cache_correct(bup_fp_cache *c, const unsigned char *fp,
+                          size_t len, const git_oid *oid)
+{
+    pthread_mutex_lock(&c->lock);
+    c->stats.mismatches++;
+    pthread_mutex_unlock(&c->lock);
+    bup_fp_cache_add(c, fp, len, oid);
+}
+
+void bup_fp_cache_get_stats(bup_fp_cache *c, bup_fp_stats *out)
+{
+    pthread_mutex_lock(&c->lock);
+    *out = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,553 @@
+#include "chunk_index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PENDING_MAX 4096
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    int slash = dlen && dir[dlen - 1] == '/';
+    char *p = malloc(dlen + strlen(name) + 2);
+    if (p)
+        sprintf(p, slash ? "%s%s" : "%s/%s", dir, name);
+    return p;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, GIT_OID_RAWSZ);
+}
+
+static void unmap_index(bup_chunk_index *idx)
+{
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    idx->map = NULL;
+    idx->map_size = 0;
+    idx->count = 0;
+    memset(idx->fanout, 0, sizeof(idx->fanout));
+}
+
+/* Map chunks.idx; a missing or malformed file leaves the index empty */
+static void map_index(bup_chunk_index *idx)
+{
+    unmap_index(idx);
+    int fd = open(idx->idx_path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < BUP_INDEX_HEADER_SIZE + 256 * 4) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    uint64_t count = get_le(map + 16, 8);
+    const unsigned char *fan = map + BUP_INDEX_HEADER_SIZE;
+    if (memcmp(map, BUP_INDEX_MAGIC, BUP_INDEX_MAGIC_SIZE) != 0 ||
+        get_le(map + 8, 4) != BUP_INDEX_VERSION ||
+        count > (size - BUP_INDEX_HEADER_SIZE - 256 * 4) / BUP_INDEX_ENTRY_SIZE ||
+        size != BUP_INDEX_HEADER_SIZE + 256 * 4 + count * BUP_INDEX_ENTRY_SIZE ||
+        get_le(fan + 255 * 4, 4) != count) {
+        munmap(map, size);
+        return;
+    }
+    uint32_t prev = 0;
+    for (int i = 0; i < 256; i++) {
+        idx->fanout[i] = (uint32_t)get_le(fan + i * 4, 4);
+        if (idx->fanout[i] < prev) {
+            munmap(map, size);
+            memset(idx->fanout, 0, sizeof(idx->fanout));
+            return;
+        }
+        prev = idx->fanout[i];
+    }
+    idx->map = map;
+    idx->map_size = size;
+    idx->count = (size_t)count;
+    idx->oids = fan + 256 * 4;
+    idx->lens = idx->oids + idx->count * GIT_OID_RAWSZ;
+}
+
+static int write_all(int fd, const void *buf, size_t len);
+
+static void unmap_bloom(bup_chunk_index *idx)
+{
+    if (idx->bloom_map)
+        munmap(idx->bloom_map, idx->bloom_size);
+    idx->bloom_map = NULL;
+    idx->bloom = NULL;
+    idx->bloom_size = 0;
+    idx->bloom_blocks = 0;
+    idx->bloom_capacity = 0;
+}
+
+static uint32_t fp_ppb(double fp_rate)
+{
+    return (uint32_t)(fp_rate * 1e9 + 0.5);
+}
+
+/* Map chunks.bloom, writable if the index is */
+static void map_bloom(bup_chunk_index *idx)
+{
+    unmap_bloom(idx);
+    int fd = open(idx->bloom_path, idx->bloom_writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < BUP_BLOOM_HEADER_SIZE) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    int prot = PROT_READ | (idx->bloom_writable ? PROT_WRITE : 0);
+    unsigned char *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    uint64_t k = get_le(map + 12, 4);
+    uint64_t nblocks = get_le(map + 16, 8);
+    if (memcmp(map, BUP_BLOOM_MAGIC, 8) != 0 ||
+        get_le(map + 8, 4) != BUP_BLOOM_VERSION ||
+        k == 0 || k > BUP_BLOOM_MAX_K || nblocks == 0 ||
+        nblocks != (size - BUP_BLOOM_HEADER_SIZE) / (BUP_BLOOM_BLOCK_BITS / 8) ||
+        size != BUP_BLOOM_HEADER_SIZE + nblocks * (BUP_BLOOM_BLOCK_BITS / 8)) {
+        munmap(map, size);
+        return;
+    }
+    idx->bloom_map = map;
+    idx->bloom_size = size;
+    idx->bloom = map + BUP_BLOOM_HEADER_SIZE;
+    idx->bloom_blocks = nblocks;
+    idx->bloom_capacity = get_le(map + 24, 8);
+    idx->bloom_k = (unsigned)k;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* oids are uniformly distributed: the first 8 bytes pick the block and
+ * the next 8 seed the bit positions inside it */
+static unsigned char *bloom_block(const unsigned char *bloom, uint64_t nblocks,
+                                  const git_oid *oid, uint64_t *bits)
+{
+    *bits = get_le(oid->id + 8, 8);
+    return (unsigned char *)bloom +
+           (get_le(oid->id, 8) % nblocks) * (BUP_BLOOM_BLOCK_BITS / 8);
+}
+
+static void bloom_set(unsigned char *bloom, uint64_t nblocks, unsigned k,
+                      const git_oid *oid)
+{
+    uint64_t h;
+    unsigned char *block = bloom_block(bloom, nblocks, oid, &h);
+    for (unsigned i = 0; i < k; i++) {
+        if (i && i % 7 == 0)
+            h = mix64(h);
+        unsigned bit = (unsigned)(h & (BUP_BLOOM_BLOCK_BITS - 1));
+        h >>= 9;
+        /* other processes may set bits in the same shared mapping */
+        __atomic_fetch_or(&block[bit / 8], (unsigned char)(1u << (bit % 8)),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+int bup_chunk_index_maybe(const bup_chunk_index *idx, const git_oid *oid)
+{
+    if (!idx->bloom)
+        return 1;
+    uint64_t h;
+    const unsigned char *block = bloom_block(idx->bloom, idx->bloom_blocks,
+                                             oid, &h);
+    for (unsigned i = 0; i < idx->bloom_k; i++) {
+        if (i && i % 7 == 0)
+            h = mix64(h);
+        unsigned bit = (unsigned)(h & (BUP_BLOOM_BLOCK_BITS - 1));
+        h >>= 9;
+        if (!(block[bit / 8] & (1u << (bit % 8))))
+            return 0;
+    }
+    return 1;
+}
+
+/* Write a new chunks.bloom holding every indexed oid, sized for twice as
+ * many; skipped while another process rebuilds it */
+static int rebuild_bloom(bup_chunk_index *idx)
+{
+    uint64_t n = idx->count + idx->journal_count;
+    uint64_t capacity = n * 2 > BUP_BLOOM_MIN_CAPACITY ?
+                        n * 2 : BUP_BLOOM_MIN_CAPACITY;
+    double bits_per_entry = -log(idx->fp_rate) / (M_LN2 * M_LN2);
+    unsigned k = (unsigned)(bits_per_entry * M_LN2 + 0.5);
+    if (k < 1)
+        k = 1;
+    if (k > BUP_BLOOM_MAX_K)
+        k = BUP_BLOOM_MAX_K;
+    uint64_t nblocks = (uint64_t)(capacity * bits_per_entry /
+                                  BUP_BLOOM_BLOCK_BITS) + 1;
+    size_t size = BUP_BLOOM_HEADER_SIZE +
+                  (size_t)nblocks * (BUP_BLOOM_BLOCK_BITS / 8);
+
+    unsigned char *buf = calloc(1, size);
+    if (!buf)
+        return -1;
+    memcpy(buf, BUP_BLOOM_MAGIC, 8);
+    put_le(buf + 8, BUP_BLOOM_VERSION, 4);
+    put_le(buf + 12, k, 4);
+    put_le(buf + 16, nblocks, 8);
+    put_le(buf + 24, capacity, 8);
+    put_le(buf + 32, fp_ppb(idx->fp_rate), 4);
+    unsigned char *bloom = buf + BUP_BLOOM_HEADER_SIZE;
+    git_oid oid;
+    for (size_t i = 0; i < idx->count; i++) {
+        git_oid_fromraw(&oid, idx->oids + i * GIT_OID_RAWSZ);
+        bloom_set(bloom, nblocks, k, &oid);
+    }
+    for (size_t i = 0; i < idx->journal_count; i++) {
+        git_oid_fromraw(&oid, idx->journal + i * BUP_INDEX_ENTRY_SIZE);
+        bloom_set(bloom, nblocks, k, &oid);
+    }
+
+    int ret = -1;
+    char *lock_path = malloc(strlen(idx->bloom_path) + sizeof(".lock"));
+    if (!lock_path)
+        goto out;
+    sprintf(lock_path, "%s.lock", idx->bloom_path);
+    int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        ret = errno == EEXIST ? 0 : -1;
+        goto out;
+    }
+    if (write_all(fd, buf, size) < 0 || close(fd) < 0 ||
+        rename(lock_path, idx->bloom_path) < 0) {
+        unlink(lock_path);
+        goto out;
+    }
+    map_bloom(idx);
+    ret = 0;
+out:
+    free(lock_path);
+    free(buf);
+    return ret;
+}
+
+static int bloom_stale(const bup_chunk_index *idx)
+{
+    return !idx->bloom ||
+           get_le(idx->bloom_map + 32, 4) != fp_ppb(idx->fp_rate) ||
+           idx->count + idx->journal_count > idx->bloom_capacity;
+}
+
+/* Read all whole entries of chunks.log into a sorted array */
+static int read_journal(bup_chunk_index *idx, unsigned char **out,
+                        size_t *count, off_t *size)
+{
+    *out = NULL;
+    *count = 0;
+    *size = 0;
+    int fd = idx->log_fd >= 0 ? idx->log_fd : open(idx->log_path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    int ret = -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        goto out;
+    size_t n = (size_t)st.st_size / BUP_INDEX_ENTRY_SIZE;
+    unsigned char *buf = malloc(n ? n * BUP_INDEX_ENTRY_SIZE : 1);
+    if (!buf)
+        goto out;
+    size_t got = 0;
+    while (got < n * BUP_INDEX_ENTRY_SIZE) {
+        ssize_t r = pread(fd, buf + got, n * BUP_INDEX_ENTRY_SIZE - got,
+                          (off_t)got);
+        if (r <= 0) {
+            free(buf);
+            goto out;
+        }
+        got += (size_t)r;
+    }
+    qsort(buf, n, BUP_INDEX_ENTRY_SIZE, entry_cmp);
+    *out = buf;
+    *count = n;
+    *size = st.st_size;
+    ret = 0;
+out:
+    if (fd != idx->log_fd)
+        close(fd);
+    return ret;
+}
+
+int bup_chunk_index_open(bup_chunk_index *idx, const char *gitdir,
+                         double fp_rate)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->log_fd = -1;
+    idx->fp_rate = fp_rate > 0 ? fp_rate : BUP_BLOOM_FP_DEFAULT;
+    char *dir = join_path(gitdir, BUP_INDEX_DIR);
+    if (!dir)
+        return -1;
+    idx->idx_path = join_path(dir, BUP_INDEX_FILE);
+    idx->log_path = join_path(dir, BUP_INDEX_LOG);
+    idx->bloom_path = join_path(dir, BUP_BLOOM_FILE);
+    idx->pending = malloc(PENDING_MAX * BUP_INDEX_ENTRY_SIZE);
+    if (!idx->idx_path || !idx->log_path || !idx->bloom_path ||
+        !idx->pending) {
+        free(dir);
+        bup_chunk_index_close(idx);
+        return -1;
+    }
+    if (mkdir(dir, 0777) == 0 || errno == EEXIST)
+        idx->log_fd = open(idx->log_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(dir);
+    idx->bloom_writable = idx->log_fd >= 0;
+
+    map_index(idx);
+    off_t size;
+    if (read_journal(idx, &idx->journal, &idx->journal_count, &size) < 0)
+        idx->journal_count = 0;
+    map_bloom(idx);
+    if (idx->bloom_writable && bloom_stale(idx))
+        rebuild_bloom(idx);
+    /* a filter that misses indexed entries would hide them */
+    if (idx->bloom && idx->count + idx->journal_count > idx->bloom_capacity)
+        unmap_bloom(idx);
+    return 0;
+}
+
+static const unsigned char *search(const unsigned char *base, size_t lo,
+                                   size_t hi, size_t stride,
+                                   const unsigned char *key)
+{
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(base + mid * stride, key, GIT_OID_RAWSZ);
+        if (c == 0)
+            return base + mid * stride;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+int bup_chunk_index_find(const bup_chunk_index *idx, const git_oid *oid,
+                         size_t *len)
+{
+    if (!bup_chunk_index_maybe(idx, oid))
+        return 0;
+    if (idx->count) {
+        unsigned b = oid->id[0];
+        size_t lo = b ? idx->fanout[b - 1] : 0;
+        const unsigned char *p = search(idx->oids, lo, idx->fanout[b],
+                                        GIT_OID_RAWSZ, oid->id);
+        if (p) {
+            size_t i = (size_t)(p - idx->oids) / GIT_OID_RAWSZ;
+            *len = (size_t)get_le(idx->lens + i * 8, 8);
+            return 1;
+        }
+    }
+    const unsigned char *e = search(idx->journal, 0, idx->journal_count,
+                                    BUP_INDEX_ENTRY_SIZE, oid->id);
+    if (e) {
+        *len = (size_t)get_le(e + GIT_OID_RAWSZ, 8);
+        return 1;
+    }
+    return 0;
+}
+
+int bup_chunk_index_flush(bup_chunk_index *idx)
+{
+    size_t size = idx->npending * BUP_INDEX_ENTRY_SIZE;
+    idx->npending = 0;
+    if (idx->log_fd < 0 || size == 0)
+        return 0;
+    /* one write per flush keeps entries whole under O_APPEND */
+    ssize_t w = write(idx->log_fd, idx->pending, size);
+    return w == (ssize_t)size ? 0 : -1;
+}
+
+int bup_chunk_index_add(bup_chunk_index *idx, const git_oid *oid, size_t len)
+{
+    if (idx->log_fd < 0)
+        return 0;
+    unsigned char *e = idx->pending + idx->npending++ * BUP_INDEX_ENTRY_SIZE;
+    memcpy(e, oid->id, GIT_OID_RAWSZ);
+    put_le(e + GIT_OID_RAWSZ, len, 8);
+    if (idx->bloom_writable && idx->bloom)
+        bloom_set(idx->bloom, idx->bloom_blocks, idx->bloom_k, oid);
+    if (idx->npending == PENDING_MAX)
+        return bup_chunk_index_flush(idx);
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len) {
+        ssize_t w = write(fd, p, len);
+        if (w <= 0)
+            return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+int bup_chunk_index_merge(bup_chunk_index *idx)
+{
+    if (idx->log_fd < 0)
+        return 0;
+    if (bup_chunk_index_flush(idx) < 0)
+        return -1;
+
+    char *lock_path = malloc(strlen(idx->idx_path) + sizeof(".lock"));
+    if (!lock_path)
+        return -1;
+    sprintf(lock_path, "%s.lock", idx->idx_path);
+    int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        free(lock_path);
+        return errno == EEXIST ? 0 : -1;
+    }
+
+    int ret = -1;
+    unsigned char *journal = NULL, *out = NULL;
+    size_t jcount = 0;
+    off_t jsize = 0;
+    if (read_journal(idx, &journal, &jcount, &jsize) < 0)
+        goto fail;
+
+    size_t max = idx->count + jcount;
+    out = malloc(BUP_INDEX_HEADER_SIZE + 256 * 4 +
+                 max * BUP_INDEX_ENTRY_SIZE);
+    if (!out)
+        goto fail;
+    unsigned char *fan = out + BUP_INDEX_HEADER_SIZE;
+    unsigned char *oids = fan + 256 * 4;
+    unsigned char *lens = oids + max * GIT_OID_RAWSZ;
+    uint32_t fanout[256] = {0};
+    size_t i = 0, j = 0, n = 0;
+    while (i < idx->count || j < jcount) {
+        const unsigned char *a = i < idx->count ?
+                                 idx->oids + i * GIT_OID_RAWSZ : NULL;
+        const unsigned char *b = j < jcount ?
+                                 journal + j * BUP_INDEX_ENTRY_SIZE : NULL;
+        int c = !a ? 1 : !b ? -1 : memcmp(a, b, GIT_OID_RAWSZ);
+        const unsigned char *oid, *len;
+        if (c <= 0) {
+            oid = a;
+            len = idx->lens + i++ * 8;
+            if (c == 0)
+                j++;
+        } else {
+            oid = b;
+            len = b + GIT_OID_RAWSZ;
+            j++;
+        }
+        /* the log may repeat an entry */
+        if (n && memcmp(oids + (n - 1) * GIT_OID_RAWSZ, oid,
+                        GIT_OID_RAWSZ) == 0)
+            continue;
+        memcpy(oids + n * GIT_OID_RAWSZ, oid, GIT_OID_RAWSZ);
+        memcpy(lens + n * 8, len, 8);
+        fanout[oid[0]]++;
+        n++;
+    }
+    /* lengths were laid out for max entries; close the gap */
+    memmove(oids + n * GIT_OID_RAWSZ, lens, n * 8);
+    uint32_t sum = 0;
+    for (int k = 0; k < 256; k++) {
+        sum += fanout[k];
+        put_le(fan + k * 4, sum, 4);
+    }
+    memcpy(out, BUP_INDEX_MAGIC, BUP_INDEX_MAGIC_SIZE);
+    put_le(out + 8, BUP_INDEX_VERSION, 4);
+    put_le(out + 12, 0, 4);
+    put_le(out + 16, n, 8);
+
+    if (write_all(fd, out, BUP_INDEX_HEADER_SIZE + 256 * 4 +
+                  n * BUP_INDEX_ENTRY_SIZE) < 0 || fsync(fd) < 0)
+        goto fail;
+    close(fd);
+    fd = -1;
+    if (rename(lock_path, idx->idx_path) < 0)
+        goto fail;
+
+    /* entries appended by other processes meanwhile stay in the log */
+    struct stat st;
+    if (fstat(idx->log_fd, &st) == 0 && st.st_size == jsize)
+        ftruncate(idx->log_fd, 0);
+    map_index(idx);
+    free(idx->journal);
+    idx->journal = NULL;
+    idx->journal_count = 0;
+    if (idx->count > idx->bloom_capacity)
+        rebuild_bloom(idx);
+    ret = 0;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+        unlink(lock_path);
+    }
+    free(lock_path);
+    free(journal);
+    free(out);
+    return ret;
+}
+
+void bup_chunk_index_close(bup_chunk_index *idx)
+{
+    if (idx->log_fd >= 0) {
+        bup_chunk_index_flush(idx);
+        struct stat st;
+        if (fstat(idx->log_fd, &st) == 0) {
+            size_t logged = (size_t)st.st_size / BUP_INDEX_ENTRY_SIZE;
+            if (logged >= BUP_INDEX_MERGE_MIN && logged >= idx->count / 8)
+                bup_chunk_index_merge(idx);
+        }
+        close(idx->log_fd);
+    }
+    unmap_index(idx);
+    unmap_bloom(idx);
+    free(idx->journal);
+    free(idx->pending);
+    free(idx->idx_path);
+    free(idx->log_path);
+    free(idx->bloom_path);
+    memset(idx, 0, sizeof(*idx));
+    idx->log_fd = -1;
+}
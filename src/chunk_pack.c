@@ -0,0 +1,786 @@
+#include "chunk_pack.h"
+#include <git2/sys/odb_backend.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define PACK_HEADER_SIZE 12
+#define PACK_VERSION 2
+#define IDX_VERSION 2
+#define IDX_LARGE_OFFSET 0x80000000u
+#define PACK_READ_BLOCK (1u << 20)
+/* pending objects are looked up before the loose and pack backends */
+#define PENDING_PRIORITY 10
+
+/* SHA-1 for the pack and index trailers; libgit2 only hashes objects */
+typedef struct {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t n;
+} sha1_ctx;
+
+static uint32_t rol32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+#define SHA1_W(i) \
+    (w[(i) & 15] = rol32(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ \
+                         w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define SHA1_ROUND(f, k, wi) \
+    do { \
+        uint32_t t = rol32(a, 5) + (f) + e + (k) + (wi); \
+        e = d; \
+        d = c; \
+        c = rol32(b, 30); \
+        b = a; \
+        a = t; \
+    } while (0)
+
+/* The message schedule is kept in a ring of 16 words; one loop per round
+ * function keeps the compiler from branching inside the rounds */
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = get_be32(p + 4 * i);
+        SHA1_ROUND((b & c) | (~b & d), 0x5a827999, w[i]);
+    }
+    for (; i < 20; i++)
+        SHA1_ROUND((b & c) | (~b & d), 0x5a827999, SHA1_W(i));
+    for (; i < 40; i++)
+        SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1, SHA1_W(i));
+    for (; i < 60; i++)
+        SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdc, SHA1_W(i));
+    for (; i < 80; i++)
+        SHA1_ROUND(b ^ c ^ d, 0xca62c1d6, SHA1_W(i));
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void sha1_init(sha1_ctx *c)
+{
+    static const uint32_t init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+                                      0x10325476, 0xc3d2e1f0 };
+    memcpy(c->h, init, sizeof(init));
+    c->len = 0;
+    c->n = 0;
+}
+
+static void sha1_update(sha1_ctx *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    c->len += len;
+    if (c->n) {
+        size_t take = 64 - c->n < len ? 64 - c->n : len;
+        memcpy(c->buf + c->n, p, take);
+        c->n += take;
+        p += take;
+        len -= take;
+        if (c->n < 64)
+            return;
+        sha1_block(c->h, c->buf);
+        c->n = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha1_block(c->h, p);
+    memcpy(c->buf, p, len);
+    c->n = len;
+}
+
+static void sha1_final(sha1_ctx *c, unsigned char out[GIT_OID_RAWSZ])
+{
+    uint64_t bits = c->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (c->n < 56 ? 56 : 120) - c->n;
+    put_be64(pad + padlen, bits);
+    sha1_update(c, pad, padlen + 8);
+    for (int i = 0; i < 5; i++)
+        put_be32(out + 4 * i, c->h[i]);
+}
+
+typedef struct {
+    git_oid oid;
+    /* of the entry header; packed counts the header and deflated data */
+    uint64_t offset;
+    uint64_t packed;
+    uint32_t crc;
+    size_t size;
+    git_object_t type;
+    int indexed;
+} pack_entry;
+
+typedef struct {
+    git_odb_backend parent;
+    bup_pack_writer *writer;
+} pending_backend;
+
+struct bup_pack_writer {
+    pthread_mutex_t lock;
+    char *dir;
+    char *tmp_path;
+    /* -1 while no pack is open */
+    int fd;
+    uint64_t offset;
+    uint64_t max_size;
+    int level;
+    double store_entropy;
+    bup_compress_stats stats;
+    pack_entry *entries;
+    size_t count, cap;
+    /* open addressing over entry numbers + 1, 0 marking a free slot */
+    uint32_t *slots;
+    size_t nslots;
+    bup_chunk_index *index;
+    pthread_mutex_t *index_lock;
+    pending_backend *pending;
+    size_t packs;
+    /* set once an add or a finish fails: the open pack went with it, and
+     * objects its writers were told are stored are not, so every later
+     * call fails as well */
+    int failed;
+};
+
+static size_t find_slot(const bup_pack_writer *w, const git_oid *oid)
+{
+    uint64_t h;
+    memcpy(&h, oid->id, sizeof(h));
+    size_t i = (size_t)h & (w->nslots - 1);
+    while (w->slots[i] &&
+           git_oid_cmp(&w->entries[w->slots[i] - 1].oid, oid) != 0)
+        i = (i + 1) & (w->nslots - 1);
+    return i;
+}
+
+static pack_entry *find_entry(const bup_pack_writer *w, const git_oid *oid)
+{
+    if (!w->nslots)
+        return NULL;
+    size_t i = find_slot(w, oid);
+    return w->slots[i] ? &w->entries[w->slots[i] - 1] : NULL;
+}
+
+static int grow(bup_pack_writer *w)
+{
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        pack_entry *tmp = realloc(w->entries, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        w->entries = tmp;
+        w->cap = cap;
+    }
+    if ((w->count + 1) * 2 <= w->nslots)
+        return 0;
+    size_t n = w->nslots ? w->nslots * 2 : 2048;
+    uint32_t *slots = calloc(n, sizeof(*slots));
+    if (!slots)
+        return -1;
+    free(w->slots);
+    w->slots = slots;
+    w->nslots = n;
+    for (size_t i = 0; i < w->count; i++)
+        w->slots[find_slot(w, &w->entries[i].oid)] = (uint32_t)(i + 1);
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static char *tmp_name(const char *dir, const char *prefix)
+{
+    size_t len = strlen(dir) + strlen(prefix) + sizeof("/XXXXXX");
+    char *path = malloc(len);
+    if (path)
+        snprintf(path, len, "%s/%sXXXXXX", dir, prefix);
+    return path;
+}
+
+static int pack_begin(bup_pack_writer *w)
+{
+    w->tmp_path = tmp_name(w->dir, BUP_PACK_TMP_PREFIX);
+    if (!w->tmp_path)
+        return -1;
+    w->fd = mkstemp(w->tmp_path);
+    unsigned char header[PACK_HEADER_SIZE];
+    memcpy(header, "PACK", 4);
+    put_be32(header + 4, PACK_VERSION);
+    put_be32(header + 8, 0);
+    if (w->fd < 0 || write_all(w->fd, header, sizeof(header)) < 0) {
+        if (w->fd >= 0) {
+            close(w->fd);
+            unlink(w->tmp_path);
+        }
+        w->fd = -1;
+        free(w->tmp_path);
+        w->tmp_path = NULL;
+        return -1;
+    }
+    w->offset = PACK_HEADER_SIZE;
+    return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const pack_entry *x = *(pack_entry *const *)a;
+    const pack_entry *y = *(pack_entry *const *)b;
+    return git_oid_cmp(&x->oid, &y->oid);
+}
+
+/* Version 2 index: fanout, sorted oids, CRCs, 31-bit offsets with larger
+ * ones in a 64-bit table, then the pack and index checksums */
+static int write_idx(bup_pack_writer *w, int fd,
+                     const unsigned char pack_sum[GIT_OID_RAWSZ])
+{
+    size_t n = w->count;
+    pack_entry **sorted = malloc((n ? n : 1) * sizeof(*sorted));
+    if (!sorted)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        sorted[i] = &w->entries[i];
+    qsort(sorted, n, sizeof(*sorted), entry_cmp);
+
+    size_t nlarge = 0;
+    for (size_t i = 0; i < n; i++)
+        nlarge += sorted[i]->offset >= IDX_LARGE_OFFSET;
+    size_t size = 8 + 256 * 4 + n * (GIT_OID_RAWSZ + 8) + nlarge * 8 +
+                  2 * GIT_OID_RAWSZ;
+    unsigned char *buf = calloc(1, size);
+    if (!buf) {
+        free(sorted);
+        return -1;
+    }
+    unsigned char *p = buf;
+    memcpy(p, "\377tOc", 4);
+    put_be32(p + 4, IDX_VERSION);
+    unsigned char *fan = p + 8;
+    unsigned char *oids = fan + 256 * 4;
+    unsigned char *crcs = oids + n * GIT_OID_RAWSZ;
+    unsigned char *offsets = crcs + n * 4;
+    unsigned char *large = offsets + n * 4;
+    uint32_t counts[256] = {0};
+    size_t l = 0;
+    for (size_t i = 0; i < n; i++) {
+        const pack_entry *e = sorted[i];
+        counts[e->oid.id[0]]++;
+        memcpy(oids + i * GIT_OID_RAWSZ, e->oid.id, GIT_OID_RAWSZ);
+        put_be32(crcs + i * 4, e->crc);
+        if (e->offset < IDX_LARGE_OFFSET) {
+            put_be32(offsets + i * 4, (uint32_t)e->offset);
+        } else {
+            put_be32(offsets + i * 4, IDX_LARGE_OFFSET | (uint32_t)l);
+            put_be64(large + l++ * 8, e->offset);
+        }
+    }
+    uint32_t sum = 0;
+    for (int i = 0; i < 256; i++) {
+        sum += counts[i];
+        put_be32(fan + i * 4, sum);
+    }
+    unsigned char *trailer = large + nlarge * 8;
+    memcpy(trailer, pack_sum, GIT_OID_RAWSZ);
+    sha1_ctx c;
+    sha1_init(&c);
+    sha1_update(&c, buf, size - GIT_OID_RAWSZ);
+    sha1_final(&c, trailer + GIT_OID_RAWSZ);
+
+    int ret = write_all(fd, buf, size);
+    free(buf);
+    free(sorted);
+    return ret;
+}
+
+/* Checksum the pack as written; the object count in its header is only
+ * known now */
+static int pack_checksum(bup_pack_writer *w, unsigned char out[GIT_OID_RAWSZ])
+{
+    unsigned char count[4];
+    put_be32(count, (uint32_t)w->count);
+    if (pwrite(w->fd, count, 4, 8) != 4)
+        return -1;
+    unsigned char *buf = malloc(PACK_READ_BLOCK);
+    if (!buf)
+        return -1;
+    sha1_ctx c;
+    sha1_init(&c);
+    int ret = 0;
+    for (uint64_t ofs = 0; ofs < w->offset && ret == 0;) {
+        size_t n = w->offset - ofs < PACK_READ_BLOCK ?
+                   (size_t)(w->offset - ofs) : PACK_READ_BLOCK;
+        ret = read_all(w->fd, buf, n, ofs);
+        sha1_update(&c, buf, n);
+        ofs += n;
+    }
+    free(buf);
+    sha1_final(&c, out);
+    if (ret == 0 && pwrite(w->fd, out, GIT_OID_RAWSZ, (off_t)w->offset) !=
+                    GIT_OID_RAWSZ)
+        ret = -1;
+    return ret;
+}
+
+static void pack_reset(bup_pack_writer *w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+    free(w->tmp_path);
+    w->tmp_path = NULL;
+    w->offset = 0;
+    w->count = 0;
+    if (w->slots)
+        memset(w->slots, 0, w->nslots * sizeof(*w->slots));
+}
+
+/* Called with w->lock held. Drop the open pack and its objects for good. */
+static void pack_fail(bup_pack_writer *w)
+{
+    if (w->fd >= 0)
+        unlink(w->tmp_path);
+    pack_reset(w);
+    w->failed = 1;
+}
+
+/* Called with w->lock held. The .idx is renamed last, so readers never
+ * find an index without its pack. */
+static int pack_finish(bup_pack_writer *w)
+{
+    if (w->failed)
+        return -1;
+    if (w->fd < 0)
+        return 0;
+    if (!w->count) {
+        unlink(w->tmp_path);
+        pack_reset(w);
+        return 0;
+    }
+    int ret = -1;
+    char *idx_tmp = tmp_name(w->dir, BUP_PACK_TMP_PREFIX);
+    int idx_fd = -1;
+    unsigned char sum[GIT_OID_RAWSZ];
+    if (!idx_tmp || pack_checksum(w, sum) < 0 ||
+        (idx_fd = mkstemp(idx_tmp)) < 0)
+        goto out;
+    if (write_idx(w, idx_fd, sum) < 0 || fsync(idx_fd) < 0 ||
+        fsync(w->fd) < 0)
+        goto out;
+    fchmod(w->fd, 0444);
+    fchmod(idx_fd, 0444);
+
+    git_oid name;
+    git_oid_fromraw(&name, sum);
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &name);
+    size_t len = strlen(w->dir) + sizeof("/pack-.pack") + GIT_OID_HEXSZ;
+    char *pack_path = malloc(len), *idx_path = malloc(len);
+    if (pack_path && idx_path) {
+        snprintf(pack_path, len, "%s/pack-%s.pack", w->dir, hex);
+        snprintf(idx_path, len, "%s/pack-%s.idx", w->dir, hex);
+        if (rename(w->tmp_path, pack_path) == 0) {
+            if (rename(idx_tmp, idx_path) == 0)
+                ret = 0;
+            else
+                unlink(pack_path);
+        }
+    }
+    free(pack_path);
+    free(idx_path);
+    if (ret < 0)
+        goto out;
+
+    w->packs++;
+    if (w->index) {
+        if (w->index_lock)
+            pthread_mutex_lock(w->index_lock);
+        for (size_t i = 0; i < w->count; i++)
+            if (w->entries[i].indexed)
+                bup_chunk_index_add(w->index, &w->entries[i].oid,
+                                    w->entries[i].size);
+        bup_chunk_index_flush(w->index);
+        if (w->index_lock)
+            pthread_mutex_unlock(w->index_lock);
+    }
+
+out:
+    if (idx_fd >= 0)
+        close(idx_fd);
+    if (ret < 0 && idx_tmp)
+        unlink(idx_tmp);
+    free(idx_tmp);
+    if (ret < 0)
+        pack_fail(w);
+    else
+        pack_reset(w);
+    return ret;
+}
+
+static void count_bytes(uint32_t counts[4][256], const unsigned char *p,
+                        size_t len)
+{
+    size_t i = 0;
+    /* four tables, so that runs of one byte do not stall on a counter */
+    for (; i + 4 <= len; i += 4) {
+        counts[0][p[i]]++;
+        counts[1][p[i + 1]]++;
+        counts[2][p[i + 2]]++;
+        counts[3][p[i + 3]]++;
+    }
+    for (; i < len; i++)
+        counts[0][p[i]]++;
+}
+
+double bup_byte_entropy(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t counts[4][256] = {{0}};
+    size_t n = len;
+    if (len <= BUP_ENTROPY_SAMPLE) {
+        count_bytes(counts, p, len);
+    } else {
+        size_t windows = BUP_ENTROPY_SAMPLE / BUP_ENTROPY_WINDOW;
+        size_t step = (len - BUP_ENTROPY_WINDOW) / (windows - 1);
+        for (size_t i = 0; i < windows; i++)
+            count_bytes(counts, p + i * step, BUP_ENTROPY_WINDOW);
+        n = BUP_ENTROPY_SAMPLE;
+    }
+    if (!n)
+        return 0;
+    double sum = 0;
+    for (int b = 0; b < 256; b++) {
+        double c = (double)counts[0][b] + counts[1][b] + counts[2][b] +
+                   counts[3][b];
+        if (c > 0)
+            sum += c * log2(c);
+    }
+    double h = log2((double)n) - sum / (double)n;
+    return h > 0 ? h : 0;
+}
+
+static uint64_t thread_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Object type and size, as in every pack entry header */
+static size_t entry_header(unsigned char *p, git_object_t type, size_t len)
+{
+    size_t n = 0;
+    unsigned char c = (unsigned char)(((unsigned)type << 4) | (len & 15));
+    len >>= 4;
+    while (len) {
+        p[n++] = c | 0x80;
+        c = len & 0x7f;
+        len >>= 7;
+    }
+    p[n++] = c;
+    return n;
+}
+
+int bup_pack_writer_add(bup_pack_writer *w, const git_oid *oid,
+                        git_object_t type, const void *data, size_t len,
+                        int indexed)
+{
+    unsigned char header[16];
+    size_t hlen = entry_header(header, type, len);
+    uLongf zlen = compressBound((uLong)len);
+    unsigned char *buf = malloc(hlen + zlen);
+    if (!buf)
+        return -1;
+    memcpy(buf, header, hlen);
+    uint64_t t0 = thread_ns();
+    int level = w->level;
+    if (level && bup_byte_entropy(data, len) >= w->store_entropy)
+        level = 0;
+    uint64_t t1 = thread_ns();
+    if (compress2(buf + hlen, &zlen, data, (uLong)len, level) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    uint64_t t2 = thread_ns();
+    size_t total = hlen + zlen;
+    uint32_t crc = (uint32_t)crc32_z(0, buf, total);
+
+    int ret = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->failed) {
+        ret = -1;
+    } else if (find_entry(w, oid)) {
+        /* another thread stored it first */
+    } else if ((w->fd < 0 && pack_begin(w) < 0) || grow(w) < 0 ||
+               write_all(w->fd, buf, total) < 0) {
+        pack_fail(w);
+        ret = -1;
+    } else {
+        pack_entry *e = &w->entries[w->count];
+        git_oid_cpy(&e->oid, oid);
+        e->offset = w->offset;
+        e->packed = total;
+        e->crc = crc;
+        e->size = len;
+        e->type = type;
+        e->indexed = indexed;
+        w->slots[find_slot(w, oid)] = (uint32_t)++w->count;
+        w->offset += total;
+        w->stats.objects++;
+        w->stats.stored += level == 0;
+        w->stats.bytes_in += len;
+        w->stats.bytes_out += zlen;
+        w->stats.estimate_ns += t1 - t0;
+        w->stats.deflate_ns += t2 - t1;
+        if (w->offset >= w->max_size)
+            ret = pack_finish(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(buf);
+    return ret;
+}
+
+/* Inflate a pending object from the open pack */
+static int pending_read(void **buffer, size_t *len, git_object_t *type,
+                        git_odb_backend *backend, const git_oid *oid)
+{
+    bup_pack_writer *w = ((pending_backend *)backend)->writer;
+    if (!w)
+        return GIT_ENOTFOUND;
+    pthread_mutex_lock(&w->lock);
+    const pack_entry *e = find_entry(w, oid);
+    if (!e) {
+        pthread_mutex_unlock(&w->lock);
+        return GIT_ENOTFOUND;
+    }
+    pack_entry entry = *e;
+    unsigned char *packed = malloc(entry.packed);
+    int ret = packed ? read_all(w->fd, packed, entry.packed, entry.offset) : -1;
+    pthread_mutex_unlock(&w->lock);
+
+    unsigned char *out = ret == 0 ? malloc(entry.size ? entry.size : 1) : NULL;
+    if (out) {
+        size_t hlen = 1;
+        while (packed[hlen - 1] & 0x80)
+            hlen++;
+        uLongf size = (uLongf)entry.size;
+        if (uncompress(out, &size, packed + hlen,
+                       (uLong)(entry.packed - hlen)) != Z_OK ||
+            size != entry.size) {
+            free(out);
+            out = NULL;
+        }
+    }
+    free(packed);
+    if (!out)
+        return -1;
+    *buffer = out;
+    *len = entry.size;
+    *type = entry.type;
+    return 0;
+}
+
+static int pending_read_header(size_t *len, git_object_t *type,
+                               git_odb_backend *backend, const git_oid *oid)
+{
+    bup_pack_writer *w = ((pending_backend *)backend)->writer;
+    if (!w)
+        return GIT_ENOTFOUND;
+    pthread_mutex_lock(&w->lock);
+    const pack_entry *e = find_entry(w, oid);
+    if (e) {
+        *len = e->size;
+        *type = e->type;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return e ? 0 : GIT_ENOTFOUND;
+}
+
+static int pending_exists(git_odb_backend *backend, const git_oid *oid)
+{
+    bup_pack_writer *w = ((pending_backend *)backend)->writer;
+    if (!w)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    int found = find_entry(w, oid) != NULL;
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/* A scan; short oids are rare and the pending pack is bounded */
+static int pending_exists_prefix(git_oid *out, git_odb_backend *backend,
+                                 const git_oid *short_id, size_t len)
+{
+    bup_pack_writer *w = ((pending_backend *)backend)->writer;
+    if (!w)
+        return GIT_ENOTFOUND;
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < w->count && found < 2; i++) {
+        if (git_oid_ncmp(&w->entries[i].oid, short_id, len) == 0) {
+            git_oid_cpy(out, &w->entries[i].oid);
+            found++;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found == 1 ? 0 : found ? GIT_EAMBIGUOUS : GIT_ENOTFOUND;
+}
+
+static void pending_free(git_odb_backend *backend)
+{
+    pending_backend *p = (pending_backend *)backend;
+    if (p->writer)
+        p->writer->pending = NULL;
+    free(p);
+}
+
+int bup_pack_writer_new(bup_pack_writer **out, git_odb *odb,
+                        const char *objects_dir,
+                        const bup_pack_params *params,
+                        bup_chunk_index *index, pthread_mutex_t *index_lock)
+{
+    bup_pack_writer *w = calloc(1, sizeof(*w));
+    pending_backend *p = calloc(1, sizeof(*p));
+    size_t len = strlen(objects_dir) + sizeof("/pack");
+    if (w)
+        w->dir = malloc(len);
+    if (!w || !p || !w->dir) {
+        if (w)
+            free(w->dir);
+        free(w);
+        free(p);
+        return -1;
+    }
+    snprintf(w->dir, len, "%s/pack", objects_dir);
+    mkdir(w->dir, 0777);
+    w->fd = -1;
+    w->max_size = params->max_size;
+    w->level = params->level;
+    w->store_entropy = params->store_entropy;
+    w->index = index;
+    w->index_lock = index_lock;
+    pthread_mutex_init(&w->lock, NULL);
+
+    p->parent.version = GIT_ODB_BACKEND_VERSION;
+    p->parent.read = pending_read;
+    p->parent.read_header = pending_read_header;
+    p->parent.exists = pending_exists;
+    p->parent.exists_prefix = pending_exists_prefix;
+    p->parent.free = pending_free;
+    p->writer = w;
+    if (git_odb_add_backend(odb, &p->parent, PENDING_PRIORITY) < 0) {
+        pthread_mutex_destroy(&w->lock);
+        free(w->dir);
+        free(w);
+        free(p);
+        return -1;
+    }
+    w->pending = p;
+    *out = w;
+    return 0;
+}
+
+int bup_pack_writer_flush(bup_pack_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    int ret = pack_finish(w);
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+int bup_pack_writer_failed(bup_pack_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    int failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return failed;
+}
+
+size_t bup_pack_writer_packs(bup_pack_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    size_t n = w->packs;
+    pthread_mutex_unlock(&w->lock);
+    return n;
+}
+
+void bup_pack_writer_stats(bup_pack_writer *w, bup_compress_stats *out)
+{
+    pthread_mutex_lock(&w->lock);
+    *out = w->stats;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int bup_pack_writer_free(bup_pack_writer *w)
+{
+    if (!w)
+        return 0;
+    int ret = bup_pack_writer_flush(w);
+    /* the odb still owns the pending backend; it now finds nothing */
+    if (w->pending)
+        w->pending->writer = NULL;
+    pthread_mutex_destroy(&w->lock);
+    free(w->entries);
+    free(w->slots);
+    free(w->dir);
+    free(w);
+    return ret;
+}
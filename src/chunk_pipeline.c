@@ -0,0 +1,191 @@
+#include "chunk_pipeline.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Queued chunks per worker thread */
+#define PIPELINE_JOBS_PER_THREAD 32
+
+enum { JOB_QUEUED, JOB_DONE };
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    void *owned;
+    git_oid oid;
+    int state;
+} pipeline_job;
+
+/* Jobs live in a ring indexed by sequence number: [head, next) are being
+ * stored or done, [next, tail) wait for a worker. Only the caller's
+ * thread advances head and tail. */
+struct bup_pipeline {
+    git_odb *odb;
+    bup_chunk_pool *pool;
+    bup_list_writer *list;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t *threads;
+    unsigned nthreads;
+    pipeline_job *ring;
+    size_t ring_size;
+    size_t head, next, tail;
+    size_t inflight, max_inflight;
+    int stop;
+    int error;
+};
+
+unsigned bup_pipeline_threads(const bup_pipeline_params *params)
+{
+    unsigned n = params->threads;
+    if (!n) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    return n > BUP_PIPELINE_MAX_THREADS ? BUP_PIPELINE_MAX_THREADS : n;
+}
+
+/* Hash a chunk and store it unless the pool or index already has it */
+static int pipeline_store(bup_pipeline *p, pipeline_job *job)
+{
+    return chunk_pool_put(p->odb, p->pool, job->data, job->len, &job->oid);
+}
+
+static void *pipeline_worker(void *arg)
+{
+    bup_pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->next == p->tail && !p->stop)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (p->next == p->tail)
+            break;
+        pipeline_job *job = &p->ring[p->next++ % p->ring_size];
+        /* after a failure the remaining jobs are only retired */
+        int skip = p->error;
+        pthread_mutex_unlock(&p->lock);
+        int ret = skip ? 0 : pipeline_store(p, job);
+        pthread_mutex_lock(&p->lock);
+        if (ret < 0)
+            p->error = 1;
+        job->state = JOB_DONE;
+        pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* List the finished chunks at the head of the ring, in order. Called and
+ * returns with the lock held. */
+static void pipeline_emit(bup_pipeline *p)
+{
+    while (p->head < p->tail && !p->error &&
+           p->ring[p->head % p->ring_size].state == JOB_DONE) {
+        pipeline_job job = p->ring[p->head++ % p->ring_size];
+        p->inflight -= job.len;
+        pthread_mutex_unlock(&p->lock);
+        int ret = bup_list_writer_add(p->list, &job.oid, job.len);
+        free(job.owned);
+        pthread_mutex_lock(&p->lock);
+        if (ret < 0)
+            p->error = 1;
+    }
+}
+
+int bup_pipeline_start(bup_pipeline **out, git_odb *odb, bup_chunk_pool *pool,
+                       bup_list_writer *list,
+                       const bup_pipeline_params *params)
+{
+    if (!pool->lock)
+        return -1;
+    bup_pipeline *p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->odb = odb;
+    p->pool = pool;
+    p->list = list;
+    p->max_inflight = params->max_inflight;
+    unsigned n = bup_pipeline_threads(params);
+    p->ring_size = (size_t)n * PIPELINE_JOBS_PER_THREAD;
+    p->ring = calloc(p->ring_size, sizeof(*p->ring));
+    p->threads = calloc(n, sizeof(*p->threads));
+    if (!p->ring || !p->threads) {
+        free(p->ring);
+        free(p->threads);
+        free(p);
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (; p->nthreads < n; p->nthreads++)
+        if (pthread_create(&p->threads[p->nthreads], NULL, pipeline_worker,
+                           p) != 0)
+            break;
+    if (!p->nthreads) {
+        bup_pipeline_finish(p);
+        return -1;
+    }
+    *out = p;
+    return 0;
+}
+
+int bup_pipeline_push(bup_pipeline *p, const void *data, size_t len,
+                      int owned)
+{
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        pipeline_emit(p);
+        if (p->error)
+            break;
+        /* a single chunk larger than the limit still gets through */
+        if (p->tail - p->head < p->ring_size &&
+            (p->head == p->tail || p->inflight + len <= p->max_inflight))
+            break;
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    if (p->error) {
+        pthread_mutex_unlock(&p->lock);
+        if (owned)
+            free((void *)data);
+        return -1;
+    }
+    pipeline_job *job = &p->ring[p->tail++ % p->ring_size];
+    job->data = data;
+    job->len = len;
+    job->owned = owned ? (void *)data : NULL;
+    job->state = JOB_QUEUED;
+    p->inflight += len;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int bup_pipeline_finish(bup_pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        pipeline_emit(p);
+        if (p->error || p->head == p->tail)
+            break;
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (unsigned i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+
+    int ret = p->error ? -1 : 0;
+    for (; p->head < p->tail; p->head++)
+        free(p->ring[p->head % p->ring_size].owned);
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p->threads);
+    free(p->ring);
+    free(p);
+    return ret;
+}
@@ -0,0 +1,208 @@
+#include "chunk_prefetch.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Chunks [consumed, next) are claimed by readers. A filling prefetch
+ * copies each chunk to dest + offsets[i]; a streaming one parks it in
+ * slots[i % depth] until the reader takes it, so readers never claim a
+ * chunk depth or more past the one being waited for. */
+struct bup_prefetch {
+    git_odb *odb;
+    bup_chunk_cache *cache;
+    const git_oid *oids;
+    const size_t *lens;
+    size_t count;
+    char *dest;
+    uint64_t *offsets;
+    git_odb_object **slots;
+    size_t depth;
+    size_t next, consumed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t *threads;
+    unsigned nthreads;
+    int stop;
+    int error;
+};
+
+unsigned bup_prefetch_threads(const bup_prefetch_params *params, size_t count)
+{
+    unsigned n = params->threads;
+    if (!n) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if (n > BUP_PREFETCH_MAX_THREADS)
+        n = BUP_PREFETCH_MAX_THREADS;
+    size_t useful = count / BUP_PREFETCH_CHUNKS_PER_THREAD;
+    if (n > useful)
+        n = useful ? (unsigned)useful : 1;
+    return n;
+}
+
+static void *prefetch_worker(void *arg)
+{
+    bup_prefetch *p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && !p->error && p->next < p->count && !p->dest &&
+               p->next >= p->consumed + p->depth)
+            pthread_cond_wait(&p->space, &p->lock);
+        if (p->stop || p->error || p->next >= p->count)
+            break;
+        size_t i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        git_odb_object *obj = NULL;
+        int ret = bup_chunk_cache_read(&obj, p->cache, p->odb, &p->oids[i]);
+        if (ret == 0 && git_odb_object_size(obj) != p->lens[i])
+            ret = -1;
+        if (ret == 0 && p->dest) {
+            memcpy(p->dest + p->offsets[i], git_odb_object_data(obj),
+                   p->lens[i]);
+            git_odb_object_free(obj);
+            obj = NULL;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (ret < 0) {
+            git_odb_object_free(obj);
+            p->error = 1;
+            pthread_cond_broadcast(&p->space);
+        } else if (!p->dest) {
+            p->slots[i % p->depth] = obj;
+        }
+        pthread_cond_broadcast(&p->ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static bup_prefetch *prefetch_new(git_odb *odb, bup_chunk_cache *cache,
+                                  const git_oid *oids, const size_t *lens,
+                                  size_t count)
+{
+    bup_prefetch *p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->odb = odb;
+    p->cache = cache;
+    p->oids = oids;
+    p->lens = lens;
+    p->count = count;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    pthread_cond_init(&p->space, NULL);
+    return p;
+}
+
+static int prefetch_spawn(bup_prefetch *p, unsigned n)
+{
+    p->threads = calloc(n ? n : 1, sizeof(*p->threads));
+    if (!p->threads)
+        return -1;
+    for (; p->nthreads < n; p->nthreads++)
+        if (pthread_create(&p->threads[p->nthreads], NULL, prefetch_worker,
+                           p) != 0)
+            break;
+    return 0;
+}
+
+static void prefetch_release(bup_prefetch *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->space);
+    pthread_mutex_unlock(&p->lock);
+    for (unsigned i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+    if (p->slots)
+        for (size_t i = 0; i < p->depth; i++)
+            git_odb_object_free(p->slots[i]);
+    pthread_cond_destroy(&p->space);
+    pthread_cond_destroy(&p->ready);
+    pthread_mutex_destroy(&p->lock);
+    free(p->threads);
+    free(p->slots);
+    free(p->offsets);
+    free(p);
+}
+
+int bup_prefetch_fill(git_odb *odb, bup_chunk_cache *cache,
+                      const git_oid *oids, const size_t *lens, size_t count,
+                      char *dest, const bup_prefetch_params *params)
+{
+    bup_prefetch *p = prefetch_new(odb, cache, oids, lens, count);
+    if (!p)
+        return -1;
+    p->dest = dest;
+    p->offsets = malloc(sizeof(*p->offsets) * (count ? count : 1));
+    if (!p->offsets) {
+        prefetch_release(p);
+        return -1;
+    }
+    uint64_t ofs = 0;
+    for (size_t i = 0; i < count; i++) {
+        p->offsets[i] = ofs;
+        ofs += lens[i];
+    }
+    if (prefetch_spawn(p, bup_prefetch_threads(params, count) - 1) < 0) {
+        prefetch_release(p);
+        return -1;
+    }
+    prefetch_worker(p);
+    int ret = p->error ? -1 : 0;
+    prefetch_release(p);
+    return ret;
+}
+
+int bup_prefetch_start(bup_prefetch **out, git_odb *odb,
+                       bup_chunk_cache *cache, const git_oid *oids,
+                       const size_t *lens, size_t count,
+                       const bup_prefetch_params *params)
+{
+    bup_prefetch *p = prefetch_new(odb, cache, oids, lens, count);
+    if (!p)
+        return -1;
+    p->depth = params->read_ahead ? params->read_ahead : 1;
+    p->slots = calloc(p->depth, sizeof(*p->slots));
+    if (!p->slots ||
+        prefetch_spawn(p, bup_prefetch_threads(params, count)) < 0 ||
+        !p->nthreads) {
+        prefetch_release(p);
+        return -1;
+    }
+    *out = p;
+    return 0;
+}
+
+int bup_prefetch_next(bup_prefetch *p, git_odb_object **obj)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->consumed >= p->count) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    git_odb_object **slot = &p->slots[p->consumed % p->depth];
+    while (!p->error && !*slot)
+        pthread_cond_wait(&p->ready, &p->lock);
+    if (!*slot) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    *obj = *slot;
+    *slot = NULL;
+    p->consumed++;
+    pthread_cond_broadcast(&p->space);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+void bup_prefetch_free(bup_prefetch *p)
+{
+    if (p)
+        prefetch_release(p);
+}
@@ -2,6 +2,11 @@
 #include "bup_odb.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BUP_HAVE_X86 1
+#endif
 
 static int chunk_count = 0;
 static size_t chunk_total_size = 0;
@@ -14,11 +19,55 @@ size_t chunk_pool_total_size(void) {
     return chunk_total_size;
 }
 
-static bup_chunk *find_chunk(bup_chunk *pool, const git_oid *oid) {
-    for (bup_chunk *c = pool; c; c = c->next)
-        if (git_oid_cmp(&c->oid, oid) == 0)
-            return c;
-    return NULL;
+#define CHUNK_POOL_MIN_SLOTS 1024
+
+/* oids are uniformly distributed, so their first bytes are a good hash */
+static size_t chunk_slot(const git_oid *oid, size_t nslots)
+{
+    size_t h = (size_t)oid->id[0] << 24 | (size_t)oid->id[1] << 16 |
+               (size_t)oid->id[2] << 8 | oid->id[3];
+    if (sizeof(size_t) > 4)
+        h = h << 32 | (size_t)oid->id[4] << 24 | (size_t)oid->id[5] << 16 |
+            (size_t)oid->id[6] << 8 | oid->id[7];
+    return h & (nslots - 1);
+}
+
+/* Return the slot holding oid, or the free slot where it belongs */
+static size_t find_slot(const bup_chunk_pool *pool, const git_oid *oid)
+{
+    size_t i = chunk_slot(oid, pool->nslots);
+    while (pool->slots[i] &&
+           git_oid_cmp(&pool->chunks[pool->slots[i] - 1].oid, oid) != 0)
+        i = (i + 1) & (pool->nslots - 1);
+    return i;
+}
+
+static int chunk_pool_grow(bup_chunk_pool *pool)
+{
+    if (pool->count == pool->cap) {
+        size_t cap = pool->cap ? pool->cap * 2 : CHUNK_POOL_MIN_SLOTS / 2;
+        if (cap >= UINT32_MAX)
+            return -1;
+        bup_chunk *chunks = realloc(pool->chunks, sizeof(*chunks) * cap);
+        if (!chunks)
+            return -1;
+        pool->chunks = chunks;
+        pool->cap = cap;
+    }
+    /* keep the load factor at or below one half */
+    if ((pool->count + 1) * 2 <= pool->nslots)
+        return 0;
+
+    size_t nslots = pool->nslots ? pool->nslots * 2 : CHUNK_POOL_MIN_SLOTS;
+    uint32_t *slots = calloc(nslots, sizeof(*slots));
+    if (!slots)
+        return -1;
+    free(pool->slots);
+    pool->slots = slots;
+    pool->nslots = nslots;
+    for (size_t k = 0; k < pool->count; k++)
+        slots[find_slot(pool, &pool->chunks[k].oid)] = (uint32_t)(k + 1);
+    return 0;
 }
 
 void rollsum_init(Rollsum *r) {
@@ -33,61 +82,723 @@ void rollsum_roll(Rollsum *r, uint8_t c) {
     r->s1 += c - drop;
     r->s2 += r->s1 - (BUP_WINDOWSIZE * (drop + BUP_ROLL_BASE));
     r->window[r->wofs] = c;
-    r->wofs = (r->wofs + 1) % BUP_WINDOWSIZE;
+    r->wofs = (r->wofs + 1) & (BUP_WINDOWSIZE - 1);
 }
 
 uint32_t rollsum_digest(const Rollsum *r) {
     return (r->s1 << BUP_ROLL_SHIFT) | (r->s2 & BUP_ROLL_MASK);
 }
 
-static bup_chunk *chunk_create(git_odb *odb, const void *data, size_t len) {
-    git_oid oid;
-    if (git_odb_write(&oid, odb, data, len, GIT_OBJECT_BLOB) < 0)
+/* The rollsum state is a function of the window alone:
+ *   s1 = W*B + sum(w[j]),  s2 = W*(W-1)*B + sum((W-j) * w[j])
+ * with w[0] the oldest byte. Recomputing it from the window lets the
+ * scanner jump over bytes whose digest can never produce a cut. */
+static void rollsum_from_window(Rollsum *r)
+{
+    unsigned s1 = BUP_WINDOWSIZE * BUP_ROLL_BASE;
+    unsigned s2 = BUP_WINDOWSIZE * (BUP_WINDOWSIZE - 1) * BUP_ROLL_BASE;
+    for (unsigned j = 0; j < BUP_WINDOWSIZE; j++) {
+        uint8_t c = r->window[(r->wofs + j) & (BUP_WINDOWSIZE - 1)];
+        s1 += c;
+        s2 += (BUP_WINDOWSIZE - j) * c;
+    }
+    r->s1 = s1;
+    r->s2 = s2;
+}
+
+/* Advance r over buf[from, to) */
+static void rollsum_skip(Rollsum *r, const uint8_t *buf, size_t from, size_t to)
+{
+    if (to - from < BUP_WINDOWSIZE) {
+        for (size_t i = from; i < to; i++)
+            rollsum_roll(r, buf[i]);
+        return;
+    }
+    memcpy(r->window, buf + to - BUP_WINDOWSIZE, BUP_WINDOWSIZE);
+    r->wofs = 0;
+    rollsum_from_window(r);
+}
+
+#define DIGEST_HIT(s1, s2, mask) \
+    (((((s1) << BUP_ROLL_SHIFT) | ((s2) & BUP_ROLL_MASK)) & (mask)) == 0)
+
+/* A kernel rolls buf[start, end) into r and returns the index of the first
+ * byte after which the digest hits the mask, or end. The state includes
+ * that byte on return. Vector kernels require start >= BUP_WINDOWSIZE so
+ * the dropped bytes can be read from buf instead of the window. */
+typedef size_t (*rollsum_kernel)(Rollsum *r, const uint8_t *buf,
+                                 size_t start, size_t end, uint32_t mask);
+
+static size_t scan_scalar(Rollsum *r, const uint8_t *buf, size_t start,
+                          size_t end, uint32_t mask)
+{
+    for (size_t i = start; i < end; i++) {
+        rollsum_roll(r, buf[i]);
+        if (DIGEST_HIT(r->s1, r->s2, mask))
+            return i;
+    }
+    return end;
+}
+
+/* Store a state computed by a vector kernel after rolling buf[.., stop) */
+static void rollsum_store(Rollsum *r, const uint8_t *buf, size_t stop,
+                          unsigned s1, unsigned s2)
+{
+    r->s1 = s1;
+    r->s2 = s2;
+    memcpy(r->window, buf + stop - BUP_WINDOWSIZE, BUP_WINDOWSIZE);
+    r->wofs = 0;
+}
+
+/* Finish a vector scan that stopped before byte i, reading the dropped
+ * bytes straight from buf. */
+static size_t scan_tail(Rollsum *r, const uint8_t *buf, size_t i, size_t end,
+                        uint32_t mask, unsigned s1, unsigned s2)
+{
+    for (; i < end; i++) {
+        uint8_t drop = buf[i - BUP_WINDOWSIZE];
+        s1 += buf[i] - drop;
+        s2 += s1 - (BUP_WINDOWSIZE * (drop + BUP_ROLL_BASE));
+        if (DIGEST_HIT(s1, s2, mask)) {
+            rollsum_store(r, buf, i + 1, s1, s2);
+            return i;
+        }
+    }
+    rollsum_store(r, buf, end, s1, s2);
+    return end;
+}
+
+#ifdef BUP_HAVE_X86
+/* Both vector kernels evaluate the rollsum recurrence for several bytes at
+ * once as prefix sums: s1[i] = s1[i-1] + (c[i] - d[i]) and
+ * s2[i] = s2[i-1] + s1[i] - W*(d[i] + B), all modulo 2^32. */
+static size_t scan_sse2(Rollsum *r, const uint8_t *buf, size_t start,
+                        size_t end, uint32_t mask)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i base = _mm_set1_epi32(BUP_WINDOWSIZE * BUP_ROLL_BASE);
+    const __m128i vmask = _mm_set1_epi32((int)mask);
+    const __m128i lo16 = _mm_set1_epi32(BUP_ROLL_MASK);
+    __m128i s1 = _mm_set1_epi32((int)r->s1);
+    __m128i s2 = _mm_set1_epi32((int)r->s2);
+    size_t i = start;
+
+    for (; i + 4 <= end; i += 4) {
+        int32_t cw, dw;
+        memcpy(&cw, buf + i, 4);
+        memcpy(&dw, buf + i - BUP_WINDOWSIZE, 4);
+        __m128i c = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(cw), zero), zero);
+        __m128i d = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(dw), zero), zero);
+
+        __m128i x = _mm_sub_epi32(c, d);
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        __m128i v1 = _mm_add_epi32(s1, x);
+
+        __m128i y = _mm_sub_epi32(v1, _mm_add_epi32(
+            _mm_slli_epi32(d, BUP_WINDOWBITS), base));
+        y = _mm_add_epi32(y, _mm_slli_si128(y, 4));
+        y = _mm_add_epi32(y, _mm_slli_si128(y, 8));
+        __m128i v2 = _mm_add_epi32(s2, y);
+
+        __m128i dig = _mm_or_si128(_mm_slli_epi32(v1, BUP_ROLL_SHIFT),
+                                   _mm_and_si128(v2, lo16));
+        int hits = _mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_and_si128(dig, vmask), zero)));
+        if (hits) {
+            int k = __builtin_ctz((unsigned)hits);
+            uint32_t a[4], b[4];
+            _mm_storeu_si128((__m128i *)a, v1);
+            _mm_storeu_si128((__m128i *)b, v2);
+            rollsum_store(r, buf, i + k + 1, a[k], b[k]);
+            return i + k;
+        }
+        s1 = _mm_shuffle_epi32(v1, _MM_SHUFFLE(3, 3, 3, 3));
+        s2 = _mm_shuffle_epi32(v2, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    return scan_tail(r, buf, i, end, mask,
+                     (unsigned)_mm_cvtsi128_si32(s1),
+                     (unsigned)_mm_cvtsi128_si32(s2));
+}
+
+__attribute__((target("avx2")))
+static __m256i prefix8_epi32(__m256i x)
+{
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i carry = _mm256_permutevar8x32_epi32(
+        x, _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3));
+    return _mm256_add_epi32(x, _mm256_blend_epi32(carry,
+                                                  _mm256_setzero_si256(), 0x0f));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(Rollsum *r, const uint8_t *buf, size_t start,
+                        size_t end, uint32_t mask)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi32(7);
+    const __m256i base = _mm256_set1_epi32(BUP_WINDOWSIZE * BUP_ROLL_BASE);
+    const __m256i vmask = _mm256_set1_epi32((int)mask);
+    const __m256i lo16 = _mm256_set1_epi32(BUP_ROLL_MASK);
+    __m256i s1 = _mm256_set1_epi32((int)r->s1);
+    __m256i s2 = _mm256_set1_epi32((int)r->s2);
+    size_t i = start;
+
+    for (; i + 8 <= end; i += 8) {
+        __m256i c = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(buf + i)));
+        __m256i d = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *)(buf + i - BUP_WINDOWSIZE)));
+
+        __m256i v1 = _mm256_add_epi32(s1, prefix8_epi32(_mm256_sub_epi32(c, d)));
+        __m256i y = _mm256_sub_epi32(v1, _mm256_add_epi32(
+            _mm256_slli_epi32(d, BUP_WINDOWBITS), base));
+        __m256i v2 = _mm256_add_epi32(s2, prefix8_epi32(y));
+
+        __m256i dig = _mm256_or_si256(_mm256_slli_epi32(v1, BUP_ROLL_SHIFT),
+                                      _mm256_and_si256(v2, lo16));
+        int hits = _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(_mm256_and_si256(dig, vmask), zero)));
+        if (hits) {
+            int k = __builtin_ctz((unsigned)hits);
+            uint32_t a[8], b[8];
+            _mm256_storeu_si256((__m256i *)a, v1);
+            _mm256_storeu_si256((__m256i *)b, v2);
+            rollsum_store(r, buf, i + k + 1, a[k], b[k]);
+            return i + k;
+        }
+        s1 = _mm256_permutevar8x32_epi32(v1, last);
+        s2 = _mm256_permutevar8x32_epi32(v2, last);
+    }
+    unsigned last1 = (unsigned)_mm256_cvtsi256_si32(s1);
+    unsigned last2 = (unsigned)_mm256_cvtsi256_si32(s2);
+    /* gcc only clears the upper halves on the return above; this path
+     * calls scan_tail, which is not VEX encoded, and returns through it,
+     * so their SSE instructions would pay for the dirty state */
+    _mm256_zeroupper();
+    return scan_tail(r, buf, i, end, mask, last1, last2);
+}
+#endif
+
+static const struct {
+    const char *name;
+    rollsum_kernel fn;
+} kernels[] = {
+    { "scalar", scan_scalar },
+#ifdef BUP_HAVE_X86
+    { "sse2", scan_sse2 },
+    { "avx2", scan_avx2 },
+#endif
+};
+
+static int kernel_idx = -1;
+
+static int kernel_supported(size_t i)
+{
+#ifdef BUP_HAVE_X86
+    if (kernels[i].fn == scan_sse2)
+        return __builtin_cpu_supports("sse2");
+    if (kernels[i].fn == scan_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    (void)i;
+    return 1;
+}
+
+/* Writers on several threads may pick the kernel at once; they all
+ * settle on the same one */
+static int current_kernel(void)
+{
+    int idx = __atomic_load_n(&kernel_idx, __ATOMIC_RELAXED);
+    if (idx < 0) {
+        idx = 0;
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+            if (kernel_supported(i))
+                idx = (int)i;
+        __atomic_store_n(&kernel_idx, idx, __ATOMIC_RELAXED);
+    }
+    return idx;
+}
+
+static rollsum_kernel select_kernel(void)
+{
+    return kernels[current_kernel()].fn;
+}
+
+const char *rollsum_kernel_name(void)
+{
+    return kernels[current_kernel()].name;
+}
+
+int rollsum_set_kernel(const char *name)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            if (!kernel_supported(i))
+                return -1;
+            __atomic_store_n(&kernel_idx, (int)i, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t scan_range(rollsum_kernel kernel, Rollsum *r, const uint8_t *buf,
+                         size_t start, size_t end, uint32_t mask)
+{
+    /* the first window's worth of bytes drops from r->window */
+    if (start < BUP_WINDOWSIZE) {
+        size_t head = end < BUP_WINDOWSIZE ? end : BUP_WINDOWSIZE;
+        size_t hit = scan_scalar(r, buf, start, head, mask);
+        if (hit < head)
+            return hit;
+        if (head == end)
+            return end;
+        start = head;
+    }
+    return kernel(r, buf, start, end, mask);
+}
+
+size_t bup_find_cuts(Rollsum *r, size_t *chunk_len,
+                     const bup_split_params *params,
+                     const uint8_t *buf, size_t len,
+                     size_t *cuts, size_t ncuts)
+{
+    rollsum_kernel kernel = select_kernel();
+    size_t n = 0;
+    size_t pos = 0;    /* next byte not yet assigned to a chunk */
+    size_t rolled = 0; /* bytes of buf already rolled into r */
+
+    while (pos < len && n < ncuts) {
+        size_t have = *chunk_len;
+        /* only the digests at chunk lengths [min, max] matter */
+        size_t first = pos + (have + 1 >= params->min_chunk ?
+                              0 : params->min_chunk - have - 1);
+        size_t forced = pos + (params->max_chunk - have) - 1;
+        if (first >= len) {
+            *chunk_len += len - pos;
+            pos = len;
+            break;
+        }
+        rollsum_skip(r, buf, rolled, first);
+        size_t end = forced < len ? forced + 1 : len;
+        size_t hit = scan_range(kernel, r, buf, first, end, params->mask);
+        if (hit == end && forced >= len) {
+            rolled = len;
+            *chunk_len += len - pos;
+            pos = len;
+            break;
+        }
+        if (hit == end)
+            hit = forced;
+        rolled = hit + 1;
+        cuts[n++] = hit + 1;
+        *chunk_len = 0;
+        pos = hit + 1;
+    }
+    rollsum_skip(r, buf, rolled, pos);
+    return n;
+}
+
+static void rollsum_engine_init(bup_chunker *c)
+{
+    rollsum_init(&c->u.rollsum);
+}
+
+static size_t rollsum_engine_feed(bup_chunker *c, const uint8_t *buf,
+                                  size_t len, size_t *cuts, size_t ncuts)
+{
+    return bup_find_cuts(&c->u.rollsum, &c->chunk_len, &c->params, buf, len,
+                         cuts, ncuts);
+}
+
+const bup_chunker_engine bup_chunker_rollsum = {
+    "rollsum", rollsum_engine_init, rollsum_engine_feed
+};
+
+/* Fixed gear table (splitmix64 seeded with "bup-gear"). Changing it changes
+ * every FastCDC cut point, so it is part of the repository format. */
+static const uint64_t gear_table[256] = {
+    0x00cbd8ab471b18beULL, 0x8ce08affa1a363acULL, 0x5712f69fcc5f4d72ULL,
+    0xdc00b60257a5f942ULL, 0x1e36e4ba22e251f3ULL, 0x7dca06e347485f37ULL,
+    0x149784dc7df53de9ULL, 0xbe49e556f98b6d44ULL, 0x5c71a714abf247d6ULL,
+    0xabc992e73e4fe9c9ULL, 0xaf9459a9a9eb4e41ULL, 0x8439266457b13fdcULL,
+    0x792411a7f0bcb50dULL, 0x73b303a3d810193cULL, 0x081ca8123589665fULL,
+    0x62e9c42da60a426eULL, 0xace55b7b28540eadULL, 0xa86557ccdcefabf7ULL,
+    0x94be65b3fd762250ULL, 0x26dc66b7aa97196cULL, 0xddc8de49a8fffd53ULL,
+    0x6bed36cc2bb664b8ULL, 0x5a6b4f852dafade0ULL, 0x9c2423a9ce740309ULL,
+    0x7f96d8db4785030dULL, 0xdd9fa928b94264a6ULL, 0xa61d4619f07ca179ULL,
+    0x1d269bb3af07ea50ULL, 0x11a3dd6a37944b5fULL, 0x120dda5cd0243d4bULL,
+    0xebf87a6c58c764d2ULL, 0xd8cd5a2bbcbf5e4fULL, 0x238d47f1fb002c9dULL,
+    0xf0894dc45a1e6339ULL, 0x6cae8435d069465fULL, 0xf28b6b73f44cd15cULL,
+    0x60343ca5cfa176e3ULL, 0x39497999a5845eebULL, 0x0bb3ab94fc7482b5ULL,
+    0x93d56199a87f6befULL, 0x240a09ecce11e413ULL, 0xbba7a5d3b4c531d8ULL,
+    0x074ef09888828cf6ULL, 0x30e0e1f49b3e56a1ULL, 0x9001a523658eaba2ULL,
+    0x028ba3a6ddbc2dccULL, 0xe414c83c5ed35085ULL, 0x8927f4b78424636cULL,
+    0x2f99ba5cbbac8ea2ULL, 0x6d73dd8b2f9b5c44ULL, 0x3c0aa8d886c00a92ULL,
+    0x13b452cd0fb6a929ULL, 0x88a603af9c93dcdbULL, 0x39725222977c0d7aULL,
+    0xfe78c14edbe947c9ULL, 0x0461fdcbdd344a74ULL, 0x06bc8700f0c3ae4eULL,
+    0x18a1c04f9aff00b9ULL, 0x4f6a113cbfd1b9b4ULL, 0x01be418826e97ba3ULL,
+    0x3dc3b2ce4bc511e2ULL, 0xddff251afe396074ULL, 0xa9fa05069aa34effULL,
+    0xbd885a5e4a41eff1ULL, 0xe6b8fbfedffe0613ULL, 0x46af9fe921097ee5ULL,
+    0x259148c3384e1d56ULL, 0x7f61b02a095761ffULL, 0x3c320ab11d6d1f83ULL,
+    0x11258140fe842ef0ULL, 0x0bb1667597bd4002ULL, 0xc539fc51faa7f98cULL,
+    0x3ac609def6d8a9a5ULL, 0x9c0a0c5ef8654997ULL, 0xe39c4b63dd74e1f7ULL,
+    0x937befca9dbd7822ULL, 0x7fc63b84545cd4e8ULL, 0x39d21c53526384c7ULL,
+    0x890370530df99338ULL, 0xfe1b4f721c8515bfULL, 0x3f03099e0e290022ULL,
+    0x5300853fa69cf527ULL, 0xfeada20b14823dcfULL, 0xbed5eb7d26a408e6ULL,
+    0x5ce300b939bbf8f7ULL, 0x311b26e8f59fe331ULL, 0x770de9240e36676aULL,
+    0x11415cb6552d2db6ULL, 0xef924e240225fb70ULL, 0xdd7c99ff68285322ULL,
+    0x874bc1c235aff7d9ULL, 0x0fb56ebd2b1f59feULL, 0x62d299da269ff47aULL,
+    0x5f4ea1383314092bULL, 0x00426a24acffd9dbULL, 0x93ceca9591e87b5dULL,
+    0xf7d30047d9346ceeULL, 0x52129ab47a99523eULL, 0xe033bbd69cea1b9bULL,
+    0x9497af6bdf3add62ULL, 0x70883257e54d1254ULL, 0x6a1fdd0e837c118eULL,
+    0xdfcf4553e769b386ULL, 0x265347dbba25c1e1ULL, 0x8e5391faf1ade250ULL,
+    0xe171ba1f3c8e2903ULL, 0xa7a856a961153de6ULL, 0x9119baca3ba52526ULL,
+    0x74b22f03de22cbf9ULL, 0x5ff2f0563d7cb935ULL, 0xbbde7b2c598df7f8ULL,
+    0x83d2199eded51c78ULL, 0xc953891e62448da3ULL, 0x0de0c7c1ef0fe863ULL,
+    0x0980b753a35d2dd7ULL, 0x19888766f6c323f1ULL, 0x1fe0c933db3ca576ULL,
+    0x42fdb22eb747e327ULL, 0x085bba0ea2775ba6ULL, 0x3f7c19b3b7f39f82ULL,
+    0xfe4ec617cb6cdc1eULL, 0xf2a9e69449c6d1b9ULL, 0x989dd0e07684d8acULL,
+    0xc7fda08014aeca0bULL, 0xc221a246c6ef01f8ULL, 0x836718e58954876cULL,
+    0x6f59a91dfc941047ULL, 0xd902cd9890a8242fULL, 0x9ececef2bae51ff7ULL,
+    0x311331ede7cb4a6eULL, 0x615c3924bf00f294ULL, 0x60c5a29372bb3219ULL,
+    0xde4d32c996933d73ULL, 0x4350ec0a02e2a97cULL, 0x6dce4ff8aa8183dfULL,
+    0x36681540010ad4d2ULL, 0xffefaadb72e80605ULL, 0xcb87f299849b7532ULL,
+    0x7f35aa5e03d875f0ULL, 0xc618684099628b8cULL, 0x6d697f14faf42c5aULL,
+    0x3bbe0da010eeaf5bULL, 0xa4b02d3c5740a006ULL, 0x1cc81ff3d23cdaf9ULL,
+    0x89d4c165c74d6dc9ULL, 0x2a289002e0739819ULL, 0x1f34dbb1588183e9ULL,
+    0x3010591b8985d8baULL, 0x730b14638b4d8d33ULL, 0xf25ff5f8c0547112ULL,
+    0x253ee74ef3640d5eULL, 0x94dca481bf72b763ULL, 0xcb6d6d54aea439ebULL,
+    0x18b6ab3218450d31ULL, 0x1ea8168cd50d9877ULL, 0xf64c3655a62076a0ULL,
+    0xc0089c73433f6d36ULL, 0x6a931b1c7a8b7c79ULL, 0x6eeb31ac267af8f4ULL,
+    0x6ab71c39ecc73947ULL, 0x463f3df3ba7dd559ULL, 0xc791081d04f7cc7bULL,
+    0x84b1d17980e91738ULL, 0x5982524b549ee239ULL, 0xe111639b4e77cf06ULL,
+    0x16a6942987a6a339ULL, 0x2ec9856bde53a357ULL, 0x0a661f78a305947cULL,
+    0x18cb3ab9f186278dULL, 0xc7bd67eb28ccfaabULL, 0x5089d90f7275b3a0ULL,
+    0x74e1a4fe337cc875ULL, 0x7c70cc3a4439397dULL, 0x82201e067d6f0c5fULL,
+    0x969eeec0d254ff56ULL, 0x863d343c5db75f6cULL, 0xdd3975c3759fa0c8ULL,
+    0x3b0f5852c19353f1ULL, 0x03a7c6c0fbdff05eULL, 0x206f4bcd47f8258aULL,
+    0x36f392c85d4ca04bULL, 0xe1bfb5d9cd0b2d94ULL, 0xab9d89b0d97a0753ULL,
+    0x27a68eff01d2dd8aULL, 0x42eb60321be691c9ULL, 0x68c854927bc39066ULL,
+    0x2a62f174b4a83c6aULL, 0xc82c6d5f137244d3ULL, 0x66a3fe09ae66fd3bULL,
+    0x2987a9272d65a92aULL, 0x66135bb1c3ef0127ULL, 0x65ee3ea57f2e1d5bULL,
+    0xea5845191e435170ULL, 0x83faaf75b425002eULL, 0xb7400cf10de60bd5ULL,
+    0xe39b81ffb4dc1c47ULL, 0x8ad191dd4c442b81ULL, 0x212aeb5ccf34bb1cULL,
+    0x1ab14fd4aa18a03aULL, 0x310d1010ea82d90eULL, 0x1c1812700d8eb29dULL,
+    0xa69098791a35c3bcULL, 0x1adfbd3236de7f4eULL, 0x9148c17b95b8f3f6ULL,
+    0x2e653f141f50daf2ULL, 0xce11a0c64e5af154ULL, 0xfe3c70f75165c253ULL,
+    0x544ad769f6521a78ULL, 0x7106e92eefb980f6ULL, 0x2015ca54a3fc6542ULL,
+    0x9b5a5fc98a6be4b4ULL, 0x3cd07b74a84789e4ULL, 0x7925a0aacfac01c5ULL,
+    0xa4d9fbbaf0775015ULL, 0xb5bec096d4f72556ULL, 0x6ba55b08388512e7ULL,
+    0x2addbe1d01bb3b5dULL, 0x6f3425a289c01174ULL, 0x82698ef1debd08c3ULL,
+    0x21b2abdac616c45cULL, 0x6f690ae44526c310ULL, 0x13588ac3a43536baULL,
+    0x06467518887e9821ULL, 0xbec765f9a1447ebcULL, 0x8a9cc7ca327913c6ULL,
+    0x0d170efaeda3efa9ULL, 0x725532d81436d95cULL, 0xeae502dd0b3c634eULL,
+    0x21ff186abe5ca489ULL, 0x2edce1809bf78fe6ULL, 0xd0873f358bfe5d91ULL,
+    0x1a63dd1033d1de83ULL, 0xe1908269a51c1bedULL, 0xb8047a0f26ef0475ULL,
+    0xe18740b27693aecdULL, 0x091e8c295cf83cd1ULL, 0x9c53e876e6fb017aULL,
+    0xc70b647ebb4e57aeULL, 0xb4da0f045b5b979dULL, 0x0b88b776fc8695c5ULL,
+    0xd4cacee7ee8f7e9bULL, 0xfa2eedde1a694a7bULL, 0x330f87da9ddf7a26ULL,
+    0x4734cbffc056b226ULL, 0x23bc3a083ed15cabULL, 0xc5cbc9d66ff62f3bULL,
+    0x9b15718af8554f9cULL, 0x1abd2a7b473a413cULL, 0xbb13faff92142c2fULL,
+    0xaa49a92757033a7cULL, 0x7f5c98f43006d6cdULL, 0x4f4199d8c18537d5ULL,
+    0x27f8a05d95c71960ULL, 0x2339f1d47e03e506ULL, 0x818a284a81dbad88ULL,
+    0xb87bafd103533a88ULL,
+};
+
+/* The gear hash shifts one bit per byte, so its top bits depend on the
+ * last 64 bytes only. Masks therefore select high bits, and hashing
+ * starts 64 bytes before min_chunk so that no hash state is carried over
+ * from the previous chunk. Cut points still depend on where the chunk
+ * started: the first min_chunk bytes are never cut, and the mask
+ * switches from mask_s to mask_l at the average size. */
+#define GEAR_WINDOW 64
+
+static uint64_t gear_mask(unsigned bits)
+{
+    if (bits < 1)
+        bits = 1;
+    if (bits > 63)
+        bits = 63;
+    return ~0ULL << (64 - bits);
+}
+
+static void gear_roll(uint64_t *fp, const uint8_t *buf, size_t i, size_t end)
+{
+    uint64_t h = *fp;
+    for (; i < end; i++)
+        h = (h << 1) + gear_table[buf[i]];
+    *fp = h;
+}
+
+static size_t gear_scan(uint64_t *fp, const uint8_t *buf, size_t i,
+                        size_t end, uint64_t mask)
+{
+    uint64_t h = *fp;
+    for (; i < end; i++) {
+        h = (h << 1) + gear_table[buf[i]];
+        if (!(h & mask))
+            break;
+    }
+    *fp = h;
+    return i;
+}
+
+static void fastcdc_engine_init(bup_chunker *c)
+{
+    c->u.gear = 0;
+}
+
+static size_t fastcdc_engine_feed(bup_chunker *c, const uint8_t *buf,
+                                  size_t len, size_t *cuts, size_t ncuts)
+{
+    const size_t min = c->params.min_chunk;
+    const size_t max = c->params.max_chunk;
+    const size_t avg = (size_t)c->params.mask + 1;
+    const unsigned bits = (unsigned)__builtin_ctzll(avg);
+    /* normalized chunking: harder to cut before avg, easier after */
+    const uint64_t mask_s = gear_mask(bits + 2);
+    /* bits is at least 1; keep bits - 2 from wrapping at avg 2 or 4 */
+    const uint64_t mask_l = gear_mask(bits > 2 ? bits - 2 : 1);
+    const size_t hash_from = min > GEAR_WINDOW ? min - GEAR_WINDOW : 0;
+    size_t n = 0;
+    size_t pos = 0;
+
+    while (pos < len && n < ncuts) {
+        size_t have = c->chunk_len;
+        size_t left = len - pos;
+        size_t step;
+
+        if (have < hash_from) {
+            step = hash_from - have < left ? hash_from - have : left;
+            c->chunk_len += step;
+            pos += step;
+            continue;
+        }
+        if (have + 1 < min) {
+            step = min - 1 - have < left ? min - 1 - have : left;
+            gear_roll(&c->u.gear, buf, pos, pos + step);
+            c->chunk_len += step;
+            pos += step;
+            continue;
+        }
+
+        size_t limit = max;
+        uint64_t mask = mask_l;
+        if (have + 1 < avg && avg - 1 < max) {
+            limit = avg - 1;
+            mask = mask_s;
+        }
+        step = limit - have < left ? limit - have : left;
+        size_t hit = gear_scan(&c->u.gear, buf, pos, pos + step, mask);
+        if (hit < pos + step) {
+            pos = hit + 1;
+        } else {
+            c->chunk_len += step;
+            pos += step;
+            if (c->chunk_len < max)
+                continue;
+        }
+        cuts[n++] = pos;
+        c->chunk_len = 0;
+        c->u.gear = 0;
+    }
+    return n;
+}
+
+const bup_chunker_engine bup_chunker_fastcdc = {
+    "fastcdc", fastcdc_engine_init, fastcdc_engine_feed
+};
+
+const bup_chunker_engine *bup_chunker_engine_by_name(const char *name)
+{
+    if (strcmp(name, bup_chunker_rollsum.name) == 0)
+        return &bup_chunker_rollsum;
+    if (strcmp(name, bup_chunker_fastcdc.name) == 0)
+        return &bup_chunker_fastcdc;
+    return NULL;
+}
+
+void bup_chunker_init(bup_chunker *c, const bup_chunker_engine *engine,
+                      const bup_split_params *params)
+{
+    c->engine = engine;
+    c->params = *params;
+    c->chunk_len = 0;
+    engine->init(c);
+}
+
+size_t bup_chunker_feed(bup_chunker *c, const uint8_t *buf, size_t len,
+                        size_t *cuts, size_t ncuts)
+{
+    return c->engine->feed(c, buf, len, cuts, ncuts);
+}
+
+bup_chunk *chunk_pool_find(const bup_chunk_pool *pool, const git_oid *oid)
+{
+    if (!pool->nslots)
         return NULL;
+    size_t i = find_slot(pool, oid);
+    return pool->slots[i] ? &pool->chunks[pool->slots[i] - 1] : NULL;
+}
+
+int chunk_pool_indexed(const bup_chunk_pool *pool, const git_oid *oid,
+                       size_t len)
+{
+    size_t indexed_len;
+    return pool->index && bup_chunk_index_find(pool->index, oid, &indexed_len) &&
+           indexed_len == len;
+}
 
-    bup_chunk *c = malloc(sizeof(*c));
-    if (!c)
+int chunk_pool_store(git_odb *odb, const bup_chunk_pool *pool,
+                     const git_oid *oid, const void *data, size_t len)
+{
+    if (!pool->store && !pool->pack) {
+        git_oid written;
+        return git_odb_write(&written, odb, data, len, GIT_OBJECT_BLOB);
+    }
+    /* what git_odb_write() would check before storing: neither the pool
+     * nor the index lists the chunk, but a pack written by other tools,
+     * an alternate or a lost index may still hold it */
+    if (git_odb_exists(odb, oid))
+        return 0;
+    if (pool->pack)
+        return bup_pack_writer_add(pool->pack, oid, GIT_OBJECT_BLOB, data,
+                                   len, 1);
+    return pool->store->write(pool->store, oid, data, len, GIT_OBJECT_BLOB);
+}
+
+bup_chunk *chunk_pool_insert(bup_chunk_pool *pool, const git_oid *oid,
+                             size_t len, int stored)
+{
+    bup_chunk *c = chunk_pool_find(pool, oid);
+    if (c)
+        return c;
+    if (chunk_pool_grow(pool) < 0)
         return NULL;
+    /* the index is only a cache; failing to extend it costs a rewrite.
+     * Packed chunks are indexed by the pack writer. */
+    if (stored && pool->index && !pool->pack)
+        bup_chunk_index_add(pool->index, oid, len);
 
-    git_oid_cpy(&c->oid, &oid);
+    c = &pool->chunks[pool->count];
+    git_oid_cpy(&c->oid, oid);
     c->len = len;
-    c->next = NULL;
+    pool->slots[find_slot(pool, oid)] = (uint32_t)++pool->count;
+    pool->total += len;
     chunk_total_size += len;
     chunk_count++;
     return c;
 }
 
-bup_chunk *chunk_get_or_create(git_odb *odb, bup_chunk **pool,
+static void pool_lock(bup_chunk_pool *pool)
+{
+    if (pool->lock)
+        pthread_mutex_lock(pool->lock);
+}
+
+static void pool_unlock(bup_chunk_pool *pool)
+{
+    if (pool->lock)
+        pthread_mutex_unlock(pool->lock);
+}
+
+int chunk_pool_wanted(bup_chunk_pool *pool, const git_oid *oid, size_t len)
+{
+    pool_lock(pool);
+    int wanted = !chunk_pool_find(pool, oid) &&
+                 !chunk_pool_indexed(pool, oid, len);
+    pool_unlock(pool);
+    return wanted;
+}
+
+int chunk_pool_add(bup_chunk_pool *pool, const git_oid *oid, size_t len,
+                   int stored)
+{
+    pool_lock(pool);
+    bup_chunk *c = chunk_pool_insert(pool, oid, len, stored);
+    pool_unlock(pool);
+    return c ? 0 : -1;
+}
+
+/* A chunk whose fingerprint is known and which the pool or index already
+ * has is listed without SHA-1. One that has to be stored is hashed
+ * regardless, so an object is never written under an unverified oid. */
+static int fingerprint_lookup(bup_chunk_pool *pool, const unsigned char *fp,
+                              size_t len, git_oid *oid, int *verify)
+{
+    if (!bup_fp_cache_find(pool->fingerprints, fp, len, oid, verify))
+        return 0;
+    return *verify || !chunk_pool_wanted(pool, oid, len) ? 1 : -1;
+}
+
+/* The store runs outside the lock; two threads racing on one new chunk
+ * both write it, which the loose backend tolerates */
+int chunk_pool_put(git_odb *odb, bup_chunk_pool *pool, const void *data,
+                   size_t len, git_oid *oid)
+{
+    /* the pool may list chunks that were lost with a failed pack */
+    if (pool->pack && bup_pack_writer_failed(pool->pack))
+        return -1;
+    unsigned char fp[BUP_FP_SIZE];
+    git_oid known;
+    int found = 0, verify = 0;
+    int use_fp = pool->fingerprints &&
+                 bup_fp_cache_enabled(pool->fingerprints);
+    if (use_fp) {
+        bup_fingerprint(pool->fingerprints, data, len, fp);
+        found = fingerprint_lookup(pool, fp, len, &known, &verify);
+        if (found > 0 && !verify) {
+            git_oid_cpy(oid, &known);
+            return chunk_pool_add(pool, oid, len, 0);
+        }
+    }
+
+    if (git_odb_hash(oid, data, len, GIT_OBJECT_BLOB) < 0)
+        return -1;
+    if (found && git_oid_cmp(oid, &known) != 0)
+        bup_fp_cache_correct(pool->fingerprints, fp, len, oid);
+    else if (!found && use_fp)
+        bup_fp_cache_add(pool->fingerprints, fp, len, oid);
+    int stored = chunk_pool_wanted(pool, oid, len);
+    if (stored && chunk_pool_store(odb, pool, oid, data, len) < 0)
+        return -1;
+    return chunk_pool_add(pool, oid, len, stored);
+}
+
+bup_chunk *chunk_get_or_create(git_odb *odb, bup_chunk_pool *pool,
                                const void *data, size_t len) {
     git_oid oid;
-    if (git_odb_hash(&oid, data, len, GIT_OBJECT_BLOB) < 0)
+    if (chunk_pool_put(odb, pool, data, len, &oid) < 0)
         return NULL;
-    bup_chunk *c = find_chunk(*pool, &oid);
-    if (c)
-        return c;
-
-    c = chunk_create(odb, data, len);
-    if (!c)
-        return NULL;
-    c->next = *pool;
-    *pool = c;
-    return c;
+    return chunk_pool_find(pool, &oid);
 }
 
-void chunk_pool_free(bup_chunk **pool) {
-    bup_chunk *c = *pool;
-    while (c) {
-        bup_chunk *next = c->next;
-        chunk_total_size -= c->len;
-        chunk_count--;
-        free(c);
-        c = next;
-    }
-    *pool = NULL;
+void chunk_pool_free(bup_chunk_pool *pool) {
+    chunk_total_size -= pool->total;
+    chunk_count -= (int)pool->count;
+    free(pool->chunks);
+    free(pool->slots);
+    bup_chunk_index *index = pool->index;
+    git_odb_backend *store = pool->store;
+    bup_pack_writer *pack = pool->pack;
+    bup_fp_cache *fingerprints = pool->fingerprints;
+    pthread_mutex_t *lock = pool->lock;
+    memset(pool, 0, sizeof(*pool));
+    pool->index = index;
+    pool->store = store;
+    pool->pack = pack;
+    pool->fingerprints = fingerprints;
+    pool->lock = lock;
 }
 
-int parse_chunk_list(const char *data, size_t size, git_oid **oids,
-                     size_t **lengths, size_t *count) {
+static int parse_entries(const char *data, size_t size, git_oid **oids,
+                         size_t **lengths, size_t *count)
+{
     const char *ptr = data;
     const char *end = data + size;
     size_t n = 0;
@@ -136,33 +847,670 @@ fail:
     return -1;
 }
 
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+int bup_list_encode(char **out, size_t *out_len, unsigned level,
+                    const git_oid *oids, const size_t *lengths, size_t count,
+                    unsigned flags)
+{
+    if (count > UINT32_MAX)
+        return -1;
+    size_t per_len = (flags & BUP_LIST_OFFSETS) ? 8 : 10;
+    unsigned char *buf = malloc(BUP_LIST_HEADER_SIZE +
+                                count * (GIT_OID_RAWSZ + per_len));
+    if (!buf)
+        return -1;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += lengths[i];
+    memcpy(buf, BUP_LIST_MAGIC, BUP_LIST_MAGIC_SIZE);
+    buf[8] = BUP_LIST_VERSION;
+    buf[9] = (unsigned char)level;
+    buf[10] = (unsigned char)flags;
+    buf[11] = 0;
+    put_le(buf + 12, count, 4);
+    put_le(buf + 16, total, 8);
+
+    unsigned char *p = buf + BUP_LIST_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, p += GIT_OID_RAWSZ)
+        memcpy(p, oids[i].id, GIT_OID_RAWSZ);
+    uint64_t ofs = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (flags & BUP_LIST_OFFSETS) {
+            put_le(p, ofs, 8);
+            p += 8;
+            ofs += lengths[i];
+            continue;
+        }
+        uint64_t v = lengths[i];
+        do {
+            *p++ = (unsigned char)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+            v >>= 7;
+        } while (v);
+    }
+
+    *out = (char *)buf;
+    *out_len = (size_t)(p - buf);
+    return 0;
+}
+
+static int parse_binary_node(const unsigned char *data, size_t size,
+                             unsigned *level, git_oid **oids,
+                             size_t **lengths, size_t *count)
+{
+    if (data[8] != BUP_LIST_VERSION || data[9] > BUP_FANOUT_MAX_LEVEL ||
+        (data[10] & ~BUP_LIST_OFFSETS) || data[11])
+        return -1;
+    unsigned flags = data[10];
+    size_t n = (size_t)get_le(data + 12, 4);
+    uint64_t total = get_le(data + 16, 8);
+    const unsigned char *p = data + BUP_LIST_HEADER_SIZE;
+    const unsigned char *end = data + size;
+    if ((size_t)(end - p) / GIT_OID_RAWSZ < n)
+        return -1;
+
+    git_oid *tmp_oids = malloc(sizeof(git_oid) * (n ? n : 1));
+    size_t *tmp_len = malloc(sizeof(size_t) * (n ? n : 1));
+    if (!tmp_oids || !tmp_len)
+        goto fail;
+    for (size_t i = 0; i < n; i++, p += GIT_OID_RAWSZ)
+        git_oid_fromraw(&tmp_oids[i], p);
+
+    uint64_t sum = 0;
+    if (flags & BUP_LIST_OFFSETS) {
+        if ((size_t)(end - p) != n * 8)
+            goto fail;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t ofs = get_le(p + 8 * i, 8);
+            uint64_t next = i + 1 < n ? get_le(p + 8 * (i + 1), 8) : total;
+            if (ofs != sum || next < ofs)
+                goto fail;
+            tmp_len[i] = (size_t)(next - ofs);
+            sum = next;
+        }
+        p = end;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            uint64_t v = 0;
+            int shift = 0;
+            for (;;) {
+                if (p == end || shift > 63)
+                    goto fail;
+                unsigned char b = *p++;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                shift += 7;
+                if (!(b & 0x80))
+                    break;
+            }
+            tmp_len[i] = (size_t)v;
+            sum += v;
+        }
+    }
+    if (p != end || sum != total)
+        goto fail;
+
+    *level = data[9];
+    *oids = tmp_oids;
+    *lengths = tmp_len;
+    *count = n;
+    return 0;
+
+fail:
+    free(tmp_oids);
+    free(tmp_len);
+    return -1;
+}
+
+int parse_chunk_node(const char *data, size_t size, unsigned flags,
+                     unsigned *level, git_oid **oids, size_t **lengths,
+                     size_t *count)
+{
+    const size_t hlen = sizeof(BUP_FANOUT_HEADER) - 1;
+    if (size >= BUP_LIST_HEADER_SIZE &&
+        memcmp(data, BUP_LIST_MAGIC, BUP_LIST_MAGIC_SIZE) == 0)
+        return parse_binary_node((const unsigned char *)data, size, level,
+                                 oids, lengths, count);
+    if (!(flags & BUP_LIST_ACCEPT_TEXT))
+        return -1;
+
+    *level = 0;
+    if (size > hlen && memcmp(data, BUP_FANOUT_HEADER, hlen) == 0) {
+        const char *nl = memchr(data, '\n', size);
+        if (!nl)
+            return -1;
+        char *endp = NULL;
+        unsigned long lvl = strtoul(data + hlen, &endp, 10);
+        if (endp != nl || lvl == 0 || lvl > BUP_FANOUT_MAX_LEVEL)
+            return -1;
+        *level = (unsigned)lvl;
+        size -= (size_t)(nl + 1 - data);
+        data = nl + 1;
+    }
+    return parse_entries(data, size, oids, lengths, count);
+}
+
+int parse_chunk_list(const char *data, size_t size, git_oid **oids,
+                     size_t **lengths, size_t *count)
+{
+    unsigned level;
+    if (parse_chunk_node(data, size, BUP_LIST_ACCEPT_TEXT, &level, oids,
+                         lengths, count) < 0)
+        return -1;
+    if (level != 0) {
+        free(*oids);
+        free(*lengths);
+        return -1;
+    }
+    return 0;
+}
+
+/* The header alone: its fields must be valid and the node's size must
+ * fit its entry count, but the entries are not decoded */
+static int binary_node_total(const unsigned char *data, size_t size,
+                             size_t *total)
+{
+    if (data[8] != BUP_LIST_VERSION || data[9] > BUP_FANOUT_MAX_LEVEL ||
+        (data[10] & ~BUP_LIST_OFFSETS) || data[11])
+        return -1;
+    uint64_t n = get_le(data + 12, 4);
+    uint64_t body = size - BUP_LIST_HEADER_SIZE;
+    if (data[10] & BUP_LIST_OFFSETS) {
+        if (body != n * (GIT_OID_RAWSZ + 8))
+            return -1;
+    } else if (body < n * (GIT_OID_RAWSZ + 1) ||
+               body > n * (GIT_OID_RAWSZ + 10)) {
+        return -1;
+    }
+    uint64_t t = get_le(data + 16, 8);
+    if (t > SIZE_MAX)
+        return -1;
+    *total = (size_t)t;
+    return 0;
+}
+
+int bup_chunk_list_size(const char *data, size_t size, unsigned flags,
+                        size_t *total)
+{
+    if (size >= BUP_LIST_HEADER_SIZE &&
+        memcmp(data, BUP_LIST_MAGIC, BUP_LIST_MAGIC_SIZE) == 0)
+        return binary_node_total((const unsigned char *)data, size, total) < 0;
+    unsigned level;
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+    if (parse_chunk_node(data, size, flags, &level, &oids, &lens, &n) < 0)
+        return 1;
+    /* entries of interior nodes carry the size of their subtree */
+    *total = 0;
+    for (size_t i = 0; i < n; i++)
+        *total += lens[i];
+    free(oids);
+    free(lens);
+    return 0;
+}
+
+typedef struct {
+    git_oid *oids;
+    size_t *lens;
+    size_t count;
+    size_t cap;
+} chunk_vec;
+
+static int chunk_vec_append(chunk_vec *v, const git_oid *oids,
+                            const size_t *lens, size_t n)
+{
+    if (v->count + n > v->cap) {
+        size_t cap = v->cap ? v->cap : 64;
+        while (cap < v->count + n)
+            cap *= 2;
+        git_oid *o = realloc(v->oids, cap * sizeof(git_oid));
+        if (!o)
+            return -1;
+        v->oids = o;
+        size_t *l = realloc(v->lens, cap * sizeof(size_t));
+        if (!l)
+            return -1;
+        v->lens = l;
+        v->cap = cap;
+    }
+    memcpy(v->oids + v->count, oids, n * sizeof(git_oid));
+    memcpy(v->lens + v->count, lens, n * sizeof(size_t));
+    v->count += n;
+    return 0;
+}
+
+static int expand_children(git_odb *odb, unsigned flags, unsigned level,
+                           const git_oid *oids, const size_t *lens, size_t n,
+                           chunk_vec *out, bup_list_node_cb cb, void *payload)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (cb && cb(&oids[i], payload) < 0)
+            return -1;
+        git_odb_object *obj = NULL;
+        if (git_odb_read(&obj, odb, &oids[i]) < 0)
+            return -1;
+        unsigned child_level;
+        git_oid *child_oids = NULL;
+        size_t *child_lens = NULL;
+        size_t child_n = 0;
+        int ret = parse_chunk_node(git_odb_object_data(obj),
+                                   git_odb_object_size(obj), flags,
+                                   &child_level, &child_oids, &child_lens,
+                                   &child_n);
+        git_odb_object_free(obj);
+        if (ret < 0)
+            return -1;
+        size_t total = 0;
+        for (size_t j = 0; j < child_n; j++)
+            total += child_lens[j];
+        if (child_level != level - 1 || total != lens[i])
+            ret = -1;
+        else if (child_level == 0)
+            ret = chunk_vec_append(out, child_oids, child_lens, child_n);
+        else
+            ret = expand_children(odb, flags, child_level, child_oids,
+                                  child_lens, child_n, out, cb, payload);
+        free(child_oids);
+        free(child_lens);
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int bup_chunk_list_expand(git_odb *odb, unsigned flags, const char *data,
+                          size_t size, git_oid **oids, size_t **lengths,
+                          size_t *count, bup_list_node_cb cb, void *payload)
+{
+    unsigned level;
+    git_oid *root_oids = NULL;
+    size_t *root_lens = NULL;
+    size_t n = 0;
+    if (parse_chunk_node(data, size, flags, &level, &root_oids, &root_lens,
+                         &n) < 0)
+        return 1;
+    if (level == 0) {
+        *oids = root_oids;
+        *lengths = root_lens;
+        *count = n;
+        return 0;
+    }
+
+    chunk_vec v = {0};
+    int ret = expand_children(odb, flags, level, root_oids, root_lens, n, &v,
+                              cb, payload);
+    free(root_oids);
+    free(root_lens);
+    if (ret < 0) {
+        free(v.oids);
+        free(v.lens);
+        return -1;
+    }
+    *oids = v.oids;
+    *lengths = v.lens;
+    *count = v.count;
+    return 0;
+}
+
+/* Index of the first entry ending after offset, given entry start
+ * offsets relative to the node */
+static size_t first_overlap(const uint64_t *starts, const size_t *lens,
+                            size_t n, uint64_t offset)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts[mid] + lens[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int walk_node(git_odb *odb, unsigned flags, unsigned level,
+                     const git_oid *oids, const size_t *lens, size_t n,
+                     uint64_t base, uint64_t offset, uint64_t end,
+                     bup_chunk_range_cb cb, void *payload)
+{
+    uint64_t *starts = malloc(sizeof(*starts) * (n ? n : 1));
+    if (!starts)
+        return -1;
+    uint64_t pos = base;
+    for (size_t i = 0; i < n; i++) {
+        starts[i] = pos;
+        pos += lens[i];
+    }
+    int ret = 0;
+    for (size_t i = first_overlap(starts, lens, n, offset);
+         i < n && starts[i] < end && ret == 0; i++) {
+        if (level == 0) {
+            ret = cb(&oids[i], starts[i], lens[i], payload);
+            continue;
+        }
+        git_odb_object *obj = NULL;
+        if (git_odb_read(&obj, odb, &oids[i]) < 0) {
+            ret = -1;
+            break;
+        }
+        unsigned child_level;
+        git_oid *child_oids = NULL;
+        size_t *child_lens = NULL;
+        size_t child_n = 0;
+        ret = parse_chunk_node(git_odb_object_data(obj),
+                               git_odb_object_size(obj), flags, &child_level,
+                               &child_oids, &child_lens, &child_n);
+        git_odb_object_free(obj);
+        if (ret < 0)
+            break;
+        uint64_t total = 0;
+        for (size_t j = 0; j < child_n; j++)
+            total += child_lens[j];
+        if (child_level != level - 1 || total != lens[i])
+            ret = -1;
+        else
+            ret = walk_node(odb, flags, child_level, child_oids, child_lens,
+                            child_n, starts[i], offset, end, cb, payload);
+        free(child_oids);
+        free(child_lens);
+    }
+    free(starts);
+    return ret;
+}
+
+int bup_chunk_list_walk(git_odb *odb, unsigned flags, const char *data,
+                        size_t size, uint64_t offset, uint64_t len,
+                        bup_chunk_range_cb cb, void *payload)
+{
+    unsigned level;
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+    if (parse_chunk_node(data, size, flags, &level, &oids, &lens, &n) < 0)
+        return 1;
+    uint64_t end = len > UINT64_MAX - offset ? UINT64_MAX : offset + len;
+    int ret = walk_node(odb, flags, level, oids, lens, n, 0, offset, end, cb,
+                        payload);
+    free(oids);
+    free(lens);
+    return ret < 0 ? -1 : 0;
+}
+
+int bup_list_reader_init(bup_list_reader *r, git_odb *odb, unsigned flags,
+                         const char *data, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+    unsigned level;
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+    if (parse_chunk_node(data, size, flags, &level, &oids, &lens, &n) < 0)
+        return 1;
+    r->levels = calloc(level + 1, sizeof(*r->levels));
+    if (!r->levels) {
+        free(oids);
+        free(lens);
+        return -1;
+    }
+    r->odb = odb;
+    r->flags = flags;
+    r->nlevels = level + 1;
+    r->levels[level].oids = oids;
+    r->levels[level].lens = lens;
+    r->levels[level].count = n;
+    for (size_t i = 0; i < n; i++)
+        r->total += lens[i];
+    return 0;
+}
+
+/* Replace the node below level with the next child of the node at level,
+ * checking the child's level and total against the parent's entry */
+static int list_reader_descend(bup_list_reader *r, size_t level)
+{
+    bup_list_reader_node *parent = &r->levels[level];
+    bup_list_reader_node *child = &r->levels[level - 1];
+    size_t i = parent->next++;
+    git_odb_object *obj = NULL;
+    if (git_odb_read(&obj, r->odb, &parent->oids[i]) < 0)
+        return -1;
+    unsigned child_level;
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+    int ret = parse_chunk_node(git_odb_object_data(obj),
+                               git_odb_object_size(obj), r->flags,
+                               &child_level, &oids, &lens, &n);
+    git_odb_object_free(obj);
+    if (ret < 0)
+        return -1;
+    size_t total = 0;
+    for (size_t j = 0; j < n; j++)
+        total += lens[j];
+    if (child_level != level - 1 || total != parent->lens[i]) {
+        free(oids);
+        free(lens);
+        return -1;
+    }
+    free(child->oids);
+    free(child->lens);
+    child->oids = oids;
+    child->lens = lens;
+    child->count = n;
+    child->next = 0;
+    return 0;
+}
+
+int bup_list_reader_next(bup_list_reader *r, const git_oid **oids,
+                         const size_t **lens, size_t *count)
+{
+    bup_list_reader_node *leaf = &r->levels[0];
+    if (r->nlevels == 1) {
+        /* a flat list is its own only leaf; next marks it handed out */
+        if (leaf->next)
+            return 1;
+        leaf->next = 1;
+    } else {
+        /* descend from the lowest interior node with entries left */
+        size_t level = 1;
+        while (level) {
+            while (level < r->nlevels &&
+                   r->levels[level].next == r->levels[level].count)
+                level++;
+            if (level == r->nlevels)
+                return 1;
+            if (list_reader_descend(r, level) < 0)
+                return -1;
+            level--;
+        }
+    }
+    *oids = leaf->oids;
+    *lens = leaf->lens;
+    *count = leaf->count;
+    return 0;
+}
+
+void bup_list_reader_free(bup_list_reader *r)
+{
+    for (size_t i = 0; i < r->nlevels; i++) {
+        free(r->levels[i].oids);
+        free(r->levels[i].lens);
+    }
+    free(r->levels);
+    memset(r, 0, sizeof(*r));
+}
+
+int bup_list_writer_init(bup_list_writer *w, git_odb *odb,
+                         unsigned fanout_bits)
+{
+    w->odb = odb;
+    w->pack = NULL;
+    w->fanout_bits = fanout_bits;
+    w->levels = calloc(1, sizeof(bup_list_node));
+    w->nlevels = w->levels ? 1 : 0;
+    return w->levels ? 0 : -1;
+}
+
+void bup_list_writer_free(bup_list_writer *w)
+{
+    for (size_t i = 0; i < w->nlevels; i++) {
+        free(w->levels[i].oids);
+        free(w->levels[i].lens);
+    }
+    free(w->levels);
+    w->levels = NULL;
+    w->nlevels = 0;
+}
+
+static int fanout_split(const git_oid *oid, unsigned bits)
+{
+    uint32_t v = ((uint32_t)oid->id[0] << 24) | ((uint32_t)oid->id[1] << 16) |
+                 ((uint32_t)oid->id[2] << 8) | oid->id[3];
+    return (v & ((1u << bits) - 1)) == 0;
+}
+
+static int list_writer_push(bup_list_writer *w, size_t level,
+                            const git_oid *oid, size_t len);
+
+static int list_writer_write(bup_list_writer *w, size_t level, git_oid *out)
+{
+    bup_list_node *node = &w->levels[level];
+    char *buf = NULL;
+    size_t len = 0;
+    /* interior nodes carry offsets so byte ranges can be located quickly */
+    if (bup_list_encode(&buf, &len, (unsigned)level, node->oids, node->lens,
+                        node->count, level ? BUP_LIST_OFFSETS : 0) < 0)
+        return -1;
+    int ret;
+    if (!w->pack) {
+        ret = git_odb_write(out, w->odb, buf, len, GIT_OBJECT_BLOB);
+    } else if (bup_pack_writer_failed(w->pack)) {
+        ret = -1;
+    } else {
+        ret = git_odb_hash(out, buf, len, GIT_OBJECT_BLOB);
+        if (ret == 0 && !git_odb_exists(w->odb, out))
+            ret = bup_pack_writer_add(w->pack, out, GIT_OBJECT_BLOB, buf,
+                                      len, 0);
+    }
+    free(buf);
+    return ret;
+}
+
+static int list_writer_flush(bup_list_writer *w, size_t level)
+{
+    git_oid oid;
+    if (list_writer_write(w, level, &oid) < 0)
+        return -1;
+    size_t total = w->levels[level].total;
+    w->levels[level].count = 0;
+    w->levels[level].total = 0;
+    return list_writer_push(w, level + 1, &oid, total);
+}
+
+static int list_writer_push(bup_list_writer *w, size_t level,
+                            const git_oid *oid, size_t len)
+{
+    if (level >= BUP_FANOUT_MAX_LEVEL)
+        return -1;
+    if (level == w->nlevels) {
+        bup_list_node *tmp = realloc(w->levels,
+                                     (level + 1) * sizeof(bup_list_node));
+        if (!tmp)
+            return -1;
+        w->levels = tmp;
+        memset(&w->levels[level], 0, sizeof(bup_list_node));
+        w->nlevels++;
+    }
+
+    bup_list_node *node = &w->levels[level];
+    if (node->count == node->cap) {
+        size_t cap = node->cap ? node->cap * 2 : 64;
+        git_oid *o = realloc(node->oids, cap * sizeof(git_oid));
+        if (!o)
+            return -1;
+        node->oids = o;
+        size_t *l = realloc(node->lens, cap * sizeof(size_t));
+        if (!l)
+            return -1;
+        node->lens = l;
+        node->cap = cap;
+    }
+    git_oid_cpy(&node->oids[node->count], oid);
+    node->lens[node->count] = len;
+    node->count++;
+    node->total += len;
+
+    if (w->fanout_bits &&
+        (fanout_split(oid, w->fanout_bits) ||
+         node->count >= BUP_FANOUT_MAX(w->fanout_bits)))
+        return list_writer_flush(w, level);
+    return 0;
+}
+
+int bup_list_writer_add(bup_list_writer *w, const git_oid *oid, size_t len)
+{
+    return list_writer_push(w, 0, oid, len);
+}
+
+int bup_list_writer_finish(bup_list_writer *w, git_oid *out)
+{
+    for (size_t level = 0; level < w->nlevels; level++) {
+        bup_list_node *node = &w->levels[level];
+        if (level + 1 == w->nlevels) {
+            /* a single node on top is the root itself */
+            if (level > 0 && node->count == 1) {
+                git_oid_cpy(out, &node->oids[0]);
+                return 0;
+            }
+            return list_writer_write(w, level, out);
+        }
+        if (node->count && list_writer_flush(w, level) < 0)
+            return -1;
+    }
+    return -1;
+}
+
 size_t bup_backend_object_chunk_count(git_odb_backend *backend,
                                       const git_oid *oid,
                                       git_oid **chunk_oids,
                                       size_t **lengths) {
     bup_odb_backend *b = (bup_odb_backend *)backend;
-    git_odb_object *obj = NULL;
-    if (git_odb_read(&obj, b->odb, oid) < 0)
+    bup_chunk_list *list = NULL;
+    if (bup_list_cache_get(&list, NULL, &b->list_cache, b->odb, b->list_flags,
+                           oid) != 0)
         return 0;
 
-    git_oid *oids = NULL;
-    size_t *lens = NULL;
-    size_t count = 0;
-    if (parse_chunk_list(git_odb_object_data(obj),
-                         git_odb_object_size(obj), &oids, &lens, &count) < 0) {
-        git_odb_object_free(obj);
+    size_t count = list->count;
+    size_t n = count ? count : 1;
+    git_oid *oids = chunk_oids ? malloc(n * sizeof(*oids)) : NULL;
+    size_t *lens = lengths ? malloc(n * sizeof(*lens)) : NULL;
+    if ((chunk_oids && !oids) || (lengths && !lens)) {
+        free(oids);
+        free(lens);
+        bup_chunk_list_release(list);
         return 0;
     }
-    git_odb_object_free(obj);
-
-    if (chunk_oids)
+    if (oids) {
+        memcpy(oids, list->oids, count * sizeof(*oids));
         *chunk_oids = oids;
-    else
-        free(oids);
-    if (lengths)
+    }
+    if (lens) {
+        memcpy(lens, list->lens, count * sizeof(*lens));
         *lengths = lens;
-    else
-        free(lens);
+    }
+    bup_chunk_list_release(list);
     return count;
 }
 
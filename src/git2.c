@@ -6,10 +6,25 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <git2/pack.h>
 #include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Bytes read from a file per write to the backend in add */
+#define ADD_BLOCK_SIZE (1u << 20)
+/* Files add_file may have mapped at once; any more are streamed */
+#define ADD_MAX_MAPS 128
+/* Largest buffer show --range reads into at once */
+#define SHOW_RANGE_WINDOW (4u << 20)
+
 static int cmd_hash_object(const char *file)
 {
     git_oid oid;
@@ -26,86 +41,278 @@ static int cmd_init(const char *path)
 {
     git_repository *repo = NULL;
     int ret = git_repository_init(&repo, path, 0);
+    if (ret == 0)
+        ret = bup_odb_init_config(repo);
     git_repository_free(repo);
     return ret;
 }
 
-static int cmd_show(const char *repo_path, const char *spec)
+static int cmd_chunking(const char *repo_path, int argc, char **argv)
 {
     git_repository *repo = NULL;
-    int ret = git_repository_open(&repo, repo_path ? repo_path : ".");
+    int ret = git_repository_open(&repo, repo_path);
     if (ret < 0)
         return ret;
 
-    git_odb *odb = NULL;
-    git_odb_backend *backend = NULL;
-    if (git_repository_odb(&odb, repo) == 0 &&
-        bup_odb_backend_new(&backend, repo_path ? repo_path : NULL) == 0)
-        git_odb_add_backend(odb, backend, 999);
+    bup_split_params params;
+    const bup_chunker_engine *engine = NULL;
+    if (argc >= 3) {
+        char *end[3];
+        unsigned long long min = strtoull(argv[0], &end[0], 10);
+        unsigned long long avg = strtoull(argv[1], &end[1], 10);
+        unsigned long long max = strtoull(argv[2], &end[2], 10);
+        if (*end[0] || *end[1] || *end[2] || avg == 0 || avg > UINT32_MAX) {
+            fprintf(stderr, "chunking expects <min> <avg> <max> in bytes\n");
+            ret = -1;
+            goto out;
+        }
+        params.min_chunk = (size_t)min;
+        params.max_chunk = (size_t)max;
+        params.mask = (uint32_t)(avg - 1);
+        if (argc == 4 && !(engine = bup_chunker_engine_by_name(argv[3]))) {
+            fprintf(stderr, "unknown chunker %s\n", argv[3]);
+            ret = -1;
+            goto out;
+        }
+        ret = bup_odb_write_split_params(repo, &params);
+        if (ret < 0)
+            fprintf(stderr, "invalid chunking policy (avg must be a power of two"
+                            " and min <= max)\n");
+        else if (engine)
+            ret = bup_odb_write_chunker(repo, engine);
+        goto out;
+    }
 
-    const char *colon = strchr(spec, ':');
-    const char *rev = spec;
-    const char *path = NULL;
-    if (colon) {
-        rev = strndup(spec, colon - spec);
-        path = colon + 1;
+    const bup_split_params legacy = BUP_SPLIT_PARAMS_LEGACY;
+    ret = bup_odb_read_split_params(&params, repo);
+    if (ret == 0)
+        ret = bup_odb_read_chunker(&engine, repo);
+    if (ret == 0)
+        printf("chunker=%s min=%zu avg=%lu max=%zu%s\n", engine->name,
+               params.min_chunk,
+               (unsigned long)params.mask + 1, params.max_chunk,
+               params.min_chunk == legacy.min_chunk &&
+               params.max_chunk == legacy.max_chunk &&
+               params.mask == legacy.mask ? " (legacy)" : "");
+out:
+    git_repository_free(repo);
+    return ret;
+}
+
+static int show_range(git_odb_backend *backend, const git_oid *oid,
+                      uint64_t offset, uint64_t len)
+{
+    size_t size = len < SHOW_RANGE_WINDOW ? (size_t)len : SHOW_RANGE_WINDOW;
+    char *buf = malloc(size ? size : 1);
+    if (!buf)
+        return -1;
+    int ret = 0;
+    while (len) {
+        size_t want = len < size ? (size_t)len : size;
+        size_t got = 0;
+        ret = bup_odb_read_range(backend, oid, offset, want, buf, &got);
+        if (ret < 0 || fwrite(buf, 1, got, stdout) != got) {
+            ret = -1;
+            break;
+        }
+        if (got < want)
+            break;
+        offset += got;
+        len -= got;
     }
+    free(buf);
+    return ret;
+}
+
+static int parse_range(const char *arg, uint64_t *offset, uint64_t *len)
+{
+    char *end = NULL;
+    *offset = strtoull(arg, &end, 10);
+    if (end == arg || *end != ':')
+        return -1;
+    const char *l = end + 1;
+    *len = strtoull(l, &end, 10);
+    return end == l || *end ? -1 : 0;
+}
 
+/* Resolve <rev>[:<path>] to the oid and mode of what it names without
+ * reading it; a bare rev names its root tree */
+static int resolve_spec(git_repository *repo, const char *spec, git_oid *oid,
+                        git_filemode_t *mode)
+{
+    const char *colon = strchr(spec, ':');
+    char *rev = colon ? strndup(spec, colon - spec) : NULL;
     git_object *obj = NULL;
-    ret = git_revparse_single(&obj, repo, rev);
-    if (colon)
-        free((char *)rev);
-    if (ret < 0) {
-        git_repository_free(repo);
+    int ret = git_revparse_single(&obj, repo, rev ? rev : spec);
+    free(rev);
+    if (ret < 0)
         return ret;
-    }
 
     git_tree *tree = NULL;
     if (git_object_type(obj) == GIT_OBJECT_COMMIT) {
         ret = git_commit_tree(&tree, (git_commit *)obj);
         git_object_free(obj);
-        if (ret < 0) {
-            git_repository_free(repo);
-            return ret;
-        }
     } else if (git_object_type(obj) == GIT_OBJECT_TREE) {
         tree = (git_tree *)obj;
     } else {
         git_object_free(obj);
-        git_repository_free(repo);
+        ret = -1;
+    }
+    if (ret < 0)
+        return ret;
+
+    if (!colon || !colon[1]) {
+        git_oid_cpy(oid, git_tree_id(tree));
+        *mode = GIT_FILEMODE_TREE;
+    } else {
+        git_tree_entry *entry = NULL;
+        ret = git_tree_entry_bypath(&entry, tree, colon + 1);
+        if (ret == 0) {
+            git_oid_cpy(oid, git_tree_entry_id(entry));
+            *mode = git_tree_entry_filemode(entry);
+            git_tree_entry_free(entry);
+        }
+    }
+    git_tree_free(tree);
+    return ret;
+}
+
+/* Open repo_path with the bup backend added to its odb */
+static int open_with_backend(git_repository **repo, git_odb **odb,
+                             git_odb_backend **backend, const char *repo_path)
+{
+    int ret = git_repository_open(repo, repo_path ? repo_path : ".");
+    if (ret < 0)
+        return ret;
+    if (git_repository_odb(odb, *repo) < 0 ||
+        bup_odb_backend_new(backend, repo_path) < 0) {
+        git_odb_free(*odb);
+        git_repository_free(*repo);
         return -1;
     }
+    git_odb_add_backend(*odb, *backend, 999);
+    return 0;
+}
 
-    git_tree_entry *entry = NULL;
-    ret = git_tree_entry_bypath(&entry, tree, path ? path : spec + strlen(spec));
-    if (ret < 0) {
-        if (git_object_type(obj) == GIT_OBJECT_TREE)
-            git_tree_free(tree);
-        else
-            git_tree_free(tree);
-        git_repository_free(repo);
+static int cmd_show(const char *repo_path, const char *spec, const char *range)
+{
+    uint64_t offset = 0, range_len = 0;
+    if (range && parse_range(range, &offset, &range_len) < 0) {
+        fprintf(stderr, "show --range expects <offset>:<length>\n");
+        return -1;
+    }
+
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    git_odb_backend *backend = NULL;
+    int ret = open_with_backend(&repo, &odb, &backend, repo_path);
+    if (ret < 0)
         return ret;
+
+    git_oid oid;
+    git_filemode_t mode;
+    ret = resolve_spec(repo, spec, &oid, &mode);
+    if (ret == 0 && mode == GIT_FILEMODE_TREE)
+        ret = -1;
+    if (ret == 0 && range) {
+        ret = show_range(backend, &oid, offset, range_len);
+    } else if (ret == 0) {
+        /* chunks go from the inflated objects to stdout directly */
+        fflush(stdout);
+        ret = bup_odb_read_to_fd(backend, &oid, STDOUT_FILENO);
     }
+    git_odb_free(odb);
+    git_repository_free(repo);
+    return ret;
+}
 
-    const git_oid *oid = git_tree_entry_id(entry);
-    void *buf = NULL;
-    size_t len = 0;
-    git_object_t type = 0;
-    if (backend->read(&buf, &len, &type, backend, oid) == 0) {
-        fwrite(buf, 1, len, stdout);
-        free(buf);
-    } else {
-        git_tree_entry_free(entry);
+static int restore_entry(git_repository *repo, git_odb_backend *backend,
+                         const git_oid *oid, git_filemode_t mode,
+                         const char *dest);
+
+static int restore_tree(git_repository *repo, git_odb_backend *backend,
+                        const git_oid *oid, const char *dest)
+{
+    git_tree *tree = NULL;
+    if (git_tree_lookup(&tree, repo, oid) < 0)
+        return -1;
+    if (mkdir(dest, 0777) < 0 && errno != EEXIST) {
         git_tree_free(tree);
-        git_odb_free(odb);
-        git_repository_free(repo);
         return -1;
     }
-    git_tree_entry_free(entry);
+    int ret = 0;
+    size_t count = git_tree_entrycount(tree);
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+        char path[4096];
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dest,
+                             git_tree_entry_name(entry)) >= sizeof(path)) {
+            ret = -1;
+            break;
+        }
+        ret = restore_entry(repo, backend, git_tree_entry_id(entry),
+                            git_tree_entry_filemode(entry), path);
+    }
     git_tree_free(tree);
+    return ret;
+}
+
+static int restore_link(git_odb_backend *backend, const git_oid *oid,
+                        const char *dest)
+{
+    char target[4096];
+    size_t len = 0;
+    if (bup_odb_read_into(backend, oid, target, sizeof(target) - 1, &len) < 0)
+        return -1;
+    target[len] = '\0';
+    unlink(dest);
+    return symlink(target, dest);
+}
+
+/* Blobs are written from their chunks straight into the file */
+static int restore_entry(git_repository *repo, git_odb_backend *backend,
+                         const git_oid *oid, git_filemode_t mode,
+                         const char *dest)
+{
+    switch (mode) {
+    case GIT_FILEMODE_TREE:
+        return restore_tree(repo, backend, oid, dest);
+    case GIT_FILEMODE_LINK:
+        return restore_link(backend, oid, dest);
+    case GIT_FILEMODE_BLOB:
+    case GIT_FILEMODE_BLOB_EXECUTABLE: {
+        int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC,
+                      mode == GIT_FILEMODE_BLOB ? 0666 : 0777);
+        if (fd < 0)
+            return -1;
+        int ret = bup_odb_read_to_fd(backend, oid, fd);
+        if (close(fd) < 0)
+            ret = -1;
+        return ret;
+    }
+    default:
+        /* submodules have no content here */
+        return 0;
+    }
+}
+
+static int cmd_restore(const char *repo_path, const char *spec,
+                       const char *dest)
+{
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    git_odb_backend *backend = NULL;
+    int ret = open_with_backend(&repo, &odb, &backend, repo_path);
+    if (ret < 0)
+        return ret;
+    git_oid oid;
+    git_filemode_t mode;
+    ret = resolve_spec(repo, spec, &oid, &mode);
+    if (ret == 0)
+        ret = restore_entry(repo, backend, &oid, mode, dest);
     git_odb_free(odb);
     git_repository_free(repo);
-    return 0;
+    return ret;
 }
 
 static git_signature *make_signature(const char *name_env, const char *email_env)
@@ -122,6 +329,207 @@ static git_signature *make_signature(const char *name_env, const char *email_env
     return sig;
 }
 
+/* Stream fd into the backend in ADD_BLOCK_SIZE reads, so memory use does
+ * not depend on its size. Only regular files have a size up front; for
+ * others st->st_size is set to the bytes read. */
+static int add_stream(git_odb_backend *backend, int fd, struct stat *st,
+                      git_oid *oid)
+{
+    int sized = S_ISREG(st->st_mode);
+    char *buf = malloc(ADD_BLOCK_SIZE);
+    git_odb_stream *stream = NULL;
+    if (!buf || backend->writestream(&stream, backend,
+                                     sized ? (git_object_size_t)st->st_size :
+                                             BUP_STREAM_SIZE_UNKNOWN,
+                                     GIT_OBJECT_BLOB) < 0) {
+        free(buf);
+        return -1;
+    }
+    int ret = 0;
+    off_t total = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf, ADD_BLOCK_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = n < 0 ? -1 : 0;
+            break;
+        }
+        if (stream->write(stream, buf, (size_t)n) < 0) {
+            ret = -1;
+            break;
+        }
+        total += n;
+    }
+    /* fails if a regular file changed size while it was read */
+    if (ret == 0)
+        ret = stream->finalize_write(stream, oid);
+    if (!sized)
+        st->st_size = total;
+    stream->free(stream);
+    free(buf);
+    return ret;
+}
+
+/* Mappings add_file is reading. A file truncated under its mapping
+ * raises SIGBUS in whichever thread touches the lost pages, chunk
+ * workers included, so instead of unwinding, the handler maps zero pages
+ * over the rest of the mapping, lets the read finish and marks the
+ * mapping so that add_file fails. */
+typedef struct {
+    char *volatile addr;
+    volatile size_t len;
+    volatile sig_atomic_t truncated;
+} add_map;
+
+static add_map add_maps[ADD_MAX_MAPS];
+static pthread_mutex_t add_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t add_sigbus_once = PTHREAD_ONCE_INIT;
+static int add_sigbus_ok;
+static uintptr_t add_page_mask;
+
+static void add_sigbus(int sig, siginfo_t *info, void *ctx)
+{
+    (void)ctx;
+    char *p = info->si_addr;
+    for (size_t i = 0; i < ADD_MAX_MAPS; i++) {
+        char *base = add_maps[i].addr;
+        if (!base || p < base || p >= base + add_maps[i].len)
+            continue;
+        char *page = (char *)((uintptr_t)p & ~add_page_mask);
+        if (mmap(page, (size_t)(base + add_maps[i].len - page), PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) ==
+            MAP_FAILED)
+            break;
+        add_maps[i].truncated = 1;
+        return;
+    }
+    /* not one of ours: fault again without the handler */
+    signal(sig, SIG_DFL);
+}
+
+static void add_sigbus_install(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = add_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    add_page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    add_sigbus_ok = sigaction(SIGBUS, &sa, NULL) == 0;
+}
+
+/* Register a mapping with the SIGBUS handler; NULL if none is free */
+static add_map *add_map_register(char *addr, size_t len)
+{
+    pthread_once(&add_sigbus_once, add_sigbus_install);
+    if (!add_sigbus_ok)
+        return NULL;
+    add_map *m = NULL;
+    pthread_mutex_lock(&add_maps_lock);
+    for (size_t i = 0; i < ADD_MAX_MAPS && !m; i++) {
+        if (!add_maps[i].addr) {
+            m = &add_maps[i];
+            m->truncated = 0;
+            m->len = len;
+            __atomic_store_n(&m->addr, addr, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&add_maps_lock);
+    return m;
+}
+
+static void add_map_release(add_map *m)
+{
+    pthread_mutex_lock(&add_maps_lock);
+    __atomic_store_n(&m->addr, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&add_maps_lock);
+}
+
+/* Regular files are mapped and chunked in place, with no heap copy;
+ * anything that cannot be mapped is streamed. A file that shrinks while
+ * it is read fails either way. *st is the file as it was read. */
+static int add_file(git_odb_backend *backend, const char *path,
+                    struct stat *st, git_oid *oid)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, st) < 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    add_map *m = NULL;
+    if (S_ISREG(st->st_mode) && st->st_size > 0 &&
+        (uint64_t)st->st_size <= SIZE_MAX)
+        map = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED &&
+        !(m = add_map_register(map, (size_t)st->st_size))) {
+        munmap(map, (size_t)st->st_size);
+        map = MAP_FAILED;
+    }
+    int ret;
+    if (map != MAP_FAILED) {
+        madvise(map, (size_t)st->st_size, MADV_SEQUENTIAL);
+        ret = backend->write(backend, oid, map, (size_t)st->st_size,
+                             GIT_OBJECT_BLOB);
+        struct stat now;
+        if (m->truncated || fstat(fd, &now) < 0 ||
+            now.st_size != st->st_size)
+            ret = -1;
+        add_map_release(m);
+        munmap(map, (size_t)st->st_size);
+    } else {
+        ret = add_stream(backend, fd, st, oid);
+    }
+    close(fd);
+    return ret;
+}
+
+/* Stat data as the index records it, truncated to 32 bits like git */
+static void index_entry_stat(git_index_entry *e, const struct stat *st)
+{
+    e->ctime.seconds = (int32_t)st->st_ctim.tv_sec;
+    e->ctime.nanoseconds = (uint32_t)st->st_ctim.tv_nsec;
+    e->mtime.seconds = (int32_t)st->st_mtim.tv_sec;
+    e->mtime.nanoseconds = (uint32_t)st->st_mtim.tv_nsec;
+    e->dev = (uint32_t)st->st_dev;
+    e->ino = (uint32_t)st->st_ino;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->file_size = (uint32_t)st->st_size;
+}
+
+/* Whether a file with stat data st still has the content recorded in
+ * entry, so its oid can be reused without reading it. As in git, an
+ * entry whose mtime is not older than the index file is racy: the file
+ * may have changed again within the same timestamp, so it is re-read. */
+static int index_entry_fresh(git_index *index, const git_index_entry *entry,
+                             const struct stat *st)
+{
+    if (!entry || !S_ISREG(st->st_mode) || entry->mode != GIT_FILEMODE_BLOB)
+        return 0;
+    git_index_entry cur = {0};
+    index_entry_stat(&cur, st);
+    if (cur.ctime.seconds != entry->ctime.seconds ||
+        cur.ctime.nanoseconds != entry->ctime.nanoseconds ||
+        cur.mtime.seconds != entry->mtime.seconds ||
+        cur.mtime.nanoseconds != entry->mtime.nanoseconds ||
+        cur.dev != entry->dev || cur.ino != entry->ino ||
+        cur.uid != entry->uid || cur.gid != entry->gid ||
+        cur.file_size != entry->file_size)
+        return 0;
+
+    struct stat ist;
+    if (stat(git_index_path(index), &ist) < 0)
+        return 0;
+    int32_t sec = (int32_t)ist.st_mtim.tv_sec;
+    uint32_t nsec = (uint32_t)ist.st_mtim.tv_nsec;
+    return entry->mtime.seconds < sec ||
+           (entry->mtime.seconds == sec && entry->mtime.nanoseconds < nsec);
+}
+
 static int cmd_add(const char *repo_path, const char *pathspec)
 {
     git_repository *repo = NULL;
@@ -134,54 +542,32 @@ static int cmd_add(const char *repo_path, const char *pathspec)
     if (ret < 0)
         goto out_repo;
 
+    /* an unchanged file is not read, and the index is left as it is */
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s", repo_path, pathspec);
+    struct stat st;
+    if (stat(filepath, &st) == 0 &&
+        index_entry_fresh(index, git_index_get_bypath(index, pathspec, 0), &st))
+        goto out_index;
+
     git_odb_backend *backend = NULL;
     ret = bup_odb_backend_new(&backend, repo_path);
     if (ret < 0)
         goto out_index;
 
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/%s", repo_path, pathspec);
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        ret = -1;
-        goto out_backend;
-    }
-    fseek(f, 0, SEEK_END);
-    long sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char *buf = malloc(sz);
-    if (!buf) {
-        fclose(f);
-        ret = -1;
-        goto out_backend;
-    }
-    if (fread(buf, 1, sz, f) != (size_t)sz) {
-        fclose(f);
-        free(buf);
-        ret = -1;
-        goto out_backend;
-    }
-    fclose(f);
-
     git_oid oid;
-    ret = backend->write(backend, &oid, buf, sz, GIT_OBJECT_BLOB);
-    free(buf);
+    ret = add_file(backend, filepath, &st, &oid);
+    /* the index may only name objects that are in place */
+    if (ret == 0)
+        ret = bup_odb_flush(backend);
     if (ret < 0)
         goto out_backend;
 
-    struct stat st;
-    if (stat(filepath, &st) < 0) {
-        ret = -1;
-        goto out_backend;
-    }
-
     git_index_entry entry = {0};
     entry.mode = GIT_FILEMODE_BLOB;
     entry.id = oid;
     entry.path = pathspec;
-    entry.file_size = (git_off_t)sz;
-    entry.ctime.seconds = (git_time_t)st.st_ctime;
-    entry.mtime.seconds = (git_time_t)st.st_mtime;
+    index_entry_stat(&entry, &st);
     ret = git_index_add(index, &entry);
     if (ret == 0)
         ret = git_index_write(index);
@@ -195,30 +581,14 @@ out_repo:
     return ret;
 }
 
-static int cmd_commit(const char *repo_path, const char *message)
+/* Commit tree_oid on top of HEAD, or as a root commit */
+static int commit_tree(git_repository *repo, const git_oid *tree_oid,
+                       const char *message)
 {
-    git_repository *repo = NULL;
-    int ret = git_repository_open(&repo, repo_path);
-    if (ret < 0)
-        return ret;
-
-    git_index *index = NULL;
-    ret = git_repository_index(&index, repo);
-    if (ret < 0)
-        goto out;
-
-    git_oid tree_oid;
-    ret = git_index_write_tree(&tree_oid, index);
-    if (ret < 0)
-        goto out_index;
-    ret = git_index_write(index);
-    if (ret < 0)
-        goto out_index;
-
     git_tree *tree = NULL;
-    ret = git_tree_lookup(&tree, repo, &tree_oid);
+    int ret = git_tree_lookup(&tree, repo, tree_oid);
     if (ret < 0)
-        goto out_index;
+        return ret;
 
     git_oid parent_oid;
     git_commit *parent = NULL;
@@ -229,7 +599,7 @@ static int cmd_commit(const char *repo_path, const char *message)
     git_signature *committer = make_signature("GIT_COMMITTER_NAME", "GIT_COMMITTER_EMAIL");
     if (!author || !committer) {
         ret = -1;
-        goto out_all;
+        goto out;
     }
 
     git_oid commit_oid;
@@ -246,12 +616,35 @@ static int cmd_commit(const char *repo_path, const char *message)
             fprintf(stderr, "commit error: %s\n", e->message);
     }
 
-out_all:
+out:
     git_signature_free(author);
     git_signature_free(committer);
     if (parent)
         git_commit_free(parent);
     git_tree_free(tree);
+    return ret;
+}
+
+static int cmd_commit(const char *repo_path, const char *message)
+{
+    git_repository *repo = NULL;
+    int ret = git_repository_open(&repo, repo_path);
+    if (ret < 0)
+        return ret;
+
+    git_index *index = NULL;
+    ret = git_repository_index(&index, repo);
+    if (ret < 0)
+        goto out;
+
+    git_oid tree_oid;
+    ret = git_index_write_tree(&tree_oid, index);
+    if (ret < 0)
+        goto out_index;
+    ret = git_index_write(index);
+    if (ret < 0)
+        goto out_index;
+    ret = commit_tree(repo, &tree_oid, message);
 
 out_index:
     git_index_free(index);
@@ -260,6 +653,338 @@ out:
     return ret;
 }
 
+/* save: snapshot a directory without going through the index. Workers
+ * read directories and chunk files off one queue, sharing the backend
+ * and its chunk index; trees are then written bottom-up and committed. */
+typedef struct save_dir save_dir;
+
+typedef struct {
+    char *name;
+    git_filemode_t mode;
+    git_oid oid;
+    /* set for subdirectories */
+    save_dir *dir;
+} save_entry;
+
+struct save_dir {
+    char *path;
+    save_entry *entries;
+    size_t count;
+};
+
+typedef struct {
+    const save_dir *parent;
+    save_entry *entry;
+} save_job;
+
+typedef struct {
+    git_odb_backend *backend;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    save_job *jobs;
+    size_t njobs, cap;
+    /* jobs taken but not finished; the walk is over when none are queued
+     * and none are active */
+    size_t active;
+    int failed;
+} save_queue;
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path)
+        snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+/* Called with q->lock held */
+static int save_push(save_queue *q, const save_dir *parent, save_entry *entry)
+{
+    if (q->njobs == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        save_job *tmp = realloc(q->jobs, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        q->jobs = tmp;
+        q->cap = cap;
+    }
+    q->jobs[q->njobs].parent = parent;
+    q->jobs[q->njobs].entry = entry;
+    q->njobs++;
+    return 0;
+}
+
+/* A subdirectory takes over *path */
+static int save_add_entry(save_dir *dir, size_t *cap, const char *name,
+                          char **path, const struct stat *st)
+{
+    git_filemode_t mode;
+    if (S_ISDIR(st->st_mode))
+        mode = GIT_FILEMODE_TREE;
+    else if (S_ISLNK(st->st_mode))
+        mode = GIT_FILEMODE_LINK;
+    else if (S_ISREG(st->st_mode))
+        mode = (st->st_mode & 0111) ? GIT_FILEMODE_BLOB_EXECUTABLE :
+                                      GIT_FILEMODE_BLOB;
+    else
+        return 0; /* sockets, devices and fifos are not saved */
+    if (dir->count == *cap) {
+        size_t n = *cap ? *cap * 2 : 16;
+        save_entry *tmp = realloc(dir->entries, n * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        dir->entries = tmp;
+        *cap = n;
+    }
+    save_entry *e = &dir->entries[dir->count];
+    memset(e, 0, sizeof(*e));
+    e->mode = mode;
+    e->name = strdup(name);
+    if (!e->name)
+        return -1;
+    dir->count++;
+    if (mode == GIT_FILEMODE_TREE) {
+        e->dir = calloc(1, sizeof(*e->dir));
+        if (!e->dir)
+            return -1;
+        e->dir->path = *path;
+        *path = NULL;
+    }
+    return 0;
+}
+
+/* List dir, then queue its entries; they are not touched again by this
+ * thread, so the array stays put while other workers fill them in */
+static int save_read_dir(save_queue *q, save_dir *dir)
+{
+    DIR *d = opendir(dir->path);
+    if (!d) {
+        fprintf(stderr, "save: cannot open %s: %s\n", dir->path,
+                strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    size_t cap = 0;
+    struct dirent *de;
+    while (ret == 0 && (de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            strcmp(de->d_name, ".git") == 0)
+            continue;
+        char *path = join_path(dir->path, de->d_name);
+        struct stat st;
+        if (!path || lstat(path, &st) < 0) {
+            fprintf(stderr, "save: cannot stat %s\n", path ? path : de->d_name);
+            ret = -1;
+        } else if (save_add_entry(dir, &cap, de->d_name, &path, &st) < 0) {
+            ret = -1;
+        }
+        free(path);
+    }
+    closedir(d);
+    if (ret < 0)
+        return ret;
+
+    pthread_mutex_lock(&q->lock);
+    for (size_t i = 0; i < dir->count && ret == 0; i++)
+        ret = save_push(q, dir, &dir->entries[i]);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/* The target of the symlink at path, in a buffer sized from lstat; a
+ * target that fills it was changed meanwhile, so it is read again */
+static ssize_t read_link(const char *path, char **out)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0 || !S_ISLNK(st.st_mode))
+        return -1;
+    size_t size = (st.st_size > 0 ? (size_t)st.st_size : PATH_MAX) + 1;
+    for (;;) {
+        char *buf = malloc(size);
+        if (!buf)
+            return -1;
+        ssize_t n = readlink(path, buf, size);
+        if (n >= 0 && (size_t)n < size) {
+            *out = buf;
+            return n;
+        }
+        free(buf);
+        if (n < 0 || size > SSIZE_MAX / 2)
+            return -1;
+        size *= 2;
+    }
+}
+
+static int save_write_entry(save_queue *q, const save_dir *parent,
+                            save_entry *e)
+{
+    char *path = join_path(parent->path, e->name);
+    if (!path)
+        return -1;
+    int ret;
+    if (e->mode == GIT_FILEMODE_LINK) {
+        char *target = NULL;
+        ssize_t n = read_link(path, &target);
+        ret = n < 0 ? -1 : q->backend->write(q->backend, &e->oid, target,
+                                              (size_t)n, GIT_OBJECT_BLOB);
+        free(target);
+    } else {
+        struct stat st;
+        ret = add_file(q->backend, path, &st, &e->oid);
+    }
+    if (ret < 0)
+        fprintf(stderr, "save: cannot read %s\n", path);
+    free(path);
+    return ret;
+}
+
+static void *save_worker(void *arg)
+{
+    save_queue *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->njobs && q->active && !q->failed)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->failed || !q->njobs)
+            break;
+        save_job job = q->jobs[--q->njobs];
+        q->active++;
+        pthread_mutex_unlock(&q->lock);
+        int ret = job.entry->dir ? save_read_dir(q, job.entry->dir) :
+                                   save_write_entry(q, job.parent, job.entry);
+        pthread_mutex_lock(&q->lock);
+        q->active--;
+        if (ret < 0)
+            q->failed = 1;
+        if (!q->active || q->failed)
+            pthread_cond_broadcast(&q->cond);
+    }
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Write the tree for dir after its subdirectories; empty directories are
+ * left out, as git does */
+static int save_tree(git_repository *repo, const save_dir *dir, git_oid *out,
+                     int *empty)
+{
+    git_treebuilder *bld = NULL;
+    int ret = git_treebuilder_new(&bld, repo, NULL);
+    for (size_t i = 0; ret == 0 && i < dir->count; i++) {
+        save_entry *e = &dir->entries[i];
+        if (e->dir) {
+            int sub_empty;
+            ret = save_tree(repo, e->dir, &e->oid, &sub_empty);
+            if (ret < 0 || sub_empty)
+                continue;
+        }
+        ret = git_treebuilder_insert(NULL, bld, e->name, &e->oid, e->mode);
+    }
+    if (ret == 0) {
+        *empty = git_treebuilder_entrycount(bld) == 0;
+        ret = git_treebuilder_write(out, bld);
+    }
+    git_treebuilder_free(bld);
+    return ret;
+}
+
+static void save_dir_free(save_dir *dir)
+{
+    for (size_t i = 0; i < dir->count; i++) {
+        free(dir->entries[i].name);
+        if (dir->entries[i].dir) {
+            save_dir_free(dir->entries[i].dir);
+            free(dir->entries[i].dir);
+        }
+    }
+    free(dir->entries);
+    free(dir->path);
+}
+
+/* Make the index match the saved tree. git2 commit builds its tree from
+ * the index, so a stale one would drop what the save recorded. The
+ * entries carry no stat data, so git2 add re-reads every file once. */
+static int save_reset_index(git_repository *repo, const git_oid *tree_oid)
+{
+    git_tree *tree = NULL;
+    git_index *index = NULL;
+    int ret = git_tree_lookup(&tree, repo, tree_oid);
+    if (ret == 0)
+        ret = git_repository_index(&index, repo);
+    if (ret == 0)
+        ret = git_index_read_tree(index, tree);
+    if (ret == 0)
+        ret = git_index_write(index);
+    git_index_free(index);
+    git_tree_free(tree);
+    return ret;
+}
+
+static int cmd_save(const char *repo_path, const char *path,
+                    const char *message)
+{
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    git_odb_backend *backend = NULL;
+    int ret = open_with_backend(&repo, &odb, &backend, repo_path);
+    if (ret < 0)
+        return ret;
+
+    save_dir root = {0};
+    save_entry top = {0};
+    top.mode = GIT_FILEMODE_TREE;
+    top.dir = &root;
+    save_queue q = {0};
+    q.backend = backend;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    root.path = strdup(path);
+    if (!root.path || save_push(&q, NULL, &top) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* the calling thread is one of the workers. Each writes its files
+     * serially: a pipeline per file would run threads * threads hashing
+     * threads and hold threads * bup.maxInflight bytes */
+    bup_pipeline_params *pipeline = &((bup_odb_backend *)backend)->pipeline;
+    unsigned nthreads = bup_pipeline_threads(pipeline);
+    pipeline->threads = 1;
+    pthread_t threads[BUP_PIPELINE_MAX_THREADS];
+    unsigned started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, save_worker, &q) == 0)
+        started++;
+    save_worker(&q);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    /* finish the pack before a commit refers to it */
+    if (q.failed || bup_odb_flush(backend) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    git_oid tree_oid;
+    int empty;
+    ret = save_tree(repo, &root, &tree_oid, &empty);
+    if (ret == 0)
+        ret = commit_tree(repo, &tree_oid, message);
+    if (ret == 0)
+        ret = save_reset_index(repo, &tree_oid);
+
+out:
+    save_dir_free(&root);
+    free(q.jobs);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    return ret;
+}
+
 static int walk_tree(git_repository *repo, git_tree *tree)
 {
     size_t count = git_tree_entrycount(tree);
@@ -350,7 +1075,17 @@ static int oid_list_add(oid_list *list, const git_oid *oid)
     return 0;
 }
 
-static int collect_tree_oids(git_repository *repo, git_odb *odb, git_tree *tree, oid_list *list)
+static int oid_list_add_all(oid_list *list, const git_oid *oids, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (oid_list_add(list, &oids[i]) < 0)
+            return -1;
+    return 0;
+}
+
+static int collect_tree_oids(git_repository *repo, git_odb *odb,
+                             unsigned list_flags, bup_list_cache *lists,
+                             git_tree *tree, oid_list *list)
 {
     size_t count = git_tree_entrycount(tree);
     for (size_t i = 0; i < count; i++) {
@@ -362,31 +1097,25 @@ static int collect_tree_oids(git_repository *repo, git_odb *odb, git_tree *tree,
             git_object *obj = NULL;
             if (git_tree_entry_to_object(&obj, repo, entry) < 0)
                 return -1;
-            int ret = collect_tree_oids(repo, odb, (git_tree *)obj, list);
+            int ret = collect_tree_oids(repo, odb, list_flags, lists,
+                                        (git_tree *)obj, list);
             git_object_free(obj);
             if (ret < 0)
                 return ret;
         } else if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB) {
-            git_odb_object *obj = NULL;
-            if (git_odb_read(&obj, odb, oid) == 0) {
-                git_oid *oids = NULL;
-                size_t *lens = NULL;
-                size_t n = 0;
-                if (parse_chunk_list(git_odb_object_data(obj),
-                                     git_odb_object_size(obj),
-                                     &oids, &lens, &n) == 0) {
-                    for (size_t j = 0; j < n; j++) {
-                        if (oid_list_add(list, &oids[j]) < 0) {
-                            free(oids);
-                            free(lens);
-                            git_odb_object_free(obj);
-                            return -1;
-                        }
-                    }
-                    free(oids);
-                    free(lens);
-                }
-                git_odb_object_free(obj);
+            /* files unchanged between commits resolve from the cache */
+            bup_chunk_list *chunks = NULL;
+            int ret = bup_list_cache_get(&chunks, NULL, lists, odb,
+                                         list_flags, oid);
+            if (ret == -1)
+                return -1;
+            if (ret == 0) {
+                ret = oid_list_add_all(list, chunks->nodes, chunks->nnodes);
+                if (ret == 0)
+                    ret = oid_list_add_all(list, chunks->oids, chunks->count);
+                bup_chunk_list_release(chunks);
+                if (ret < 0)
+                    return -1;
             }
         }
     }
@@ -401,8 +1130,18 @@ static int collect_reachable_oids(git_repository *repo, oid_list *list)
         return ret;
     git_revwalk_push_head(walk);
 
+    unsigned list_flags;
+    size_t budget;
     git_odb *odb = NULL;
-    if (git_repository_odb(&odb, repo) < 0) {
+    if (bup_odb_read_list_flags(&list_flags, repo) < 0 ||
+        bup_odb_read_list_cache(&budget, repo) < 0 ||
+        git_repository_odb(&odb, repo) < 0) {
+        git_revwalk_free(walk);
+        return -1;
+    }
+    bup_list_cache lists;
+    if (bup_list_cache_init(&lists, budget) < 0) {
+        git_odb_free(odb);
         git_revwalk_free(walk);
         return -1;
     }
@@ -428,18 +1167,106 @@ static int collect_reachable_oids(git_repository *repo, oid_list *list)
             ret = -1;
             break;
         }
-        ret = collect_tree_oids(repo, odb, tree, list);
+        ret = collect_tree_oids(repo, odb, list_flags, &lists, tree, list);
         git_tree_free(tree);
         git_commit_free(commit);
         if (ret < 0)
             break;
     }
+    bup_oid_cache_free(&lists);
     git_revwalk_free(walk);
     git_odb_free(odb);
     return ret == GIT_ITEROVER ? 0 : ret;
 }
 
-static void remove_loose_objects(const char *repo_path)
+static int oid_cmp(const void *a, const void *b)
+{
+    return git_oid_cmp(a, b);
+}
+
+/* Return 1 if every object the version 2 pack index at path lists is in
+ * keep, which is sorted */
+static int pack_redundant(const char *path, const oid_list *keep)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    unsigned char header[8 + 256 * 4];
+    int redundant = fread(header, sizeof(header), 1, f) == 1 &&
+                    memcmp(header, "\377tOc\0\0\0\2", 8) == 0;
+    const unsigned char *n = header + 8 + 255 * 4;
+    uint32_t count = redundant ? (uint32_t)n[0] << 24 | (uint32_t)n[1] << 16 |
+                                 (uint32_t)n[2] << 8 | n[3] : 0;
+    unsigned char raw[GIT_OID_RAWSZ];
+    git_oid oid;
+    for (uint32_t i = 0; i < count && redundant; i++) {
+        redundant = fread(raw, sizeof(raw), 1, f) == 1;
+        if (redundant) {
+            git_oid_fromraw(&oid, raw);
+            redundant = bsearch(&oid, keep->oids, keep->count,
+                                sizeof(git_oid), oid_cmp) != NULL;
+        }
+    }
+    fclose(f);
+    return redundant;
+}
+
+/* Drop the packs other than new_pack whose objects it all holds, such as
+ * those add and save write; the .idx goes first so that no reader finds
+ * it without its pack */
+static void remove_redundant_packs(const char *repo_path, const char *new_pack,
+                                   const oid_list *keep)
+{
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/.git/objects/pack", repo_path);
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *ent;
+    char file[1024];
+    while ((ent = readdir(d))) {
+        const char *name = ent->d_name;
+        size_t len = strlen(name);
+        if (len < sizeof("pack-.idx") || strncmp(name, "pack-", 5) != 0 ||
+            strcmp(name + len - 4, ".idx") != 0 ||
+            strncmp(name + 5, new_pack, len - sizeof("pack-.idx") + 1) == 0)
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", dir, name);
+        if (!pack_redundant(file, keep) || unlink(file) < 0)
+            continue;
+        snprintf(file, sizeof(file), "%s/%.*s.pack", dir, (int)(len - 4), name);
+        unlink(file);
+    }
+    closedir(d);
+}
+
+/* Temporary packs that have not grown for BUP_PACK_TMP_EXPIRE seconds
+ * were left by a session that died or failed; a live writer appends to
+ * its pack or finishes it well before then */
+static void remove_stale_tmp_packs(const char *repo_path)
+{
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/.git/objects/pack", repo_path);
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    time_t now = time(NULL);
+    struct dirent *ent;
+    char file[1024];
+    struct stat st;
+    while ((ent = readdir(d))) {
+        if (strncmp(ent->d_name, BUP_PACK_TMP_PREFIX,
+                    sizeof(BUP_PACK_TMP_PREFIX) - 1) != 0)
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", dir, ent->d_name);
+        if (lstat(file, &st) == 0 && S_ISREG(st.st_mode) &&
+            now - st.st_mtime >= BUP_PACK_TMP_EXPIRE)
+            unlink(file);
+    }
+    closedir(d);
+}
+
+static void remove_packed_objects(const char *repo_path, const char *new_pack)
 {
     git_repository *repo = NULL;
     if (git_repository_open(&repo, repo_path) < 0)
@@ -459,6 +1286,9 @@ static void remove_loose_objects(const char *repo_path)
         return;
     }
 
+    qsort(keep.oids, keep.count, sizeof(git_oid), oid_cmp);
+    remove_redundant_packs(repo_path, new_pack, &keep);
+
     char objdir[512];
     snprintf(objdir, sizeof(objdir), "%s/.git/objects", repo_path);
     DIR *d = opendir(objdir);
@@ -488,17 +1318,10 @@ static void remove_loose_objects(const char *repo_path)
                 continue;
             snprintf(file, sizeof(file), "%s/%s", path, ent2->d_name);
             snprintf(hex, sizeof(hex), "%s%s", ent->d_name, ent2->d_name);
-            if (git_oid_fromstr(&oid, hex) == 0) {
-                int keep_obj = 0;
-                for (size_t i = 0; i < keep.count; i++) {
-                    if (git_oid_cmp(&keep.oids[i], &oid) == 0) {
-                        keep_obj = 1;
-                        break;
-                    }
-                }
-                if (keep_obj)
-                    unlink(file);
-            }
+            if (git_oid_fromstr(&oid, hex) == 0 &&
+                bsearch(&oid, keep.oids, keep.count, sizeof(git_oid),
+                        oid_cmp))
+                unlink(file);
         }
         closedir(sd);
         rmdir(path); /* ignore failure if not empty */
@@ -537,12 +1360,30 @@ static int cmd_repack(const char *repo_path)
         goto out_pb;
 
     ret = git_packbuilder_write(pb, NULL, 0, NULL, NULL);
+    char pack_name[GIT_OID_HEXSZ + 1] = "";
+    if (ret == 0)
+        snprintf(pack_name, sizeof(pack_name), "%s", git_packbuilder_name(pb));
     git_packbuilder_free(pb);
     pb = NULL;
+    if (ret == 0) {
+        /* fold the chunk log into the sorted index while we are at it */
+        bup_chunk_index idx;
+        double fp_rate;
+        ret = bup_odb_read_bloom_fp(&fp_rate, repo);
+        if (ret == 0)
+            ret = bup_chunk_index_open(&idx, git_repository_path(repo),
+                                       fp_rate);
+        if (ret == 0) {
+            ret = bup_chunk_index_merge(&idx);
+            bup_chunk_index_close(&idx);
+        }
+    }
     git_repository_free(repo);
     repo = NULL;
-    if (ret == 0)
-        remove_loose_objects(repo_path);
+    if (ret == 0) {
+        remove_packed_objects(repo_path, pack_name);
+        remove_stale_tmp_packs(repo_path);
+    }
 
 out_pb:
     if (pb)
@@ -609,12 +1450,37 @@ int main(int argc, char **argv)
                 ret = cmd_commit(repo_path, msg);
             }
         }
+    } else if (strcmp(cmd, "save") == 0) {
+        const char *msg = "save";
+        if (arg + 1 < argc && strcmp(argv[arg], "-m") == 0) {
+            msg = argv[arg + 1];
+            arg += 2;
+        }
+        if (!repo_path || argc - arg != 1) {
+            fprintf(stderr, "save requires -C <repo>, [-m <message>] and a"
+                            " directory\n");
+            ret = 1;
+        } else {
+            ret = cmd_save(repo_path, argv[arg], msg);
+        }
     } else if (strcmp(cmd, "show") == 0) {
+        const char *range = NULL;
+        if (arg < argc && strncmp(argv[arg], "--range=", 8) == 0)
+            range = argv[arg++] + 8;
         if (arg >= argc) {
-            fprintf(stderr, "show requires an object spec\n");
+            fprintf(stderr, "show requires [--range=<offset>:<length>] and"
+                            " an object spec\n");
             ret = 1;
         } else {
-            ret = cmd_show(repo_path, argv[arg]);
+            ret = cmd_show(repo_path, argv[arg], range);
+        }
+    } else if (strcmp(cmd, "restore") == 0) {
+        if (argc - arg != 2) {
+            fprintf(stderr, "restore requires <rev>[:<path>] and a"
+                            " destination\n");
+            ret = 1;
+        } else {
+            ret = cmd_restore(repo_path, argv[arg], argv[arg + 1]);
         }
     } else if (strcmp(cmd, "repack") == 0) {
         if (!repo_path) {
@@ -623,6 +1489,15 @@ int main(int argc, char **argv)
         } else {
             ret = cmd_repack(repo_path);
         }
+    } else if (strcmp(cmd, "chunking") == 0) {
+        if (!repo_path || (argc - arg != 0 && argc - arg != 3 &&
+                           argc - arg != 4)) {
+            fprintf(stderr, "chunking requires -C <repo> and optionally"
+                            " <min> <avg> <max> [rollsum|fastcdc]\n");
+            ret = 1;
+        } else {
+            ret = cmd_chunking(repo_path, argc - arg, argv + arg);
+        }
     } else if (strcmp(cmd, "fsck") == 0) {
         if (!repo_path) {
             fprintf(stderr, "fsck requires -C <repo>\n");
@@ -0,0 +1,180 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 2500000
+#define REPO_TEMPLATE "add_input_repoXXXXXX"
+/* The file truncated under add is this many blobs long, and cut back to
+ * one once add has mapped it. An add that unmaps it before it is stopped
+ * proves nothing, so it is retried up to SHRINK_ATTEMPTS times. */
+#define SHRINK_COPIES 40
+#define SHRINK_ATTEMPTS 5
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(808);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void write_file(const char *path, const char *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(data, 1, len, f) == len);
+    fclose(f);
+}
+
+static void verify_head_blob(const char *repo, const char *path,
+                             const char *data, size_t len)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s show HEAD:%s", repo, path);
+    FILE *p = popen(cmd, "r");
+    assert(p);
+    char *buf = malloc(len + 1);
+    assert(fread(buf, 1, len + 1, p) == len);
+    assert(pclose(p) == 0);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+}
+
+/* Whether process pid has a mapping of a file whose path ends in name */
+static int has_mapping(pid_t pid, const char *name)
+{
+    char maps[64];
+    snprintf(maps, sizeof(maps), "/proc/%d/maps", (int)pid);
+    FILE *f = fopen(maps, "r");
+    if (!f)
+        return 0;
+    char line[1024];
+    size_t nlen = strlen(name);
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\n");
+        found = len > nlen && line[len - nlen - 1] == '/' &&
+                memcmp(line + len - nlen, name, nlen) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+/* Add the file at path under repo as name, truncating it to one blob
+ * while add has it mapped. Returns 1 with add's exit status in *status
+ * if the truncation happened under the mapping, 0 if add got past it
+ * first. */
+static int add_while_truncating(const char *repo, const char *path,
+                                const char *name, const char *data,
+                                int *status)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (int i = 0; i < SHRINK_COPIES; i++)
+        assert(write(fd, data, BLOB_SIZE) == BLOB_SIZE);
+    close(fd);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        execl("./git2", "git2", "-C", repo, "add", name, (char *)NULL);
+        _exit(127);
+    }
+    while (!has_mapping(pid, name) && waitpid(pid, status, WNOHANG) == 0)
+        ;
+    /* stopped, add cannot unmap the file between the check and the
+     * truncation */
+    int mapped = kill(pid, SIGSTOP) == 0 &&
+                 waitpid(pid, status, WUNTRACED) == pid &&
+                 WIFSTOPPED(*status) && has_mapping(pid, name);
+    if (mapped)
+        assert(truncate(path, BLOB_SIZE) == 0);
+    kill(pid, SIGCONT);
+    while (waitpid(pid, status, 0) == pid && !WIFEXITED(*status) &&
+           !WIFSIGNALED(*status))
+        ;
+    return mapped;
+}
+
+int main(void)
+{
+    setenv("GIT_AUTHOR_NAME", "Tester", 1);
+    setenv("GIT_AUTHOR_EMAIL", "tester@example.com", 1);
+    setenv("GIT_COMMITTER_NAME", "Tester", 1);
+    setenv("GIT_COMMITTER_EMAIL", "tester@example.com", 1);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "./git2 init %s", repo);
+    assert(system(cmd) == 0);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    char path[512];
+
+    /* a regular file is mapped, an empty one and a pipe are streamed */
+    snprintf(path, sizeof(path), "%s/mapped.bin", repo);
+    write_file(path, data, BLOB_SIZE);
+    snprintf(path, sizeof(path), "%s/empty.bin", repo);
+    write_file(path, data, 0);
+    snprintf(path, sizeof(path), "%s/pipe.bin", repo);
+    assert(mkfifo(path, 0600) == 0);
+    snprintf(cmd, sizeof(cmd), "cat %s/mapped.bin > %s &", repo, path);
+    assert(system(cmd) == 0);
+
+    const char *files[] = { "mapped.bin", "empty.bin", "pipe.bin" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        snprintf(cmd, sizeof(cmd), "./git2 -C %s add %s", repo, files[i]);
+        assert(system(cmd) == 0);
+    }
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s commit -m inputs", repo);
+    assert(system(cmd) == 0);
+    verify_head_blob(repo, "mapped.bin", data, BLOB_SIZE);
+    verify_head_blob(repo, "empty.bin", data, 0);
+    verify_head_blob(repo, "pipe.bin", data, BLOB_SIZE);
+
+    /* both paths chunk the same bytes into the same blob */
+    git_libgit2_init();
+    git_repository *r = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    git_index *index = NULL;
+    assert(git_repository_index(&index, r) == 0);
+    const git_index_entry *mapped = git_index_get_bypath(index, "mapped.bin", 0);
+    const git_index_entry *piped = git_index_get_bypath(index, "pipe.bin", 0);
+    assert(mapped && piped);
+    assert(git_oid_cmp(&mapped->id, &piped->id) == 0);
+    assert(piped->file_size == BLOB_SIZE);
+    git_index_free(index);
+
+    /* a file cut short while it is mapped fails the add instead of
+     * killing it with SIGBUS, and the index does not record it */
+    char name[64];
+    int status = 0;
+    int attempt = 0;
+    for (;; attempt++) {
+        assert(attempt < SHRINK_ATTEMPTS);
+        snprintf(name, sizeof(name), "shrinking%d.bin", attempt);
+        snprintf(path, sizeof(path), "%s/%s", repo, name);
+        if (add_while_truncating(repo, path, name, data, &status))
+            break;
+    }
+    assert(WIFEXITED(status) && WEXITSTATUS(status) != 0);
+    assert(git_repository_index(&index, r) == 0);
+    assert(!git_index_get_bypath(index, name, 0));
+    git_index_free(index);
+    git_repository_free(r);
+    git_libgit2_shutdown();
+
+    free(data);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", repo);
+    system(cmd);
+    return 0;
+}
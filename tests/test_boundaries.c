@@ -0,0 +1,156 @@
+#include "chunk_utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DATA_SIZE 300000
+#define MAX_CUTS (DATA_SIZE + 1)
+#define SMALL_BATCH 3
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+static const bup_split_params param_sets[] = {
+    BUP_SPLIT_PARAMS_DEFAULT,
+    BUP_SPLIT_PARAMS_LEGACY,
+    { 1, 256, 0x1f },
+    { 64, 65536, 0x3ff },
+    { 100, 1000, 0x7f },
+    { 2048, 16384, 0x1fff },
+    { 32, 1 << 20, 0x30fff },
+};
+
+/* The smallest averages FastCDC accepts; its large-chunk mask is two
+ * bits easier than the average and must not wrap around */
+static const bup_split_params tiny_params[] = {
+    { 1, 256, 0x1 },
+    { 1, 256, 0x3 },
+};
+
+static void fill_data(uint8_t *buf, size_t len)
+{
+    srand(4321);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)(rand() % 256);
+    /* long runs and short periods exercise degenerate windows */
+    memset(buf + len / 3, 0, 20000);
+    for (size_t i = 0; i < 20000; i++)
+        buf[len / 2 + i] = (uint8_t)(i % 7);
+}
+
+/* The write loop as it was before bup_find_cuts() */
+static size_t reference_cuts(const bup_split_params *p, const uint8_t *buf,
+                             size_t len, size_t *cuts)
+{
+    Rollsum r;
+    rollsum_init(&r);
+    size_t n = 0;
+    size_t chunk_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        rollsum_roll(&r, buf[i]);
+        chunk_len++;
+        if (chunk_len >= p->min_chunk &&
+            ((rollsum_digest(&r) & p->mask) == 0 ||
+             chunk_len >= p->max_chunk)) {
+            cuts[n++] = i + 1;
+            chunk_len = 0;
+        }
+    }
+    return n;
+}
+
+/* Feed buf in pieces of at most piece bytes, at most batch cuts per call */
+static size_t scanner_cuts(const bup_chunker_engine *engine,
+                           const bup_split_params *p, const uint8_t *buf,
+                           size_t len, size_t piece, size_t batch,
+                           size_t *cuts)
+{
+    bup_chunker c;
+    bup_chunker_init(&c, engine, p);
+    size_t n = 0;
+    size_t ofs = 0;
+    while (ofs < len) {
+        size_t avail = len - ofs < piece ? len - ofs : piece;
+        size_t got = bup_chunker_feed(&c, buf + ofs, avail, cuts + n, batch);
+        for (size_t k = 0; k < got; k++)
+            cuts[n + k] += ofs;
+        n += got;
+        ofs = got == batch ? cuts[n - 1] : ofs + avail;
+    }
+    return n;
+}
+
+int main(void)
+{
+    uint8_t *data = malloc(DATA_SIZE);
+    size_t *expect = malloc(sizeof(size_t) * MAX_CUTS);
+    size_t *got = malloc(sizeof(size_t) * MAX_CUTS);
+    assert(data && expect && got);
+    fill_data(data, DATA_SIZE);
+
+    for (size_t k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++) {
+        if (rollsum_set_kernel(kernel_names[k]) < 0) {
+            printf("kernel %s unsupported, skipping\n", kernel_names[k]);
+            continue;
+        }
+        assert(strcmp(rollsum_kernel_name(), kernel_names[k]) == 0);
+
+        for (size_t p = 0; p < sizeof(param_sets) / sizeof(param_sets[0]); p++) {
+            const bup_split_params *params = &param_sets[p];
+            size_t n = reference_cuts(params, data, DATA_SIZE, expect);
+
+            size_t m = scanner_cuts(&bup_chunker_rollsum, params, data,
+                                    DATA_SIZE, DATA_SIZE, MAX_CUTS, got);
+            assert(m == n && memcmp(got, expect, n * sizeof(size_t)) == 0);
+
+            m = scanner_cuts(&bup_chunker_rollsum, params, data, DATA_SIZE,
+                             1000, SMALL_BATCH, got);
+            assert(m == n && memcmp(got, expect, n * sizeof(size_t)) == 0);
+
+            m = scanner_cuts(&bup_chunker_rollsum, params, data, DATA_SIZE,
+                             37, MAX_CUTS, got);
+            assert(m == n && memcmp(got, expect, n * sizeof(size_t)) == 0);
+
+            printf("kernel=%s min=%zu max=%zu cuts=%zu\n", kernel_names[k],
+                   params->min_chunk, params->max_chunk, n);
+        }
+    }
+
+    /* FastCDC has no byte-at-a-time reference; cuts must not depend on
+     * how the input is fed and must respect the size bounds */
+    for (size_t p = 0; p < sizeof(param_sets) / sizeof(param_sets[0]); p++) {
+        const bup_split_params *params = &param_sets[p];
+        size_t n = scanner_cuts(&bup_chunker_fastcdc, params, data, DATA_SIZE,
+                                DATA_SIZE, MAX_CUTS, expect);
+        size_t m = scanner_cuts(&bup_chunker_fastcdc, params, data, DATA_SIZE,
+                                1000, SMALL_BATCH, got);
+        assert(m == n && memcmp(got, expect, n * sizeof(size_t)) == 0);
+        m = scanner_cuts(&bup_chunker_fastcdc, params, data, DATA_SIZE, 37,
+                         MAX_CUTS, got);
+        assert(m == n && memcmp(got, expect, n * sizeof(size_t)) == 0);
+
+        size_t prev = 0;
+        for (size_t i = 0; i < n; i++) {
+            assert(expect[i] - prev >= params->min_chunk);
+            assert(expect[i] - prev <= params->max_chunk);
+            prev = expect[i];
+        }
+        printf("engine=fastcdc min=%zu max=%zu cuts=%zu\n",
+               params->min_chunk, params->max_chunk, n);
+    }
+
+    for (size_t p = 0; p < sizeof(tiny_params) / sizeof(tiny_params[0]); p++) {
+        const bup_split_params *params = &tiny_params[p];
+        size_t n = scanner_cuts(&bup_chunker_fastcdc, params, data, DATA_SIZE,
+                                DATA_SIZE, MAX_CUTS, expect);
+        /* random data: chunks stay near the average, far from max */
+        assert(n > 0 && expect[n - 1] / n < 4 * (params->mask + 1));
+        printf("engine=fastcdc avg=%zu cuts=%zu\n",
+               (size_t)params->mask + 1, n);
+    }
+
+    free(got);
+    free(expect);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 2000000
+#define EDIT_OFFSET 1000000
+#define EDIT_SIZE 100
+#define SMALL_BUDGET 100000
+#define READ_THREADS 4
+#define REPO_TEMPLATE "cache_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(99);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static char *make_repo(char *tmpl, int64_t budget)
+{
+    char *path = mkdtemp(tmpl);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int64(cfg, "bup.chunkCache", budget) == 0);
+    /* prefetch threads share the cache */
+    assert(git_config_set_int32(cfg, "bup.readThreads", READ_THREADS) == 0);
+    git_config_free(cfg);
+    size_t got = 0;
+    assert(bup_odb_read_chunk_cache(&got, repo) == 0);
+    assert(got == (size_t)budget);
+    git_repository_free(repo);
+    return path;
+}
+
+static void read_blob(git_odb_backend *backend, const git_oid *oid,
+                      const char *data)
+{
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, oid) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+}
+
+static size_t chunk_count(git_odb_backend *backend, const git_oid *oid)
+{
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = bup_backend_object_chunk_count(backend, oid, &oids, &lens);
+    free(oids);
+    free(lens);
+    return n;
+}
+
+static void remove_repo(const char *path)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char *v1 = malloc(BLOB_SIZE);
+    char *v2 = malloc(BLOB_SIZE);
+    fill_random(v1, BLOB_SIZE);
+    memcpy(v2, v1, BLOB_SIZE);
+    memset(v2 + EDIT_OFFSET, 'x', EDIT_SIZE);
+
+    char big_tmp[] = REPO_TEMPLATE;
+    char *big = make_repo(big_tmp, (int64_t)BUP_CHUNK_CACHE_DEFAULT);
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, big) == 0);
+    git_oid oid1, oid2;
+    assert(backend->write(backend, &oid1, v1, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(backend->write(backend, &oid2, v2, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    size_t n1 = chunk_count(backend, &oid1);
+    size_t n2 = chunk_count(backend, &oid2);
+
+    bup_cache_stats st;
+    read_blob(backend, &oid1, v1);
+    bup_odb_chunk_cache_stats(backend, &st);
+    assert(st.hits == 0 && st.misses == n1);
+    assert(st.entries == n1 && st.bytes == BLOB_SIZE);
+
+    /* the next version only inflates the chunks around the edit */
+    read_blob(backend, &oid2, v2);
+    bup_odb_chunk_cache_stats(backend, &st);
+    assert(st.misses > n1 && st.misses < n1 + 4);
+    assert(st.hits + st.misses == n1 + n2);
+    assert(st.bytes <= BUP_CHUNK_CACHE_DEFAULT);
+
+    /* streams and range reads go through the same cache */
+    uint64_t hits = st.hits;
+    char part[EDIT_SIZE];
+    size_t got = 0;
+    assert(bup_odb_read_range(backend, &oid1, 0, sizeof(part), part, &got) == 0);
+    assert(got == sizeof(part) && memcmp(part, v1, sizeof(part)) == 0);
+    bup_odb_chunk_cache_stats(backend, &st);
+    assert(st.hits == hits + 1);
+    backend->free(backend);
+
+    /* a small budget is never exceeded */
+    char small_tmp[] = REPO_TEMPLATE;
+    char *small = make_repo(small_tmp, SMALL_BUDGET);
+    assert(bup_odb_backend_new(&backend, small) == 0);
+    assert(backend->write(backend, &oid1, v1, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    read_blob(backend, &oid1, v1);
+    read_blob(backend, &oid1, v1);
+    bup_odb_chunk_cache_stats(backend, &st);
+    assert(st.bytes <= SMALL_BUDGET && st.entries > 0);
+    assert(st.hits + st.misses == 2 * n1);
+    backend->free(backend);
+
+    /* and 0 turns it off */
+    char off_tmp[] = REPO_TEMPLATE;
+    char *off = make_repo(off_tmp, 0);
+    assert(bup_odb_backend_new(&backend, off) == 0);
+    assert(backend->write(backend, &oid1, v1, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    read_blob(backend, &oid1, v1);
+    bup_odb_chunk_cache_stats(backend, &st);
+    assert(st.hits == 0 && st.misses == 0 && st.entries == 0);
+    backend->free(backend);
+
+    free(v1);
+    free(v2);
+    remove_repo(big);
+    remove_repo(small);
+    remove_repo(off);
+    git_libgit2_shutdown();
+    return 0;
+}
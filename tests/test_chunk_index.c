@@ -0,0 +1,253 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 300000
+#define REPO_TEMPLATE "index_repoXXXXXX"
+#define BLOOM_TEMPLATE "bloom_dirXXXXXX"
+#define BLOOM_ENTRIES 70000
+#define BLOOM_PROBES 200000
+
+static const char *detect_cli(void)
+{
+    return "./git2";
+}
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static size_t write_blob(const char *repo, const char *data, size_t len,
+                         git_oid **chunks, size_t **lens)
+{
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, len, GIT_OBJECT_BLOB) == 0);
+    size_t n = bup_backend_object_chunk_count(backend, &oid, chunks, lens);
+    backend->free(backend);
+    return n;
+}
+
+static long file_size(const char *repo, const char *name)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/.git/" BUP_INDEX_DIR "/%s", repo, name);
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void check_indexed(const char *repo, const git_oid *chunks,
+                          const size_t *lens, size_t n)
+{
+    char gitdir[512];
+    snprintf(gitdir, sizeof(gitdir), "%s/.git", repo);
+    bup_chunk_index idx;
+    assert(bup_chunk_index_open(&idx, gitdir, 0) == 0);
+    for (size_t i = 0; i < n; i++) {
+        size_t len = 0;
+        assert(bup_chunk_index_maybe(&idx, &chunks[i]));
+        assert(bup_chunk_index_find(&idx, &chunks[i], &len) == 1);
+        assert(len == lens[i]);
+    }
+    git_oid missing;
+    memset(&missing, 0xab, sizeof(missing));
+    size_t len;
+    assert(bup_chunk_index_find(&idx, &missing, &len) == 0);
+    bup_chunk_index_close(&idx);
+}
+
+static void random_oid(git_oid *oid)
+{
+    for (size_t j = 0; j < GIT_OID_RAWSZ; j++)
+        oid->id[j] = (unsigned char)(rand() % 256);
+}
+
+static double false_positives(const bup_chunk_index *idx)
+{
+    size_t hits = 0;
+    git_oid oid;
+    for (size_t i = 0; i < BLOOM_PROBES; i++) {
+        random_oid(&oid);
+        hits += (size_t)bup_chunk_index_maybe(idx, &oid);
+    }
+    return (double)hits / BLOOM_PROBES;
+}
+
+static void check_bloom(void)
+{
+    char dir_tmp[] = BLOOM_TEMPLATE;
+    char *dir = mkdtemp(dir_tmp);
+    assert(dir);
+    git_oid *oids = malloc(sizeof(git_oid) * BLOOM_ENTRIES);
+    srand(3);
+    bup_chunk_index idx;
+    assert(bup_chunk_index_open(&idx, dir, 0) == 0);
+    assert(idx.bloom && idx.bloom_capacity == BUP_BLOOM_MIN_CAPACITY);
+    for (size_t i = 0; i < BLOOM_ENTRIES; i++) {
+        random_oid(&oids[i]);
+        assert(bup_chunk_index_add(&idx, &oids[i], i) == 0);
+        assert(bup_chunk_index_maybe(&idx, &oids[i]));
+    }
+    /* closing merges the log, outgrowing the filter */
+    bup_chunk_index_close(&idx);
+
+    assert(bup_chunk_index_open(&idx, dir, 0) == 0);
+    assert(idx.count == BLOOM_ENTRIES);
+    assert(idx.bloom_capacity == 2 * BLOOM_ENTRIES);
+    for (size_t i = 0; i < BLOOM_ENTRIES; i++)
+        assert(bup_chunk_index_maybe(&idx, &oids[i]));
+    double fp = false_positives(&idx);
+    printf("bloom k=%u fp=%.4f\n", idx.bloom_k, fp);
+    assert(fp < BUP_BLOOM_FP_DEFAULT);
+    bup_chunk_index_close(&idx);
+
+    /* another rate rebuilds the filter */
+    assert(bup_chunk_index_open(&idx, dir, 0.001) == 0);
+    assert(idx.bloom_k == 10);
+    for (size_t i = 0; i < BLOOM_ENTRIES; i++)
+        assert(bup_chunk_index_maybe(&idx, &oids[i]));
+    fp = false_positives(&idx);
+    printf("bloom k=%u fp=%.4f\n", idx.bloom_k, fp);
+    assert(fp < 0.001);
+    bup_chunk_index_close(&idx);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+    free(oids);
+}
+
+static char *loose_path(const char *repo, const git_oid *oid)
+{
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), oid);
+    char *path = malloc(512);
+    snprintf(path, 512, "%s/.git/objects/%.2s/%s", repo, hex, hex + 2);
+    return path;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    const char *cli = detect_cli();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s init %s", cli, repo);
+    assert(system(cmd) == 0);
+    /* chunks are written loose, so that one can be removed below */
+    git_repository *r = NULL;
+    git_config *cfg = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(git_repository_config(&cfg, r) == 0);
+    assert(git_config_set_bool(cfg, "bup.packWrites", 0) == 0);
+
+    char *a = malloc(BLOB_SIZE), *b = malloc(BLOB_SIZE);
+    fill_random(a, BLOB_SIZE, 1);
+    fill_random(b, BLOB_SIZE, 2);
+    git_oid *chunks_a = NULL, *chunks_b = NULL;
+    size_t *lens_a = NULL, *lens_b = NULL;
+
+    /* the first process logs its chunks, the next one finds them */
+    size_t na = write_blob(repo, a, BLOB_SIZE, &chunks_a, &lens_a);
+    assert(na > 2);
+    assert(file_size(repo, BUP_INDEX_LOG) == (long)(na * BUP_INDEX_ENTRY_SIZE));
+    assert(file_size(repo, BUP_INDEX_FILE) < 0);
+    check_indexed(repo, chunks_a, lens_a, na);
+
+    /* indexed chunks are not written again */
+    char *victim = loose_path(repo, &chunks_a[1]);
+    assert(unlink(victim) == 0);
+    free(chunks_a);
+    free(lens_a);
+    na = write_blob(repo, a, BLOB_SIZE, &chunks_a, &lens_a);
+    assert(access(victim, F_OK) != 0);
+    assert(file_size(repo, BUP_INDEX_LOG) == (long)(na * BUP_INDEX_ENTRY_SIZE));
+
+    /* merging moves the log into the sorted index */
+    char gitdir[512];
+    snprintf(gitdir, sizeof(gitdir), "%s/.git", repo);
+    bup_chunk_index idx;
+    assert(bup_chunk_index_open(&idx, gitdir, 0) == 0);
+    assert(bup_chunk_index_merge(&idx) == 0);
+    assert(idx.count == na && idx.journal_count == 0);
+    bup_chunk_index_close(&idx);
+    assert(file_size(repo, BUP_INDEX_LOG) == 0);
+    assert(file_size(repo, BUP_INDEX_FILE) ==
+           (long)(BUP_INDEX_HEADER_SIZE + 256 * 4 + na * BUP_INDEX_ENTRY_SIZE));
+    check_indexed(repo, chunks_a, lens_a, na);
+
+    /* lookups cover the mapped index and the log together */
+    size_t nb = write_blob(repo, b, BLOB_SIZE, &chunks_b, &lens_b);
+    assert(file_size(repo, BUP_INDEX_LOG) == (long)(nb * BUP_INDEX_ENTRY_SIZE));
+    check_indexed(repo, chunks_a, lens_a, na);
+    check_indexed(repo, chunks_b, lens_b, nb);
+
+    /* repack merges as well */
+    snprintf(cmd, sizeof(cmd), "%s -C %s repack", cli, repo);
+    assert(system(cmd) == 0);
+    assert(file_size(repo, BUP_INDEX_LOG) == 0);
+    check_indexed(repo, chunks_a, lens_a, na);
+    check_indexed(repo, chunks_b, lens_b, nb);
+
+    /* a damaged index is ignored and chunks are simply written again */
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" BUP_INDEX_DIR "/" BUP_INDEX_FILE, gitdir);
+    assert(truncate(path, 100) == 0);
+    assert(bup_chunk_index_open(&idx, gitdir, 0) == 0);
+    size_t len;
+    assert(idx.count == 0 && !bup_chunk_index_find(&idx, &chunks_a[0], &len));
+    bup_chunk_index_close(&idx);
+    free(chunks_a);
+    free(lens_a);
+    na = write_blob(repo, a, BLOB_SIZE, &chunks_a, &lens_a);
+    assert(access(victim, F_OK) == 0);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    void *buf = NULL;
+    size_t rlen = 0;
+    git_object_t type = 0;
+    git_oid oid;
+    assert(backend->write(backend, &oid, a, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(backend->read(&buf, &rlen, &type, backend, &oid) == 0);
+    assert(rlen == BLOB_SIZE && memcmp(buf, a, rlen) == 0);
+    free(buf);
+    backend->free(backend);
+
+    /* the rate comes from the repository config */
+    assert(git_config_set_string(cfg, "bup.bloomFpRate", "0.001") == 0);
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    assert(((bup_odb_backend *)backend)->chunk_index.bloom_k == 10);
+    backend->free(backend);
+    assert(git_config_set_string(cfg, "bup.bloomFpRate", "2") == 0);
+    assert(bup_odb_backend_new(&backend, repo) < 0);
+    git_config_free(cfg);
+    git_repository_free(r);
+
+    check_bloom();
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", repo);
+    system(cmd);
+    free(victim);
+    free(chunks_a);
+    free(lens_a);
+    free(chunks_b);
+    free(lens_b);
+    free(a);
+    free(b);
+    git_libgit2_shutdown();
+    return 0;
+}
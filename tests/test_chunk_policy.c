@@ -0,0 +1,231 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 200000
+#define INSERT_POS 10
+#define REPO_TEMPLATE "policy_repoXXXXXX"
+#define LEGACY_TEMPLATE "legacy_repoXXXXXX"
+
+static const char *detect_cli(void)
+{
+    return "./git2";
+}
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(99);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static size_t store_blob_get_chunks(git_odb_backend *backend, const void *data,
+                                    size_t len, git_oid **chunks, size_t **lens)
+{
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, len, GIT_OBJECT_BLOB) == 0);
+    return bup_backend_object_chunk_count(backend, &oid, chunks, lens);
+}
+
+static size_t count_reused(const git_oid *new_chunks, size_t new_count,
+                           const git_oid *old_chunks, size_t old_count)
+{
+    size_t reused = 0;
+    for (size_t i = 0; i < new_count; i++) {
+        for (size_t j = 0; j < old_count; j++) {
+            if (git_oid_cmp(&new_chunks[i], &old_chunks[j]) == 0) {
+                reused++;
+                break;
+            }
+        }
+    }
+    return reused;
+}
+
+static void read_params(const char *repo_path, bup_split_params *out)
+{
+    git_repository *repo = NULL;
+    assert(git_repository_open(&repo, repo_path) == 0);
+    assert(bup_odb_read_split_params(out, repo) == 0);
+    git_repository_free(repo);
+}
+
+static void check_variable_policy(const char *repo, const char *data,
+                                  const char *shifted)
+{
+    bup_split_params params;
+    const bup_split_params def = BUP_SPLIT_PARAMS_DEFAULT;
+    read_params(repo, &params);
+    assert(params.min_chunk == def.min_chunk);
+    assert(params.max_chunk == def.max_chunk);
+    assert(params.mask == def.mask);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+
+    git_oid *chunks1 = NULL, *chunks2 = NULL;
+    size_t *lens1 = NULL, *lens2 = NULL;
+    size_t n1 = store_blob_get_chunks(backend, data, BLOB_SIZE, &chunks1, &lens1);
+    assert(n1 > 2);
+    int varied = 0;
+    for (size_t i = 0; i < n1; i++) {
+        assert(lens1[i] <= params.max_chunk);
+        if (i + 1 < n1)
+            assert(lens1[i] >= params.min_chunk);
+        if (lens1[i] != lens1[0])
+            varied = 1;
+    }
+    assert(varied);
+
+    /* a one-byte insertion only disturbs the chunks around it */
+    size_t n2 = store_blob_get_chunks(backend, shifted, BLOB_SIZE + 1,
+                                      &chunks2, &lens2);
+    size_t reused = count_reused(chunks2, n2, chunks1, n1);
+    printf("variable chunks=%zu reused=%zu\n", n2, reused);
+    assert(reused + 2 >= n1);
+
+    free(chunks1);
+    free(lens1);
+    free(chunks2);
+    free(lens2);
+    backend->free(backend);
+}
+
+static void check_fastcdc_engine(const char *cli, const char *repo,
+                                 const char *data, const char *shifted)
+{
+    git_repository *r = NULL;
+    const bup_chunker_engine *engine = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(bup_odb_read_chunker(&engine, r) == 0);
+    assert(engine == &bup_chunker_rollsum);
+    git_repository_free(r);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s -C %s chunking 2048 8192 32768 fastcdc",
+             cli, repo);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd),
+             "%s -C %s chunking 2048 8192 32768 nosuch 2>/dev/null", cli, repo);
+    assert(system(cmd) != 0);
+
+    assert(git_repository_open(&r, repo) == 0);
+    assert(bup_odb_read_chunker(&engine, r) == 0);
+    assert(engine == &bup_chunker_fastcdc);
+    git_repository_free(r);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    assert(((bup_odb_backend *)backend)->chunker == &bup_chunker_fastcdc);
+
+    git_oid *chunks1 = NULL, *chunks2 = NULL;
+    size_t *lens1 = NULL, *lens2 = NULL;
+    size_t n1 = store_blob_get_chunks(backend, data, BLOB_SIZE, &chunks1, &lens1);
+    size_t n2 = store_blob_get_chunks(backend, shifted, BLOB_SIZE + 1,
+                                      &chunks2, &lens2);
+    size_t reused = count_reused(chunks2, n2, chunks1, n1);
+    printf("fastcdc chunks=%zu reused=%zu\n", n2, reused);
+    assert(n1 > 2);
+    assert(reused + 2 >= n1);
+
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    git_oid oid;
+    assert(backend->write(backend, &oid, shifted, BLOB_SIZE + 1,
+                          GIT_OBJECT_BLOB) == 0);
+    assert(backend->read(&buf, &len, &type, backend, &oid) == 0);
+    assert(len == BLOB_SIZE + 1 && memcmp(buf, shifted, len) == 0);
+    free(buf);
+
+    free(chunks1);
+    free(lens1);
+    free(chunks2);
+    free(lens2);
+    backend->free(backend);
+}
+
+static void check_legacy_policy(const char *cli, const char *repo,
+                                const char *data)
+{
+    git_repository *r = NULL;
+    assert(git_repository_init(&r, repo, 0) == 0);
+    git_repository_free(r);
+
+    bup_split_params params;
+    read_params(repo, &params);
+    assert(params.min_chunk == BUP_LEGACY_CHUNK);
+    assert(params.max_chunk == BUP_LEGACY_CHUNK);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    git_oid *chunks = NULL;
+    size_t *lens = NULL;
+    size_t n = store_blob_get_chunks(backend, data, BLOB_SIZE, &chunks, &lens);
+    assert(n == (BLOB_SIZE + BUP_LEGACY_CHUNK - 1) / BUP_LEGACY_CHUNK);
+    for (size_t i = 0; i + 1 < n; i++)
+        assert(lens[i] == BUP_LEGACY_CHUNK);
+    free(chunks);
+    free(lens);
+    backend->free(backend);
+
+    /* opting in switches later writes to the recorded policy */
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s -C %s chunking 1024 4096 16384", cli, repo);
+    assert(system(cmd) == 0);
+    read_params(repo, &params);
+    assert(params.min_chunk == 1024 && params.max_chunk == 16384);
+    assert(params.mask == 4095);
+
+    snprintf(cmd, sizeof(cmd), "%s -C %s chunking 1024 3000 16384 2>/dev/null",
+             cli, repo);
+    assert(system(cmd) != 0);
+
+    git_repository *cfg_repo = NULL;
+    git_config *cfg = NULL;
+    assert(git_repository_open(&cfg_repo, repo) == 0);
+    assert(git_repository_config(&cfg, cfg_repo) == 0);
+    assert(git_config_set_int64(cfg, "bup.avgChunk", 3000) == 0);
+    git_config_free(cfg);
+    git_repository_free(cfg_repo);
+    assert(bup_odb_backend_new(&backend, repo) < 0);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    const char *cli = detect_cli();
+
+    char *data = malloc(BLOB_SIZE);
+    char *shifted = malloc(BLOB_SIZE + 1);
+    fill_random(data, BLOB_SIZE);
+    memcpy(shifted, data, INSERT_POS);
+    shifted[INSERT_POS] = 'x';
+    memcpy(shifted + INSERT_POS + 1, data + INSERT_POS, BLOB_SIZE - INSERT_POS);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s init %s", cli, repo);
+    assert(system(cmd) == 0);
+    check_variable_policy(repo, data, shifted);
+    check_fastcdc_engine(cli, repo, data, shifted);
+
+    char legacy_tmp[] = LEGACY_TEMPLATE;
+    char *legacy = mkdtemp(legacy_tmp);
+    assert(legacy);
+    check_legacy_policy(cli, legacy, data);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s", repo, legacy);
+    system(cmd);
+    free(data);
+    free(shifted);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_CHUNKS 20000
+#define STORE_CHUNKS 100
+#define REPO_TEMPLATE "pool_repoXXXXXX"
+
+static size_t make_chunk(char *buf, size_t i)
+{
+    return (size_t)sprintf(buf, "chunk %zu %zu", i, i * 7919 % 1000);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(git_repository_odb(&odb, repo) == 0);
+
+    int base_count = chunk_pool_count();
+    bup_chunk_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    git_oid *oids = malloc(sizeof(git_oid) * NUM_CHUNKS);
+    char buf[64];
+    size_t total = 0;
+    for (size_t i = 0; i < NUM_CHUNKS; i++) {
+        size_t len = make_chunk(buf, i);
+        bup_chunk *c = chunk_get_or_create(odb, &pool, buf, len);
+        assert(c && c->len == len);
+        git_oid_cpy(&oids[i], &c->oid);
+        total += len;
+    }
+    assert(pool.count == NUM_CHUNKS && pool.total == total);
+    assert(pool.count * 2 <= pool.nslots);
+    assert(chunk_pool_count() == base_count + NUM_CHUNKS);
+
+    /* every chunk is found again (in reverse, after all the growth) and
+     * nothing new is written */
+    for (size_t i = NUM_CHUNKS; i-- > 0;) {
+        size_t len = make_chunk(buf, i);
+        bup_chunk *c = chunk_get_or_create(odb, &pool, buf, len);
+        assert(c && c->len == len);
+        assert(git_oid_cmp(&c->oid, &oids[i]) == 0);
+        assert(git_odb_exists(odb, &oids[i]));
+    }
+    assert(pool.count == NUM_CHUNKS);
+
+    chunk_pool_free(&pool);
+    assert(pool.count == 0 && pool.chunks == NULL && pool.slots == NULL);
+    assert(chunk_pool_count() == base_count);
+
+    /* a freed pool is reusable */
+    size_t len = make_chunk(buf, 1);
+    bup_chunk *c = chunk_get_or_create(odb, &pool, buf, len);
+    assert(c && git_oid_cmp(&c->oid, &oids[1]) == 0);
+    chunk_pool_free(&pool);
+
+    /* chunks handed to a store with their oid read back like any other */
+    char objects[512];
+    snprintf(objects, sizeof(objects), "%s/.git/objects", path);
+    assert(git_odb_backend_loose(&pool.store, objects, -1, 0, 0, 0) == 0);
+    for (size_t i = 0; i < STORE_CHUNKS; i++) {
+        len = (size_t)sprintf(buf, "stored %zu", i);
+        c = chunk_get_or_create(odb, &pool, buf, len);
+        assert(c);
+        git_oid expect;
+        assert(git_odb_hash(&expect, buf, len, GIT_OBJECT_BLOB) == 0);
+        assert(git_oid_cmp(&c->oid, &expect) == 0);
+        git_odb_object *obj = NULL;
+        assert(git_odb_read(&obj, odb, &expect) == 0);
+        assert(git_odb_object_size(obj) == len);
+        assert(memcmp(git_odb_object_data(obj), buf, len) == 0);
+        git_odb_object_free(obj);
+    }
+    chunk_pool_free(&pool);
+    pool.store->free(pool.store);
+
+    /* a chunk the odb has, here through an alternate, is not stored again
+     * even though no index lists it */
+    char alt_tmp[] = REPO_TEMPLATE;
+    char *alt = mkdtemp(alt_tmp);
+    assert(alt);
+    git_repository *alt_repo = NULL;
+    assert(git_repository_init(&alt_repo, alt, 0) == 0);
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/.git/objects/info/alternates", alt);
+    FILE *f = fopen(file, "w");
+    assert(f);
+    fprintf(f, "%s\n", objects);
+    fclose(f);
+    git_repository_free(alt_repo);
+    assert(git_repository_open(&alt_repo, alt) == 0);
+    git_odb *alt_odb = NULL;
+    assert(git_repository_odb(&alt_odb, alt_repo) == 0);
+    snprintf(objects, sizeof(objects), "%s/.git/objects", alt);
+    assert(git_odb_backend_loose(&pool.store, objects, -1, 0, 0, 0) == 0);
+    len = (size_t)sprintf(buf, "stored %d", 0);
+    c = chunk_get_or_create(alt_odb, &pool, buf, len);
+    assert(c);
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &c->oid);
+    snprintf(file, sizeof(file), "%s/%.2s/%s", objects, hex, hex + 2);
+    assert(access(file, F_OK) < 0);
+    chunk_pool_free(&pool);
+    pool.store->free(pool.store);
+    git_odb_free(alt_odb);
+    git_repository_free(alt_repo);
+
+    /* a linked worktree writes into the common objects directory */
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd),
+             "git -C %s -c user.name=t -c user.email=t@t commit -q "
+             "--allow-empty -m base && git -C %s worktree add -q ../%s.wt",
+             path, path, path);
+    assert(system(cmd) == 0);
+    snprintf(file, sizeof(file), "%s.wt", path);
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, file) == 0);
+    git_oid blob;
+    assert(backend->write(backend, &blob, buf, len, GIT_OBJECT_BLOB) == 0);
+    backend->free(backend);
+    snprintf(file, sizeof(file), "%s/.git/worktrees/%s.wt/objects", path,
+             strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    assert(access(file, F_OK) < 0);
+
+    free(oids);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s.wt %s", path, path, alt);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
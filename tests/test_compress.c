@@ -0,0 +1,164 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 1000000
+#define REPO_TEMPLATE "compress_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+/* Words from a small vocabulary: varied enough to chunk, easy to deflate */
+static void fill_text(char *buf, size_t len, unsigned seed)
+{
+    static const char *words[] = { "chunk ", "list ", "pack ", "index ",
+                                   "object ", "blob ", "tree ", "commit\n" };
+    srand(seed);
+    size_t off = 0;
+    while (off < len) {
+        const char *w = words[rand() % 8];
+        size_t n = strlen(w) < len - off ? strlen(w) : len - off;
+        memcpy(buf + off, w, n);
+        off += n;
+    }
+}
+
+static void set_config(git_repository *repo, const char *key, const char *value)
+{
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_string(cfg, key, value) == 0);
+    git_config_free(cfg);
+}
+
+/* Write data through a fresh backend, check it reads back, both from the
+ * pending pack and from the finished one, and return the stats */
+static void write_blob(const char *path, const char *data,
+                       bup_compress_stats *st)
+{
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    for (int flushed = 0; flushed < 2; flushed++) {
+        void *buf = NULL;
+        size_t len = 0;
+        git_object_t type = 0;
+        assert(backend->read(&buf, &len, &type, backend, &oid) == 0);
+        assert(len == BLOB_SIZE && memcmp(buf, data, len) == 0);
+        free(buf);
+        assert(bup_odb_flush(backend) == 0);
+    }
+    bup_odb_compress_stats(backend, st);
+    backend->free(backend);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    /* entropy in bits per byte */
+    char *random = malloc(BLOB_SIZE), *text = malloc(BLOB_SIZE);
+    fill_random(random, BLOB_SIZE, 1);
+    fill_text(text, BLOB_SIZE, 1);
+    unsigned char all[256];
+    for (int i = 0; i < 256; i++)
+        all[i] = (unsigned char)i;
+    assert(bup_byte_entropy(random, 0) == 0);
+    assert(bup_byte_entropy(text, 1) == 0);
+    assert(fabs(bup_byte_entropy(all, sizeof(all)) - 8) < 1e-9);
+    assert(fabs(bup_byte_entropy("abab", 4) - 1) < 1e-9);
+    assert(bup_byte_entropy(random, 8192) > 7.9);
+    assert(bup_byte_entropy(text, 8192) < 5);
+    /* large objects are sampled */
+    assert(bup_byte_entropy(random, BLOB_SIZE) > 7.99);
+    assert(bup_byte_entropy(text, BLOB_SIZE) < 5);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    bup_pack_params params;
+    assert(bup_odb_read_pack(&params, repo) == 0);
+    assert(params.level == BUP_PACK_LEVEL_DEFAULT &&
+           params.store_entropy == BUP_STORE_ENTROPY_DEFAULT);
+
+    /* random chunks are stored, not deflated */
+    bup_compress_stats st;
+    write_blob(path, random, &st);
+    assert(st.objects > 10 && st.stored >= st.objects * 9 / 10);
+    assert(st.bytes_in >= BLOB_SIZE && st.bytes_out >= st.bytes_in);
+    assert(st.bytes_out < st.bytes_in + st.bytes_in / 100);
+    printf("random: %llu/%llu stored, estimate %llu ns, deflate %llu ns\n",
+           (unsigned long long)st.stored, (unsigned long long)st.objects,
+           (unsigned long long)st.estimate_ns,
+           (unsigned long long)st.deflate_ns);
+
+    /* text is deflated; only its list nodes, which are mostly oids, may
+     * be stored */
+    write_blob(path, text, &st);
+    assert(st.objects > 10 && st.stored < st.objects / 10);
+    assert(st.bytes_out < st.bytes_in / 2);
+    uint64_t fast_out = st.bytes_out;
+
+    /* at a higher level it shrinks further */
+    fill_text(text, BLOB_SIZE, 2);
+    set_config(repo, "bup.compression", "9");
+    write_blob(path, text, &st);
+    assert(st.stored < st.objects / 10 && st.bytes_out < fast_out);
+
+    /* an entropy above 8 deflates everything, level 0 nothing */
+    fill_random(random, BLOB_SIZE, 2);
+    set_config(repo, "bup.compression", "1");
+    set_config(repo, "bup.storeEntropy", "8.5");
+    write_blob(path, random, &st);
+    assert(st.objects > 10 && st.stored == 0);
+    fill_text(text, BLOB_SIZE, 3);
+    set_config(repo, "bup.compression", "0");
+    write_blob(path, text, &st);
+    assert(st.stored == st.objects && st.bytes_out >= st.bytes_in);
+
+    set_config(repo, "bup.storeEntropy", "x");
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    set_config(repo, "bup.storeEntropy", "0");
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    set_config(repo, "bup.storeEntropy", "-1");
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    set_config(repo, "bup.storeEntropy", "1e1");
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    /* the value is read the same where the decimal separator is a comma */
+    if (setlocale(LC_NUMERIC, "de_DE.UTF-8")) {
+        set_config(repo, "bup.storeEntropy", "7.25");
+        assert(bup_odb_read_pack(&params, repo) == 0);
+        assert(params.store_entropy == 7.25);
+        setlocale(LC_NUMERIC, "C");
+    }
+    set_config(repo, "bup.storeEntropy", "7");
+    set_config(repo, "bup.compression", "10");
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    set_config(repo, "bup.compression", "6");
+    assert(bup_odb_read_pack(&params, repo) == 0);
+    assert(params.level == 6 && params.store_entropy == 7);
+
+    free(random);
+    free(text);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
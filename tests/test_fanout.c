@@ -0,0 +1,196 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 1000000
+#define FANOUT_BITS 2
+#define FLIP_POS (BLOB_SIZE / 2)
+#define REPO_TEMPLATE "fanout_repoXXXXXX"
+#define FILE_NAME "big.bin"
+
+typedef struct {
+    git_oid oids[4096];
+    size_t count;
+} node_set;
+
+static const char *detect_cli(void)
+{
+    return "./git2";
+}
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(7);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static int record_node(const git_oid *oid, void *payload)
+{
+    node_set *set = payload;
+    assert(set->count < sizeof(set->oids) / sizeof(set->oids[0]));
+    git_oid_cpy(&set->oids[set->count++], oid);
+    return 0;
+}
+
+static int in_set(const node_set *set, const git_oid *oid)
+{
+    for (size_t i = 0; i < set->count; i++)
+        if (git_oid_cmp(&set->oids[i], oid) == 0)
+            return 1;
+    return 0;
+}
+
+static unsigned root_level(git_odb *odb, const git_oid *oid, node_set *nodes,
+                           size_t *chunks)
+{
+    git_odb_object *obj = NULL;
+    assert(git_odb_read(&obj, odb, oid) == 0);
+    unsigned level = 0;
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+    assert(parse_chunk_node(git_odb_object_data(obj), git_odb_object_size(obj),
+                            0, &level, &oids, &lens, &n) == 0);
+    free(oids);
+    free(lens);
+    assert(bup_chunk_list_expand(odb, 0, git_odb_object_data(obj),
+                                 git_odb_object_size(obj), &oids, &lens,
+                                 chunks, record_node, nodes) == 0);
+    size_t total = 0;
+    for (size_t i = 0; i < *chunks; i++)
+        total += lens[i];
+    assert(total == BLOB_SIZE);
+    free(oids);
+    free(lens);
+    git_odb_object_free(obj);
+    return level;
+}
+
+static int is_loose(const char *repo, const git_oid *oid)
+{
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), oid);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/.git/objects/%.2s/%s", repo, hex, hex + 2);
+    return access(path, F_OK) == 0;
+}
+
+static void verify_head_blob(const char *cli, const char *repo,
+                             const char *data, size_t len)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s -C %s show HEAD:%s", cli, repo, FILE_NAME);
+    FILE *p = popen(cmd, "r");
+    assert(p);
+    char *buf = malloc(len);
+    assert(fread(buf, 1, len, p) == len);
+    assert(fgetc(p) == EOF);
+    pclose(p);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    const char *cli = detect_cli();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s init %s", cli, repo);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "%s -C %s chunking 64 256 1024", cli, repo);
+    assert(system(cmd) == 0);
+
+    git_repository *r = NULL;
+    git_config *cfg = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(git_repository_config(&cfg, r) == 0);
+    assert(git_config_set_int32(cfg, "bup.fanoutBits", FANOUT_BITS) == 0);
+    git_config_free(cfg);
+    git_odb *odb = NULL;
+    assert(git_repository_odb(&odb, r) == 0);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid oid1, oid2;
+    assert(backend->write(backend, &oid1, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_flush(backend) == 0);
+
+    node_set *nodes1 = calloc(1, sizeof(node_set));
+    node_set *nodes2 = calloc(1, sizeof(node_set));
+    size_t chunks1 = 0, chunks2 = 0;
+    unsigned level = root_level(odb, &oid1, nodes1, &chunks1);
+    printf("chunks=%zu nodes=%zu levels=%u\n", chunks1, nodes1->count, level);
+    assert(level >= 2);
+    assert(bup_backend_object_chunk_count(backend, &oid1, NULL, NULL) == chunks1);
+
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, &oid1) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, len) == 0);
+    free(buf);
+
+    /* a one-byte change rewrites about one node per level */
+    data[FLIP_POS] ^= 0x55;
+    assert(backend->write(backend, &oid2, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_flush(backend) == 0);
+    root_level(odb, &oid2, nodes2, &chunks2);
+    size_t fresh = 0;
+    for (size_t i = 0; i < nodes2->count; i++)
+        if (!in_set(nodes1, &nodes2->oids[i]))
+            fresh++;
+    printf("new nodes=%zu of %zu\n", fresh, nodes2->count);
+    assert(fresh <= 2 * level);
+
+    assert(backend->read(&buf, &len, &type, backend, &oid2) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, len) == 0);
+    free(buf);
+    backend->free(backend);
+
+    setenv("GIT_AUTHOR_NAME", "Tester", 1);
+    setenv("GIT_AUTHOR_EMAIL", "tester@example.com", 1);
+    setenv("GIT_COMMITTER_NAME", "Tester", 1);
+    setenv("GIT_COMMITTER_EMAIL", "tester@example.com", 1);
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", repo, FILE_NAME);
+    FILE *f = fopen(filepath, "wb");
+    assert(f);
+    fwrite(data, 1, BLOB_SIZE, f);
+    fclose(f);
+    snprintf(cmd, sizeof(cmd), "%s -C %s add %s", cli, repo, FILE_NAME);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "%s -C %s commit -m big", cli, repo);
+    assert(system(cmd) == 0);
+    verify_head_blob(cli, repo, data, BLOB_SIZE);
+
+    /* repack must carry the interior nodes along with the data chunks */
+    snprintf(cmd, sizeof(cmd), "%s -C %s repack", cli, repo);
+    assert(system(cmd) == 0);
+    for (size_t i = 0; i < nodes2->count; i++)
+        assert(!is_loose(repo, &nodes2->oids[i]));
+    assert(!is_loose(repo, &oid2));
+    verify_head_blob(cli, repo, data, BLOB_SIZE);
+
+    free(nodes1);
+    free(nodes2);
+    free(data);
+    git_odb_free(odb);
+    git_repository_free(r);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", repo);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 2000000
+#define SMALL_BUDGET 65536
+#define REPO_TEMPLATE "fingerprint_repoXXXXXX"
+#define CHUNK_A "first chunk"
+#define CHUNK_B "second chunk"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(4242);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void set_verify(git_repository *repo, int32_t every)
+{
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.fingerprintVerify", every) == 0);
+    git_config_free(cfg);
+}
+
+/* Write data through a fresh backend and return its fingerprint stats */
+static void write_blob(const char *path, const char *data, git_oid *oid,
+                       bup_fp_stats *st)
+{
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    assert(backend->write(backend, oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    bup_odb_fingerprint_stats(backend, st);
+    backend->free(backend);
+}
+
+static off_t map_size(const char *gitdir)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s" BUP_INDEX_DIR "/" BUP_FP_FILE, gitdir);
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    size_t budget;
+    unsigned verify;
+    assert(bup_odb_read_fingerprint(&budget, &verify, repo) == 0);
+    assert(budget == BUP_FP_CACHE_DEFAULT && verify == BUP_FP_VERIFY_DEFAULT);
+    set_verify(repo, 0);
+    const char *gitdir = git_repository_path(repo);
+
+    /* SipHash-2-4-128 reference vectors: key 00..0f, message 00..len-1 */
+    static const char *const sip128[] = {
+        "a3817f04ba25a8e66df67214c7550293",
+        "da87c1d86b99af44347659119b22fc45",
+    };
+    bup_fp_cache key = { .seed = { 0x0706050403020100ULL,
+                                   0x0f0e0d0c0b0a0908ULL } };
+    unsigned char msg[1] = { 0 }, fp[BUP_FP_SIZE];
+    char hex[2 * BUP_FP_SIZE + 1];
+    for (size_t len = 0; len < 2; len++) {
+        bup_fingerprint(&key, msg, len, fp);
+        for (int i = 0; i < BUP_FP_SIZE; i++)
+            sprintf(hex + 2 * i, "%02x", fp[i]);
+        assert(strcmp(hex, sip128[len]) == 0);
+    }
+
+    /* the first write learns every chunk, a later one skips SHA-1 */
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid first, again;
+    bup_fp_stats st;
+    write_blob(path, data, &first, &st);
+    assert(st.hits == 0 && st.misses > 1);
+    uint64_t chunks = st.misses;
+    assert(map_size(gitdir) > 0 && map_size(gitdir) <= (off_t)BUP_FP_CACHE_DEFAULT);
+    write_blob(path, data, &again, &st);
+    assert(git_oid_cmp(&first, &again) == 0);
+    assert(st.hits == chunks && st.misses == 0 && st.verified == 0);
+
+    /* every hit confirmed */
+    set_verify(repo, 1);
+    write_blob(path, data, &again, &st);
+    assert(git_oid_cmp(&first, &again) == 0);
+    assert(st.verified == chunks && st.mismatches == 0);
+
+    /* a wrong mapping is trusted while its oid is known, caught when
+     * verified, and never used to store an object */
+    git_odb *odb = NULL;
+    assert(git_repository_odb(&odb, repo) == 0);
+    bup_fp_cache fpc;
+    assert(bup_fp_cache_open(&fpc, gitdir, SMALL_BUDGET, 0) == 0);
+    assert(bup_fp_cache_enabled(&fpc));
+    bup_chunk_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.fingerprints = &fpc;
+    git_oid a, b, oid;
+    assert(chunk_pool_put(odb, &pool, CHUNK_B, strlen(CHUNK_B), &b) == 0);
+    assert(git_odb_hash(&a, CHUNK_A, strlen(CHUNK_A), GIT_OBJECT_BLOB) == 0);
+    bup_fingerprint(&fpc, CHUNK_A, strlen(CHUNK_A), fp);
+    bup_fp_cache_add(&fpc, fp, strlen(CHUNK_A), &b);
+    assert(chunk_pool_put(odb, &pool, CHUNK_A, strlen(CHUNK_A), &oid) == 0);
+    assert(git_oid_cmp(&oid, &b) == 0);
+    fpc.verify = 1;
+    assert(chunk_pool_put(odb, &pool, CHUNK_A, strlen(CHUNK_A), &oid) == 0);
+    assert(git_oid_cmp(&oid, &a) == 0);
+    bup_fp_cache_get_stats(&fpc, &st);
+    assert(st.mismatches == 1);
+    chunk_pool_free(&pool);
+
+    bup_fp_cache_add(&fpc, fp, strlen(CHUNK_A), &b);
+    fpc.verify = 0;
+    assert(chunk_pool_put(odb, &pool, CHUNK_A, strlen(CHUNK_A), &oid) == 0);
+    assert(git_oid_cmp(&oid, &a) == 0 && git_odb_exists(odb, &a));
+    bup_fp_cache_get_stats(&fpc, &st);
+    assert(st.mismatches == 2);
+    chunk_pool_free(&pool);
+    bup_fp_cache_close(&fpc);
+
+    /* another budget rebuilds the map at its size; 0 disables it */
+    assert(map_size(gitdir) > SMALL_BUDGET / 2 && map_size(gitdir) <= SMALL_BUDGET);
+    assert(bup_fp_cache_open(&fpc, gitdir, 0, 0) == 0);
+    assert(!bup_fp_cache_enabled(&fpc));
+    bup_fp_cache_close(&fpc);
+
+    free(data);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 1000000
+#define FANOUT_BITS 2
+#define RANGE_OFFSET 500000
+#define RANGE_LEN 30000
+#define TINY_BUDGET 64
+#define SMALL_TEXT "not a list\n"
+#define REPO_TEMPLATE "list_cache_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(2024);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void read_blob(git_odb_backend *backend, const git_oid *oid,
+                      const char *data)
+{
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, oid) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.fanoutBits", FANOUT_BITS) == 0);
+    git_config_free(cfg);
+    size_t budget = 0;
+    assert(bup_odb_read_list_cache(&budget, repo) == 0);
+    assert(budget == BUP_LIST_CACHE_DEFAULT);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_flush(backend) == 0);
+
+    /* the list is parsed once and then reused by every reader */
+    bup_cache_stats st;
+    read_blob(backend, &oid, data);
+    bup_odb_list_cache_stats(backend, &st);
+    assert(st.hits == 0 && st.misses == 1 && st.entries == 1);
+    read_blob(backend, &oid, data);
+    git_oid *oids = NULL;
+    size_t *lens = NULL;
+    size_t count = bup_backend_object_chunk_count(backend, &oid, &oids, &lens);
+    assert(count > 1);
+    char *part = malloc(RANGE_LEN);
+    size_t got = 0;
+    assert(bup_odb_read_range(backend, &oid, RANGE_OFFSET, RANGE_LEN, part,
+                              &got) == 0);
+    assert(got == RANGE_LEN && memcmp(part, data + RANGE_OFFSET, RANGE_LEN) == 0);
+    assert(bup_odb_read_range(backend, &oid, BLOB_SIZE - 10, RANGE_LEN, part,
+                              &got) == 0);
+    assert(got == 10 && memcmp(part, data + BLOB_SIZE - 10, 10) == 0);
+    bup_odb_list_cache_stats(backend, &st);
+    assert(st.hits == 4 && st.misses == 1 && st.entries == 1);
+
+    /* entries carry chunk offsets and the interior nodes */
+    git_odb *odb = NULL;
+    assert(git_repository_odb(&odb, repo) == 0);
+    bup_list_cache lists;
+    assert(bup_list_cache_init(&lists, BUP_LIST_CACHE_DEFAULT) == 0);
+    bup_chunk_list *list = NULL;
+    assert(bup_list_cache_get(&list, NULL, &lists, odb, 0, &oid) == 0);
+    assert(list->count == count && list->total == BLOB_SIZE);
+    assert(list->nnodes > 0);
+    uint64_t ofs = 0;
+    for (size_t i = 0; i < count; i++) {
+        assert(git_oid_cmp(&list->oids[i], &oids[i]) == 0);
+        assert(list->lens[i] == lens[i] && list->starts[i] == ofs);
+        ofs += lens[i];
+    }
+    /* a reference outlives eviction */
+    bup_oid_cache_free(&lists);
+    assert(list->count == count);
+    bup_chunk_list_release(list);
+
+    /* lists larger than the budget are not kept */
+    assert(bup_list_cache_init(&lists, TINY_BUDGET) == 0);
+    assert(bup_list_cache_get(&list, NULL, &lists, odb, 0, &oid) == 0);
+    bup_chunk_list_release(list);
+    bup_oid_cache_get_stats(&lists, &st);
+    assert(st.entries == 0 && st.bytes == 0);
+    bup_oid_cache_free(&lists);
+
+    /* plain objects come back as objects */
+    git_oid plain;
+    assert(git_odb_write(&plain, odb, SMALL_TEXT, strlen(SMALL_TEXT),
+                         GIT_OBJECT_BLOB) == 0);
+    git_odb_object *obj = NULL;
+    assert(bup_list_cache_get(&list, &obj, NULL, odb, 0, &plain) == 1);
+    assert(git_odb_object_size(obj) == strlen(SMALL_TEXT));
+    git_odb_object_free(obj);
+
+    free(part);
+    free(oids);
+    free(lens);
+    free(data);
+    backend->free(backend);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
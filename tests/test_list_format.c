@@ -0,0 +1,201 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_ENTRIES 1000
+#define BLOB_SIZE 50000
+#define REPO_TEMPLATE "format_repoXXXXXX"
+#define LEGACY_TEMPLATE "format_legacyXXXXXX"
+
+static const char *detect_cli(void)
+{
+    return "./git2";
+}
+
+static void fill_entries(git_oid *oids, size_t *lens, size_t n)
+{
+    srand(5);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < GIT_OID_RAWSZ; j++)
+            oids[i].id[j] = (unsigned char)(rand() % 256);
+        lens[i] = (i % 7 == 0) ? ((size_t)1 << 40) + i : (size_t)(rand() % 70000);
+    }
+}
+
+static char *text_list(const git_oid *oids, const size_t *lens, size_t n,
+                       size_t *len)
+{
+    char *buf = malloc(n * (GIT_OID_HEXSZ + 1 + 20 + 1) + 1);
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        char hex[GIT_OID_HEXSZ + 1];
+        git_oid_tostr(hex, sizeof(hex), &oids[i]);
+        pos += (size_t)sprintf(buf + pos, "%s %zu\n", hex, lens[i]);
+    }
+    *len = pos;
+    return buf;
+}
+
+static void check_roundtrip(const git_oid *oids, const size_t *lens,
+                            unsigned flags)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    assert(bup_list_encode(&buf, &len, 3, oids, lens, NUM_ENTRIES, flags) == 0);
+    assert(memcmp(buf, BUP_LIST_MAGIC, BUP_LIST_MAGIC_SIZE) == 0);
+
+    unsigned level = 0;
+    git_oid *out_oids = NULL;
+    size_t *out_lens = NULL;
+    size_t n = 0;
+    assert(parse_chunk_node(buf, len, 0, &level, &out_oids, &out_lens, &n) == 0);
+    assert(level == 3 && n == NUM_ENTRIES);
+    for (size_t i = 0; i < n; i++) {
+        assert(git_oid_cmp(&out_oids[i], &oids[i]) == 0);
+        assert(out_lens[i] == lens[i]);
+    }
+    free(out_oids);
+    free(out_lens);
+
+    /* truncation, an unknown version and (for varint lengths, where it is
+     * redundant) a wrong total are rejected */
+    assert(parse_chunk_node(buf, len - 1, 0, &level, &out_oids, &out_lens,
+                            &n) < 0);
+    if (!(flags & BUP_LIST_OFFSETS)) {
+        buf[16] ^= 1;
+        assert(parse_chunk_node(buf, len, 0, &level, &out_oids, &out_lens,
+                                &n) < 0);
+        buf[16] ^= 1;
+    }
+    buf[8]++;
+    assert(parse_chunk_node(buf, len, 0, &level, &out_oids, &out_lens, &n) < 0);
+    free(buf);
+}
+
+static void write_raw(const char *repo, const void *data, size_t len,
+                      git_oid *oid)
+{
+    git_repository *r = NULL;
+    git_odb *odb = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(git_repository_odb(&odb, r) == 0);
+    assert(git_odb_write(oid, odb, data, len, GIT_OBJECT_BLOB) == 0);
+    git_odb_free(odb);
+    git_repository_free(r);
+}
+
+static void read_back(git_odb_backend *backend, const git_oid *oid,
+                      const void *expect, size_t expect_len)
+{
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, oid) == 0);
+    assert(type == GIT_OBJECT_BLOB && len == expect_len);
+    assert(memcmp(buf, expect, len) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    const char *cli = detect_cli();
+
+    git_oid *oids = malloc(sizeof(git_oid) * NUM_ENTRIES);
+    size_t *lens = malloc(sizeof(size_t) * NUM_ENTRIES);
+    fill_entries(oids, lens, NUM_ENTRIES);
+    check_roundtrip(oids, lens, 0);
+    check_roundtrip(oids, lens, BUP_LIST_OFFSETS);
+
+    size_t text_len = 0;
+    char *text = text_list(oids, lens, NUM_ENTRIES, &text_len);
+    char *bin = NULL;
+    size_t bin_len = 0;
+    assert(bup_list_encode(&bin, &bin_len, 0, oids, lens, NUM_ENTRIES, 0) == 0);
+    printf("text=%zu binary=%zu\n", text_len, bin_len);
+    assert(bin_len * 2 < text_len);
+    free(bin);
+
+    unsigned level;
+    git_oid *p_oids = NULL;
+    size_t *p_lens = NULL;
+    size_t n = 0;
+    assert(parse_chunk_node(text, text_len, 0, &level, &p_oids, &p_lens, &n) < 0);
+    assert(parse_chunk_list(text, text_len, &p_oids, &p_lens, &n) == 0);
+    assert(n == NUM_ENTRIES && git_oid_cmp(&p_oids[5], &oids[5]) == 0);
+    free(p_oids);
+    free(p_lens);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s init %s", cli, repo);
+    assert(system(cmd) == 0);
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+
+    char *data = malloc(BLOB_SIZE);
+    srand(11);
+    for (size_t i = 0; i < BLOB_SIZE; i++)
+        data[i] = (char)(rand() % 256);
+    git_oid data_oid;
+    assert(backend->write(backend, &data_oid, data, BLOB_SIZE,
+                          GIT_OBJECT_BLOB) == 0);
+    read_back(backend, &data_oid, data, BLOB_SIZE);
+    git_oid empty_oid;
+    assert(backend->write(backend, &empty_oid, "", 0, GIT_OBJECT_BLOB) == 0);
+    read_back(backend, &empty_oid, "", 0);
+
+    /* a user file that happens to look like a text list of real chunks is
+     * returned verbatim, not reassembled */
+    git_oid *chunks = NULL;
+    size_t *chunk_lens = NULL;
+    size_t nchunks = bup_backend_object_chunk_count(backend, &data_oid, &chunks,
+                                                    &chunk_lens);
+    assert(nchunks > 1);
+    size_t fake_len = 0;
+    char *fake = text_list(chunks, chunk_lens, nchunks, &fake_len);
+    git_oid fake_oid;
+    write_raw(repo, fake, fake_len, &fake_oid);
+    read_back(backend, &fake_oid, fake, fake_len);
+    backend->free(backend);
+
+    /* repositories from before the binary format still read text lists */
+    char legacy_tmp[] = LEGACY_TEMPLATE;
+    char *legacy = mkdtemp(legacy_tmp);
+    assert(legacy);
+    git_repository *r = NULL;
+    assert(git_repository_init(&r, legacy, 0) == 0);
+    git_repository_free(r);
+    assert(bup_odb_backend_new(&backend, legacy) == 0);
+    git_oid legacy_oid;
+    assert(backend->write(backend, &legacy_oid, data, BLOB_SIZE,
+                          GIT_OBJECT_BLOB) == 0);
+    free(chunks);
+    free(chunk_lens);
+    nchunks = bup_backend_object_chunk_count(backend, &legacy_oid, &chunks,
+                                             &chunk_lens);
+    free(fake);
+    fake = text_list(chunks, chunk_lens, nchunks, &fake_len);
+    write_raw(legacy, fake, fake_len, &fake_oid);
+    read_back(backend, &fake_oid, data, BLOB_SIZE);
+    backend->free(backend);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s", repo, legacy);
+    system(cmd);
+    free(fake);
+    free(chunks);
+    free(chunk_lens);
+    free(data);
+    free(text);
+    free(oids);
+    free(lens);
+    git_libgit2_shutdown();
+    return 0;
+}
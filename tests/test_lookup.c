@@ -0,0 +1,131 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 400000
+#define FANOUT_BITS 2
+#define SMALL_TEXT "plain blob\n"
+#define SHORT_LEN 10
+#define REPO_TEMPLATE "lookup_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(77);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    /* a small fanout gives the blob a multi-level list */
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.fanoutBits", FANOUT_BITS) == 0);
+    git_config_free(cfg);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid big;
+    assert(backend->write(backend, &big, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+
+    git_odb *repo_odb = NULL;
+    assert(git_repository_odb(&repo_odb, repo) == 0);
+    git_oid plain;
+    assert(git_odb_write(&plain, repo_odb, SMALL_TEXT, strlen(SMALL_TEXT),
+                         GIT_OBJECT_BLOB) == 0);
+    git_oid tree;
+    assert(git_odb_write(&tree, repo_odb, "", 0, GIT_OBJECT_TREE) == 0);
+
+    /* headers come from the list alone, without reassembling */
+    int reads = bup_backend_read_calls();
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read_header(&len, &type, backend, &big) == 0);
+    assert(len == BLOB_SIZE && type == GIT_OBJECT_BLOB);
+    assert(backend->read_header(&len, &type, backend, &plain) == 0);
+    assert(len == strlen(SMALL_TEXT) && type == GIT_OBJECT_BLOB);
+    assert(backend->read_header(&len, &type, backend, &tree) == 0);
+    assert(len == 0 && type == GIT_OBJECT_TREE);
+    git_oid missing;
+    git_oid_fromstr(&missing, "0123456789012345678901234567890123456789");
+    assert(backend->read_header(&len, &type, backend, &missing) ==
+           GIT_ENOTFOUND);
+    assert(bup_backend_read_calls() == reads);
+
+    /* a binary node's size comes from its header, checked against the
+     * node's length but without decoding the entries */
+    git_oid ids[2];
+    memset(ids, 0xab, sizeof(ids));
+    const size_t lens[2] = { 5, 7 };
+    char *node = NULL;
+    size_t node_len = 0, total = 0;
+    assert(bup_list_encode(&node, &node_len, 0, ids, lens, 2, 0) == 0);
+    assert(bup_chunk_list_size(node, node_len, 0, &total) == 0 && total == 12);
+    node[node_len - 1] = 9;
+    assert(bup_chunk_list_size(node, node_len, 0, &total) == 0 && total == 12);
+    assert(bup_chunk_list_size(node, BUP_LIST_HEADER_SIZE + GIT_OID_RAWSZ, 0,
+                               &total) == 1);
+    free(node);
+
+    /* and libgit2 asks the backend when it only needs the header */
+    git_odb *odb = NULL;
+    assert(git_odb_new(&odb) == 0);
+    assert(git_odb_add_backend(odb, backend, 10) == 0);
+    assert(git_odb_read_header(&len, &type, odb, &big) == 0);
+    assert(len == BLOB_SIZE && type == GIT_OBJECT_BLOB);
+    assert(bup_backend_read_calls() == reads);
+
+    /* existence and short oids never reassemble the blob */
+    assert(backend->exists(backend, &big) == 1);
+    assert(backend->exists(backend, &missing) == 0);
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &big);
+    git_oid short_id, full;
+    assert(git_oid_fromstrn(&short_id, hex, SHORT_LEN) == 0);
+    assert(backend->exists_prefix(&full, backend, &short_id, SHORT_LEN) == 0);
+    assert(git_oid_cmp(&full, &big) == 0);
+    assert(git_odb_exists_prefix(&full, odb, &short_id, SHORT_LEN) == 0);
+    assert(git_oid_cmp(&full, &big) == 0);
+    assert(git_odb_exists(odb, &big));
+    assert(bup_backend_read_calls() == reads);
+    assert(git_oid_fromstrn(&short_id, "0123456789", SHORT_LEN) == 0);
+    assert(backend->exists_prefix(&full, backend, &short_id, SHORT_LEN) ==
+           GIT_ENOTFOUND);
+
+    /* read_prefix resolves, then reads like read */
+    assert(git_oid_fromstrn(&short_id, hex, SHORT_LEN) == 0);
+    void *buf = NULL;
+    memset(&full, 0, sizeof(full));
+    assert(backend->read_prefix(&full, &buf, &len, &type, backend, &short_id,
+                                SHORT_LEN) == 0);
+    assert(git_oid_cmp(&full, &big) == 0);
+    assert(len == BLOB_SIZE && type == GIT_OBJECT_BLOB);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+    git_odb_free(odb);
+
+    free(data);
+    git_odb_free(repo_odb);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,254 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 2000000
+#define SMALL_PACK 300000
+#define SHORT_LEN 12
+#define REPO_TEMPLATE "pack_write_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+/* Files in dir starting with prefix and ending with suffix */
+static size_t count_files(const char *dir, const char *prefix,
+                          const char *suffix)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return 0;
+    size_t n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        const char *name = ent->d_name;
+        size_t len = strlen(name), slen = strlen(suffix);
+        n += name[0] != '.' && strncmp(name, prefix, strlen(prefix)) == 0 &&
+             len >= slen && strcmp(name + len - slen, suffix) == 0;
+    }
+    closedir(d);
+    return n;
+}
+
+static size_t count_loose(const char *repo)
+{
+    char dir[512];
+    size_t n = 0;
+    for (int i = 0; i < 256; i++) {
+        snprintf(dir, sizeof(dir), "%s/.git/objects/%02x", repo, i);
+        n += count_files(dir, "", "");
+    }
+    return n;
+}
+
+static size_t count_packs(const char *repo, const char *prefix)
+{
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/.git/objects/pack", repo);
+    return count_files(dir, prefix, "");
+}
+
+static long log_size(const char *repo)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/.git/" BUP_INDEX_DIR "/" BUP_INDEX_LOG,
+             repo);
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+/* Every chunk and the blob through a plain odb of the repository, which
+ * only has the finished packs to go by */
+static void check_packed(git_repository *repo, git_odb_backend *backend,
+                         const git_oid *oid, const char *data)
+{
+    git_odb *odb = NULL;
+    assert(git_repository_odb(&odb, repo) == 0);
+    assert(git_odb_refresh(odb) == 0);
+    git_oid *chunks = NULL;
+    size_t *lens = NULL;
+    size_t n = bup_backend_object_chunk_count(backend, oid, &chunks, &lens);
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        git_odb_object *obj = NULL;
+        assert(git_odb_read(&obj, odb, &chunks[i]) == 0);
+        assert(git_odb_object_size(obj) == lens[i]);
+        assert(memcmp(git_odb_object_data(obj), data + off, lens[i]) == 0);
+        off += lens[i];
+        git_odb_object_free(obj);
+    }
+    assert(off == BLOB_SIZE);
+    assert(git_odb_exists(odb, oid));
+    free(chunks);
+    free(lens);
+    git_odb_free(odb);
+}
+
+static void read_back(git_odb_backend *backend, const git_oid *oid,
+                      const char *data)
+{
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, oid) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, len) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    bup_pack_params params;
+    assert(bup_odb_read_pack(&params, repo) == 0);
+    assert(params.enabled && params.max_size == BUP_PACK_SIZE_DEFAULT);
+
+    char *a = malloc(BLOB_SIZE), *b = malloc(BLOB_SIZE);
+    fill_random(a, BLOB_SIZE, 1);
+    fill_random(b, BLOB_SIZE, 2);
+
+    /* nothing is written loose; until the pack is finished its objects
+     * are read back from it, and the index does not list them */
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid oid_a;
+    assert(backend->write(backend, &oid_a, a, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(count_loose(path) == 0);
+    assert(count_packs(path, BUP_PACK_TMP_PREFIX) == 1);
+    assert(count_packs(path, "pack-") == 0);
+    assert(log_size(path) == 0);
+    read_back(backend, &oid_a, a);
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &oid_a);
+    git_oid short_id, full;
+    assert(git_oid_fromstrn(&short_id, hex, SHORT_LEN) == 0);
+    assert(backend->exists_prefix(&full, backend, &short_id, SHORT_LEN) == 0);
+    assert(git_oid_cmp(&full, &oid_a) == 0);
+
+    /* flushing puts the pack and its index in place */
+    assert(bup_odb_flush(backend) == 0);
+    assert(count_packs(path, BUP_PACK_TMP_PREFIX) == 0);
+    assert(count_packs(path, "pack-") == 2);
+    size_t chunks = bup_backend_object_chunk_count(backend, &oid_a, NULL, NULL);
+    assert(log_size(path) == (long)(chunks * BUP_INDEX_ENTRY_SIZE));
+    check_packed(repo, backend, &oid_a, a);
+    read_back(backend, &oid_a, a);
+    backend->free(backend);
+
+    /* known chunks start no pack at all */
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid again;
+    assert(backend->write(backend, &again, a, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(git_oid_cmp(&again, &oid_a) == 0);
+    backend->free(backend);
+    assert(count_packs(path, "pack-") == 2);
+
+    /* a session that dies leaves only a temporary pack behind */
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        git_odb_backend *child = NULL;
+        git_oid oid;
+        if (bup_odb_backend_new(&child, path) < 0 ||
+            child->write(child, &oid, b, BLOB_SIZE, GIT_OBJECT_BLOB) < 0)
+            _exit(1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0);
+    assert(count_packs(path, BUP_PACK_TMP_PREFIX) == 1);
+    long logged = log_size(path);
+
+    /* so its chunks are written again, here into packs of bup.packSize */
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int64(cfg, "bup.packSize", SMALL_PACK) == 0);
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid oid_b;
+    assert(backend->write(backend, &oid_b, b, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(count_packs(path, "pack-") >= 2 + 2 * (BLOB_SIZE / SMALL_PACK));
+    assert(bup_odb_flush(backend) == 0);
+    chunks = bup_backend_object_chunk_count(backend, &oid_b, NULL, NULL);
+    assert(log_size(path) == logged + (long)(chunks * BUP_INDEX_ENTRY_SIZE));
+    check_packed(repo, backend, &oid_b, b);
+    backend->free(backend);
+
+    /* a write that fails takes the open pack with it: the objects already
+     * in it, though reported stored, are gone, so nothing may be written
+     * against them and the session cannot flush */
+    fill_random(b, BLOB_SIZE, 4);
+    size_t tmp_packs = count_packs(path, BUP_PACK_TMP_PREFIX);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        git_odb_backend *child = NULL;
+        git_oid small, big;
+        if (bup_odb_backend_new(&child, path) < 0 ||
+            child->write(child, &small, b, SMALL_PACK / 2,
+                         GIT_OBJECT_BLOB) < 0)
+            _exit(1);
+        /* the open pack hits this limit before it is finished, and write()
+         * fails with EFBIG */
+        struct rlimit lim = { SMALL_PACK * 3 / 4, SMALL_PACK * 3 / 4 };
+        signal(SIGXFSZ, SIG_IGN);
+        if (setrlimit(RLIMIT_FSIZE, &lim) < 0)
+            _exit(1);
+        if (child->write(child, &big, b + SMALL_PACK / 2,
+                         BLOB_SIZE - SMALL_PACK / 2, GIT_OBJECT_BLOB) == 0)
+            _exit(2);
+        if (child->write(child, &small, b, SMALL_PACK / 2,
+                         GIT_OBJECT_BLOB) == 0 ||
+            child->exists(child, &small))
+            _exit(3);
+        if (bup_odb_flush(child) == 0 || bup_odb_flush(child) == 0)
+            _exit(4);
+        child->free(child);
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0);
+    assert(count_packs(path, BUP_PACK_TMP_PREFIX) == tmp_packs);
+
+    /* with bup.packWrites off every object is loose again */
+    assert(git_config_set_bool(cfg, "bup.packWrites", 0) == 0);
+    assert(bup_odb_read_pack(&params, repo) == 0);
+    assert(!params.enabled && params.max_size == SMALL_PACK);
+    fill_random(b, BLOB_SIZE, 3);
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    assert(backend->write(backend, &oid_b, b, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(count_loose(path) > 1);
+    read_back(backend, &oid_b, b);
+    backend->free(backend);
+    assert(git_config_set_int64(cfg, "bup.packSize", 0) == 0);
+    assert(bup_odb_read_pack(&params, repo) < 0);
+    git_config_free(cfg);
+
+    free(a);
+    free(b);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
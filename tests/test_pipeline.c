@@ -0,0 +1,126 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 4000000
+#define REPEAT_SIZE 100000
+#define SMALL_INFLIGHT 65536
+#define REPO_TEMPLATE "pipeline_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(1234);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static char *make_repo(char *tmpl, int threads, int64_t inflight)
+{
+    char *path = mkdtemp(tmpl);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.threads", threads) == 0);
+    if (inflight)
+        assert(git_config_set_int64(cfg, "bup.maxInflight", inflight) == 0);
+    git_config_free(cfg);
+
+    bup_pipeline_params params;
+    assert(bup_odb_read_pipeline(&params, repo) == 0);
+    assert(params.threads == (unsigned)threads);
+    assert(params.max_inflight == (inflight ? (size_t)inflight :
+                                   BUP_PIPELINE_INFLIGHT_DEFAULT));
+    git_repository_free(repo);
+    return path;
+}
+
+static void write_blob(const char *path, const char *data, size_t len,
+                       git_oid *oid, git_oid **chunks, size_t *count)
+{
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    assert(backend->write(backend, oid, data, len, GIT_OBJECT_BLOB) == 0);
+    size_t *lens = NULL;
+    *count = bup_backend_object_chunk_count(backend, oid, chunks, &lens);
+    assert(*count > 1);
+    size_t total = 0;
+    for (size_t i = 0; i < *count; i++)
+        total += lens[i];
+    assert(total == len);
+    free(lens);
+
+    void *buf = NULL;
+    size_t got = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &got, &type, backend, oid) == 0);
+    assert(type == GIT_OBJECT_BLOB && got == len);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+    backend->free(backend);
+}
+
+static void remove_repo(const char *path)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    bup_pipeline_params params = { 3, 1 };
+    assert(bup_pipeline_threads(&params) == 3);
+    params.threads = 1000;
+    assert(bup_pipeline_threads(&params) == BUP_PIPELINE_MAX_THREADS);
+    params.threads = 0;
+    assert(bup_pipeline_threads(&params) >= 1);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    /* repeated content makes workers race on identical chunks */
+    for (size_t ofs = BLOB_SIZE / 2; ofs + REPEAT_SIZE <= BLOB_SIZE;
+         ofs += REPEAT_SIZE)
+        memcpy(data + ofs, data, REPEAT_SIZE);
+
+    char serial_tmp[] = REPO_TEMPLATE;
+    char parallel_tmp[] = REPO_TEMPLATE;
+    char *serial = make_repo(serial_tmp, 1, 0);
+    char *parallel = make_repo(parallel_tmp, 4, SMALL_INFLIGHT);
+
+    git_oid oid1, oid2;
+    git_oid *chunks1 = NULL, *chunks2 = NULL;
+    size_t n1 = 0, n2 = 0;
+    write_blob(serial, data, BLOB_SIZE, &oid1, &chunks1, &n1);
+    write_blob(parallel, data, BLOB_SIZE, &oid2, &chunks2, &n2);
+
+    /* same chunks, same order, same list whatever the thread count */
+    assert(git_oid_cmp(&oid1, &oid2) == 0);
+    assert(n1 == n2);
+    assert(memcmp(chunks1, chunks2, n1 * sizeof(git_oid)) == 0);
+
+    /* a second write finds everything in the index and stores nothing */
+    git_oid oid3;
+    git_oid *chunks3 = NULL;
+    size_t n3 = 0;
+    write_blob(parallel, data, BLOB_SIZE, &oid3, &chunks3, &n3);
+    assert(git_oid_cmp(&oid2, &oid3) == 0);
+
+    free(chunks1);
+    free(chunks2);
+    free(chunks3);
+    free(data);
+    remove_repo(serial);
+    remove_repo(parallel);
+    git_libgit2_shutdown();
+    return 0;
+}
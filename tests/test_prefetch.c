@@ -0,0 +1,129 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 4000000
+#define READ_THREADS 4
+#define READ_AHEAD 2
+#define STREAM_BUF 1000
+#define REPO_TEMPLATE "prefetch_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(4321);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void read_all(git_odb_backend *backend, const git_oid *oid,
+                     const char *data)
+{
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, oid) == 0);
+    assert(type == GIT_OBJECT_BLOB && len == BLOB_SIZE);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+}
+
+/* Read the stream in small pieces; stop after limit bytes if nonzero */
+static int read_stream(git_odb_backend *backend, const git_oid *oid,
+                       const char *data, size_t limit)
+{
+    git_odb_stream *stream = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->readstream(&stream, &len, &type, backend, oid) == 0);
+    assert(len == BLOB_SIZE);
+    char buf[STREAM_BUF];
+    size_t ofs = 0;
+    int n;
+    while ((n = stream->read(stream, buf, sizeof(buf))) > 0) {
+        assert(memcmp(buf, data + ofs, (size_t)n) == 0);
+        ofs += (size_t)n;
+        if (limit && ofs >= limit)
+            break;
+    }
+    stream->free(stream);
+    if (n < 0)
+        return -1;
+    assert(limit || ofs == BLOB_SIZE);
+    return 0;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    bup_prefetch_params params = { 3, 1 };
+    assert(bup_prefetch_threads(&params, 1000) == 3);
+    assert(bup_prefetch_threads(&params, 2 * BUP_PREFETCH_CHUNKS_PER_THREAD) == 2);
+    assert(bup_prefetch_threads(&params, 1) == 1);
+    params.threads = 1000;
+    assert(bup_prefetch_threads(&params, 100000) == BUP_PREFETCH_MAX_THREADS);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.readThreads", READ_THREADS) == 0);
+    assert(git_config_set_int32(cfg, "bup.readAhead", READ_AHEAD) == 0);
+    /* a loose chunk is removed below */
+    assert(git_config_set_bool(cfg, "bup.packWrites", 0) == 0);
+    git_config_free(cfg);
+    assert(bup_odb_read_prefetch(&params, repo) == 0);
+    assert(params.threads == READ_THREADS && params.read_ahead == READ_AHEAD);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    git_oid *chunks = NULL;
+    size_t *lens = NULL;
+    size_t count = bup_backend_object_chunk_count(backend, &oid, &chunks, &lens);
+    assert(bup_prefetch_threads(&params, count) == READ_THREADS);
+
+    /* every chunk lands at its offset, in any completion order */
+    read_all(backend, &oid, data);
+    assert(read_stream(backend, &oid, data, 0) == 0);
+    /* a stream dropped early stops its readers */
+    assert(read_stream(backend, &oid, data, BLOB_SIZE / 3) == 0);
+
+    /* a chunk missing near the end fails both paths */
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &chunks[count - 2]);
+    char loose[512];
+    snprintf(loose, sizeof(loose), "%s/.git/objects/%.2s/%s", path, hex,
+             hex + 2);
+    assert(unlink(loose) == 0);
+    backend->free(backend);
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    void *buf = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->read(&buf, &len, &type, backend, &oid) < 0);
+    assert(read_stream(backend, &oid, data, 0) < 0);
+    backend->free(backend);
+
+    free(chunks);
+    free(lens);
+    free(data);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 1000000
+#define FANOUT_BITS 2
+#define NUM_RANGES 200
+#define MAX_RANGE 50000
+#define CLI_OFFSET 123457
+#define CLI_LEN 54321
+#define SMALL_TEXT "0123456789abcdef"
+#define REPO_TEMPLATE "range_repoXXXXXX"
+#define FILE_NAME "big.bin"
+
+typedef struct {
+    uint64_t offset, end;
+    size_t visited;
+    uint64_t next;
+} walk_check;
+
+static const char *detect_cli(void)
+{
+    return "./git2";
+}
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(31337);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+/* chunks arrive in order, contiguous, and each overlaps the range */
+static int check_chunk(const git_oid *oid, uint64_t start, size_t len,
+                       void *payload)
+{
+    walk_check *w = payload;
+    (void)oid;
+    assert(start < w->end && start + len > w->offset);
+    assert(!w->visited || start == w->next);
+    w->next = start + len;
+    w->visited++;
+    return 0;
+}
+
+static void check_range(git_odb_backend *backend, const git_oid *oid,
+                        const char *data, size_t size, uint64_t offset,
+                        size_t len)
+{
+    char *buf = malloc(len ? len : 1);
+    size_t got = 12345;
+    assert(bup_odb_read_range(backend, oid, offset, len, buf, &got) == 0);
+    size_t expect = offset >= size ? 0 :
+                    size - offset < len ? size - (size_t)offset : len;
+    assert(got == expect);
+    assert(memcmp(buf, data + (offset < size ? offset : size), got) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    const char *cli = detect_cli();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s init %s", cli, path);
+    assert(system(cmd) == 0);
+    git_repository *repo = NULL;
+    assert(git_repository_open(&repo, path) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.fanoutBits", FANOUT_BITS) == 0);
+    git_config_free(cfg);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_flush(backend) == 0);
+
+    srand(5);
+    for (int i = 0; i < NUM_RANGES; i++) {
+        uint64_t offset = (uint64_t)(rand() % BLOB_SIZE);
+        check_range(backend, &oid, data, BLOB_SIZE, offset,
+                    (size_t)(rand() % MAX_RANGE));
+    }
+    check_range(backend, &oid, data, BLOB_SIZE, 0, BLOB_SIZE);
+    check_range(backend, &oid, data, BLOB_SIZE, BLOB_SIZE - 10, 100);
+    check_range(backend, &oid, data, BLOB_SIZE, BLOB_SIZE, 100);
+    check_range(backend, &oid, data, BLOB_SIZE, BLOB_SIZE * 2, 100);
+    check_range(backend, &oid, data, BLOB_SIZE, 1000, 0);
+
+    /* the walk touches only the chunks overlapping the range */
+    git_odb *odb = NULL;
+    assert(git_repository_odb(&odb, repo) == 0);
+    git_odb_object *obj = NULL;
+    assert(git_odb_read(&obj, odb, &oid) == 0);
+    size_t *lens = NULL;
+    size_t total_chunks = bup_backend_object_chunk_count(backend, &oid, NULL,
+                                                         &lens);
+    assert(total_chunks > 10);
+    walk_check w = { lens[0] + 1, lens[0] + lens[1] + 2, 0, 0 };
+    assert(bup_chunk_list_walk(odb, 0, git_odb_object_data(obj),
+                               git_odb_object_size(obj), w.offset,
+                               w.end - w.offset, check_chunk, &w) == 0);
+    assert(w.visited == 2);
+    free(lens);
+    git_odb_object_free(obj);
+
+    /* ordinary blobs are sliced directly */
+    git_oid plain;
+    assert(git_odb_write(&plain, odb, SMALL_TEXT, strlen(SMALL_TEXT),
+                         GIT_OBJECT_BLOB) == 0);
+    check_range(backend, &plain, SMALL_TEXT, strlen(SMALL_TEXT), 4, 6);
+    check_range(backend, &plain, SMALL_TEXT, strlen(SMALL_TEXT), 10, 100);
+    git_odb_free(odb);
+    backend->free(backend);
+    git_repository_free(repo);
+
+    /* git2 show --range */
+    char file[512];
+    snprintf(file, sizeof(file), "%s/%s", path, FILE_NAME);
+    FILE *f = fopen(file, "wb");
+    assert(f);
+    fwrite(data, 1, BLOB_SIZE, f);
+    fclose(f);
+    setenv("GIT_AUTHOR_NAME", "Tester", 1);
+    setenv("GIT_AUTHOR_EMAIL", "tester@example.com", 1);
+    setenv("GIT_COMMITTER_NAME", "Tester", 1);
+    setenv("GIT_COMMITTER_EMAIL", "tester@example.com", 1);
+    snprintf(cmd, sizeof(cmd), "%s -C %s add %s", cli, path, FILE_NAME);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "%s -C %s commit -m range", cli, path);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "%s -C %s show --range=%d:%d HEAD:%s", cli,
+             path, CLI_OFFSET, CLI_LEN, FILE_NAME);
+    FILE *p = popen(cmd, "r");
+    assert(p);
+    char *buf = malloc(CLI_LEN);
+    assert(fread(buf, 1, CLI_LEN, p) == CLI_LEN);
+    assert(fgetc(p) == EOF);
+    assert(pclose(p) == 0);
+    assert(memcmp(buf, data + CLI_OFFSET, CLI_LEN) == 0);
+    free(buf);
+
+    free(data);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
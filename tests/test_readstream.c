@@ -0,0 +1,158 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 300000
+#define SMALL_TEXT "not a chunk list\n"
+#define REPO_TEMPLATE "rstream_repoXXXXXX"
+/* small chunks and nodes, for a list tree several levels deep */
+#define TREE_FANOUT_BITS 2
+#define TREE_SPLIT { 64, 1024, 0xff }
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(4242);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+/* Read a whole stream in pieces of varying size */
+static char *drain(git_odb_stream *stream, size_t len)
+{
+    char *buf = malloc(len + 1);
+    size_t got = 0;
+    size_t step = 1;
+    int n;
+    while ((n = git_odb_stream_read(stream, buf + got, step)) > 0) {
+        got += (size_t)n;
+        assert(got <= len);
+        step = step * 3 + 7;
+        if (step > len + 1 - got)
+            step = len + 1 - got;
+    }
+    assert(n == 0 && got == len);
+    return buf;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *path = mkdtemp(repo_tmp);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    assert(backend->readstream);
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+    git_oid oid;
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_backend_object_chunk_count(backend, &oid, NULL, NULL) > 1);
+
+    /* chunked blob, straight from the backend */
+    git_odb_stream *stream = NULL;
+    size_t len = 0;
+    git_object_t type = 0;
+    assert(backend->readstream(&stream, &len, &type, backend, &oid) == 0);
+    assert(len == BLOB_SIZE && type == GIT_OBJECT_BLOB);
+    char *buf = drain(stream, len);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+    stream->free(stream);
+
+    /* an ordinary object is streamed as stored */
+    git_odb *repo_odb = NULL;
+    assert(git_repository_odb(&repo_odb, repo) == 0);
+    git_oid plain;
+    assert(git_odb_write(&plain, repo_odb, SMALL_TEXT, strlen(SMALL_TEXT),
+                         GIT_OBJECT_BLOB) == 0);
+    git_odb_free(repo_odb);
+    assert(backend->readstream(&stream, &len, &type, backend, &plain) == 0);
+    assert(len == strlen(SMALL_TEXT) && type == GIT_OBJECT_BLOB);
+    buf = drain(stream, len);
+    assert(memcmp(buf, SMALL_TEXT, len) == 0);
+    free(buf);
+    stream->free(stream);
+
+    /* missing objects are reported as such */
+    git_oid missing;
+    git_oid_fromstr(&missing, "0123456789012345678901234567890123456789");
+    assert(backend->readstream(&stream, &len, &type, backend, &missing) ==
+           GIT_ENOTFOUND);
+
+    /* libgit2 picks the backend's stream through an odb */
+    git_odb *odb = NULL;
+    assert(git_odb_new(&odb) == 0);
+    assert(git_odb_add_backend(odb, backend, 10) == 0);
+    assert(git_odb_open_rstream(&stream, &len, &type, odb, &oid) == 0);
+    assert(len == BLOB_SIZE);
+    buf = drain(stream, len);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+    stream->free(stream);
+    git_odb_free(odb);
+
+    /* a list tree is walked one node per level, without resolving the
+     * list into the list cache; a list resolved earlier is read from it */
+    const bup_split_params tree_split = TREE_SPLIT;
+    assert(bup_odb_write_split_params(repo, &tree_split) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.fanoutBits", TREE_FANOUT_BITS) == 0);
+    assert(git_config_set_int32(cfg, "bup.readThreads", 4) == 0);
+    assert(git_config_set_int32(cfg, "bup.readAhead", 4) == 0);
+    git_config_free(cfg);
+    /* the odb freed the first backend */
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    assert(backend->write(backend, &oid, data, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_flush(backend) == 0);
+    assert(git_repository_odb(&repo_odb, repo) == 0);
+    git_odb_object *root = NULL;
+    assert(git_odb_read(&root, repo_odb, &oid) == 0);
+    assert(git_odb_object_size(root) > 9 &&
+           ((const unsigned char *)git_odb_object_data(root))[9] >= 2);
+    git_odb_object_free(root);
+    git_odb_free(repo_odb);
+
+    assert(backend->readstream(&stream, &len, &type, backend, &oid) == 0);
+    assert(len == BLOB_SIZE && type == GIT_OBJECT_BLOB);
+    buf = drain(stream, len);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+    stream->free(stream);
+    bup_cache_stats st;
+    bup_odb_list_cache_stats(backend, &st);
+    assert(st.entries == 0);
+
+    void *whole = NULL;
+    assert(backend->read(&whole, &len, &type, backend, &oid) == 0);
+    free(whole);
+    bup_odb_list_cache_stats(backend, &st);
+    assert(st.entries == 1);
+    assert(backend->readstream(&stream, &len, &type, backend, &oid) == 0);
+    assert(len == BLOB_SIZE);
+    buf = drain(stream, len);
+    assert(memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+    stream->free(stream);
+    backend->free(backend);
+
+    free(data);
+    git_repository_free(repo);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
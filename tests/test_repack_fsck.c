@@ -7,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 
 #define FILE_SIZE 100000
@@ -237,8 +239,23 @@ int main(void)
     printf("size_before_pack=%lld pack_files_before=%zu loose_before=%zu\n",
            size_before, pack_before, loose_before);
 
+    /* a temporary pack left by a dead session goes, a recent one stays */
+    char stale[512], fresh[512];
+    snprintf(stale, sizeof(stale), "%s/.git/objects/pack/%sstale", repo,
+             BUP_PACK_TMP_PREFIX);
+    snprintf(fresh, sizeof(fresh), "%s/.git/objects/pack/%sfresh", repo,
+             BUP_PACK_TMP_PREFIX);
+    fclose(fopen(stale, "wb"));
+    fclose(fopen(fresh, "wb"));
+    struct timeval old[2] = { { time(NULL) - BUP_PACK_TMP_EXPIRE - 60, 0 },
+                              { time(NULL) - BUP_PACK_TMP_EXPIRE - 60, 0 } };
+    assert(utimes(stale, old) == 0);
+
     snprintf(cmd, sizeof(cmd), "%s -C %s repack", cli, repo);
     assert(system(cmd) == 0);
+    struct stat st;
+    assert(stat(stale, &st) < 0 && stat(fresh, &st) == 0);
+    unlink(fresh);
     long long size_after = dir_size(repo);
     size_t pack_after = count_pack_files(repo);
     size_t loose_after = count_loose_objects(repo);
@@ -249,7 +266,8 @@ int main(void)
     printf(
         "size_after_pack=%lld pack_files_after=%zu loose_after=%zu\n",
         size_after, pack_after, loose_after);
-    assert(pack_before == 0);
+    /* each commit packed its chunks; repack folds them into one */
+    assert(pack_before > 0);
     assert(pack_after == 1);
     assert(loose_before > 0);
     assert(loose_after == 0);
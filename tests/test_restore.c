@@ -0,0 +1,142 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 600000
+#define SMALL_SIZE 3000
+#define SMALL_TEXT "plain blob\n"
+#define OUT_FILE "restore_out.tmp"
+#define REPO_TEMPLATE "restore_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void write_file(const char *path, const char *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(data, 1, len, f) == len);
+    fclose(f);
+}
+
+static void check_file(const char *path, const char *data, size_t len)
+{
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    char *buf = malloc(len + 1);
+    assert(fread(buf, 1, len + 1, f) == len);
+    fclose(f);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    setenv("GIT_AUTHOR_NAME", "Tester", 1);
+    setenv("GIT_AUTHOR_EMAIL", "tester@example.com", 1);
+    setenv("GIT_COMMITTER_NAME", "Tester", 1);
+    setenv("GIT_COMMITTER_EMAIL", "tester@example.com", 1);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "./git2 init %s", repo);
+    assert(system(cmd) == 0);
+
+    char *big = malloc(BLOB_SIZE);
+    char *small = malloc(SMALL_SIZE);
+    fill_random(big, BLOB_SIZE, 5);
+    fill_random(small, SMALL_SIZE, 6);
+
+    /* read into a caller buffer or an fd, lists and plain objects alike */
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, repo) == 0);
+    git_oid oid;
+    assert(backend->write(backend, &oid, big, BLOB_SIZE, GIT_OBJECT_BLOB) == 0);
+    char *buf = malloc(BLOB_SIZE);
+    size_t len = 0;
+    assert(bup_odb_read_into(backend, &oid, buf, BLOB_SIZE, &len) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, big, BLOB_SIZE) == 0);
+    assert(bup_odb_read_into(backend, &oid, buf, BLOB_SIZE - 1, &len) ==
+           GIT_EBUFS);
+    assert(len == BLOB_SIZE);
+
+    int fd = open(OUT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(bup_odb_read_to_fd(backend, &oid, fd) == 0);
+    close(fd);
+    check_file(OUT_FILE, big, BLOB_SIZE);
+
+    git_odb *odb = NULL;
+    git_repository *r = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(git_repository_odb(&odb, r) == 0);
+    git_oid plain;
+    assert(git_odb_write(&plain, odb, SMALL_TEXT, strlen(SMALL_TEXT),
+                         GIT_OBJECT_BLOB) == 0);
+    assert(bup_odb_read_into(backend, &plain, buf, BLOB_SIZE, &len) == 0);
+    assert(len == strlen(SMALL_TEXT) && memcmp(buf, SMALL_TEXT, len) == 0);
+    fd = open(OUT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(bup_odb_read_to_fd(backend, &plain, fd) == 0);
+    close(fd);
+    check_file(OUT_FILE, SMALL_TEXT, strlen(SMALL_TEXT));
+    git_odb_free(odb);
+    git_repository_free(r);
+    backend->free(backend);
+    unlink(OUT_FILE);
+
+    /* restore a committed tree and a single file */
+    char path[512];
+    snprintf(path, sizeof(path), "%s/sub", repo);
+    assert(mkdir(path, 0777) == 0);
+    snprintf(path, sizeof(path), "%s/big.bin", repo);
+    write_file(path, big, BLOB_SIZE);
+    snprintf(path, sizeof(path), "%s/sub/small.bin", repo);
+    write_file(path, small, SMALL_SIZE);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s add big.bin", repo);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s add sub/small.bin", repo);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s commit -m files", repo);
+    assert(system(cmd) == 0);
+
+    char dest[512];
+    snprintf(dest, sizeof(dest), "%s.out", repo);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s restore HEAD %s", repo, dest);
+    assert(system(cmd) == 0);
+    snprintf(path, sizeof(path), "%s/big.bin", dest);
+    check_file(path, big, BLOB_SIZE);
+    snprintf(path, sizeof(path), "%s/sub/small.bin", dest);
+    check_file(path, small, SMALL_SIZE);
+
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s restore HEAD:big.bin %s", repo,
+             OUT_FILE);
+    assert(system(cmd) == 0);
+    check_file(OUT_FILE, big, BLOB_SIZE);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s restore HEAD:missing %s", repo,
+             OUT_FILE);
+    assert(system(cmd) != 0);
+    unlink(OUT_FILE);
+
+    free(buf);
+    free(big);
+    free(small);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s", repo, dest);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BIG_SIZE 700000
+#define SMALL_SIZE 2000
+#define SMALL_FILES 40
+#define SAVE_THREADS 4
+#define LONG_LINK 4000
+#define REPO_TEMPLATE "save_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static void write_file(const char *path, const char *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(data, 1, len, f) == len);
+    fclose(f);
+}
+
+static void check_file(const char *path, const char *data, size_t len)
+{
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    char *buf = malloc(len + 1);
+    assert(fread(buf, 1, len + 1, f) == len);
+    fclose(f);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+}
+
+/* Run git2 save, sampling its thread count until it exits; returns the
+ * exit status and the most threads seen at once */
+static int save_counting_threads(const char *repo, const char *src,
+                                 const char *message, int *max_threads)
+{
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        execl("./git2", "git2", "-C", repo, "save", "-m", message, src,
+              (char *)NULL);
+        _exit(127);
+    }
+    char status_path[64];
+    snprintf(status_path, sizeof(status_path), "/proc/%d/status", (int)pid);
+    *max_threads = 0;
+    int status;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        FILE *f = fopen(status_path, "r");
+        char line[256];
+        int n;
+        while (f && fgets(line, sizeof(line), f))
+            if (sscanf(line, "Threads: %d", &n) == 1 && n > *max_threads)
+                *max_threads = n;
+        if (f)
+            fclose(f);
+        usleep(1000);
+    }
+    return status;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    setenv("GIT_AUTHOR_NAME", "Tester", 1);
+    setenv("GIT_AUTHOR_EMAIL", "tester@example.com", 1);
+    setenv("GIT_COMMITTER_NAME", "Tester", 1);
+    setenv("GIT_COMMITTER_EMAIL", "tester@example.com", 1);
+
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "./git2 init %s", repo);
+    assert(system(cmd) == 0);
+    git_repository *r = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, r) == 0);
+    assert(git_config_set_int32(cfg, "bup.threads", SAVE_THREADS) == 0);
+    git_config_free(cfg);
+
+    /* a tree with nested, empty, executable and linked entries */
+    char *big = malloc(BIG_SIZE);
+    char *small = malloc(SMALL_SIZE);
+    fill_random(big, BIG_SIZE, 11);
+    char src[512], path[512];
+    snprintf(src, sizeof(src), "%s.src", repo);
+    assert(mkdir(src, 0777) == 0);
+    snprintf(path, sizeof(path), "%s/sub", src);
+    assert(mkdir(path, 0777) == 0);
+    snprintf(path, sizeof(path), "%s/sub/deep", src);
+    assert(mkdir(path, 0777) == 0);
+    snprintf(path, sizeof(path), "%s/empty", src);
+    assert(mkdir(path, 0777) == 0);
+    snprintf(path, sizeof(path), "%s/big.bin", src);
+    write_file(path, big, BIG_SIZE);
+    snprintf(path, sizeof(path), "%s/sub/deep/copy.bin", src);
+    write_file(path, big, BIG_SIZE);
+    for (int i = 0; i < SMALL_FILES; i++) {
+        fill_random(small, SMALL_SIZE, (unsigned)i);
+        snprintf(path, sizeof(path), "%s/sub/f%02d", src, i);
+        write_file(path, small, SMALL_SIZE);
+    }
+    snprintf(path, sizeof(path), "%s/run.sh", src);
+    write_file(path, "#!/bin/sh\n", 10);
+    assert(chmod(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/link", src);
+    assert(symlink("big.bin", path) == 0);
+    /* a target far longer than the usual path, read whole */
+    char long_target[LONG_LINK + 1];
+    for (int i = 0; i < LONG_LINK; i++)
+        long_target[i] = i % 8 == 7 ? '/' : 'a' + i % 7;
+    long_target[LONG_LINK] = '\0';
+    snprintf(path, sizeof(path), "%s/long", src);
+    assert(symlink(long_target, path) == 0);
+
+    /* big.bin would get a pipeline of its own; save writes it serially,
+     * so its workers are the only threads */
+    int max_threads;
+    int status = save_counting_threads(repo, src, "first", &max_threads);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(max_threads <= SAVE_THREADS);
+
+    git_oid first_oid;
+    assert(git_reference_name_to_id(&first_oid, r, "HEAD") == 0);
+    git_commit *first = NULL;
+    assert(git_commit_lookup(&first, r, &first_oid) == 0);
+    assert(git_commit_parentcount(first) == 0);
+    assert(strcmp(git_commit_message(first), "first") == 0);
+    git_tree *tree = NULL;
+    assert(git_commit_tree(&tree, first) == 0);
+    git_tree_entry *e = NULL, *copy = NULL;
+    assert(git_tree_entry_bypath(&e, tree, "empty") == GIT_ENOTFOUND);
+    assert(git_tree_entry_bypath(&e, tree, "run.sh") == 0);
+    assert(git_tree_entry_filemode(e) == GIT_FILEMODE_BLOB_EXECUTABLE);
+    git_tree_entry_free(e);
+    assert(git_tree_entry_bypath(&e, tree, "link") == 0);
+    assert(git_tree_entry_filemode(e) == GIT_FILEMODE_LINK);
+    git_tree_entry_free(e);
+    /* equal files share their chunk list whichever worker wrote them */
+    assert(git_tree_entry_bypath(&e, tree, "big.bin") == 0);
+    assert(git_tree_entry_bypath(&copy, tree, "sub/deep/copy.bin") == 0);
+    assert(git_oid_cmp(git_tree_entry_id(e), git_tree_entry_id(copy)) == 0);
+    git_tree_entry_free(copy);
+    git_oid big_oid;
+    git_oid_cpy(&big_oid, git_tree_entry_id(e));
+    git_tree_entry_free(e);
+    git_tree_free(tree);
+
+    char dest[512];
+    snprintf(dest, sizeof(dest), "%s.out", repo);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s restore HEAD %s", repo, dest);
+    assert(system(cmd) == 0);
+    snprintf(path, sizeof(path), "%s/sub/deep/copy.bin", dest);
+    check_file(path, big, BIG_SIZE);
+    for (int i = 0; i < SMALL_FILES; i++) {
+        fill_random(small, SMALL_SIZE, (unsigned)i);
+        snprintf(path, sizeof(path), "%s/sub/f%02d", dest, i);
+        check_file(path, small, SMALL_SIZE);
+    }
+    char link_buf[LONG_LINK + 2];
+    snprintf(path, sizeof(path), "%s/long", dest);
+    assert(readlink(path, link_buf, sizeof(link_buf)) == LONG_LINK);
+    assert(memcmp(link_buf, long_target, LONG_LINK) == 0);
+
+    /* a second save builds on the first and reuses unchanged blobs */
+    fill_random(small, SMALL_SIZE, 99);
+    snprintf(path, sizeof(path), "%s/sub/f00", src);
+    write_file(path, small, SMALL_SIZE);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s save %s", repo, src);
+    assert(system(cmd) == 0);
+    git_oid second_oid;
+    assert(git_reference_name_to_id(&second_oid, r, "HEAD") == 0);
+    git_commit *second = NULL;
+    assert(git_commit_lookup(&second, r, &second_oid) == 0);
+    assert(git_commit_parentcount(second) == 1);
+    assert(git_oid_cmp(git_commit_parent_id(second, 0), &first_oid) == 0);
+    assert(git_commit_tree(&tree, second) == 0);
+    assert(git_tree_entry_bypath(&e, tree, "big.bin") == 0);
+    assert(git_oid_cmp(git_tree_entry_id(e), &big_oid) == 0);
+    git_tree_entry_free(e);
+    git_tree_free(tree);
+    git_commit_free(second);
+    git_commit_free(first);
+
+    /* save resets the index to its tree, so a commit after an add keeps
+     * everything the save recorded */
+    snprintf(path, sizeof(path), "%s/added.txt", repo);
+    write_file(path, "added\n", 6);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s add added.txt", repo);
+    assert(system(cmd) == 0);
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s commit -m third", repo);
+    assert(system(cmd) == 0);
+    git_oid third_oid;
+    assert(git_reference_name_to_id(&third_oid, r, "HEAD") == 0);
+    git_commit *third = NULL;
+    assert(git_commit_lookup(&third, r, &third_oid) == 0);
+    assert(git_oid_cmp(git_commit_parent_id(third, 0), &second_oid) == 0);
+    assert(git_commit_tree(&tree, third) == 0);
+    assert(git_tree_entry_bypath(&e, tree, "added.txt") == 0);
+    git_tree_entry_free(e);
+    assert(git_tree_entry_bypath(&e, tree, "big.bin") == 0);
+    assert(git_oid_cmp(git_tree_entry_id(e), &big_oid) == 0);
+    git_tree_entry_free(e);
+    assert(git_tree_entry_bypath(&e, tree, "sub/deep/copy.bin") == 0);
+    git_tree_entry_free(e);
+    assert(git_tree_entry_bypath(&e, tree, "long") == 0);
+    assert(git_tree_entry_filemode(e) == GIT_FILEMODE_LINK);
+    git_tree_entry_free(e);
+    git_tree_free(tree);
+    git_commit_free(third);
+
+    /* a missing directory fails without moving HEAD */
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s save %s.missing", repo, src);
+    assert(system(cmd) != 0);
+    git_oid head;
+    assert(git_reference_name_to_id(&head, r, "HEAD") == 0);
+    assert(git_oid_cmp(&head, &third_oid) == 0);
+
+    git_repository_free(r);
+    free(big);
+    free(small);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s %s", repo, src, dest);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
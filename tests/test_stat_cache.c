@@ -0,0 +1,126 @@
+#include <git2.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_SIZE 300000
+#define FILE_NAME "data.bin"
+#define PAST_SECONDS 100
+#define FUTURE_SECONDS 3600
+#define REPO_TEMPLATE "stat_cache_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len, unsigned seed)
+{
+    srand(seed);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+/* Write data and set the file's mtime to now + offset seconds */
+static void write_file(const char *path, const char *data, size_t len,
+                       long offset)
+{
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(data, 1, len, f) == len);
+    fclose(f);
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec += offset;
+    times[1] = times[0];
+    assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+static void add(const char *repo)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "./git2 -C %s add " FILE_NAME, repo);
+    assert(system(cmd) == 0);
+}
+
+static void index_entry(const char *repo, git_oid *oid, git_index_entry *out)
+{
+    git_repository *r = NULL;
+    git_index *index = NULL;
+    assert(git_repository_open(&r, repo) == 0);
+    assert(git_repository_index(&index, r) == 0);
+    const git_index_entry *e = git_index_get_bypath(index, FILE_NAME, 0);
+    assert(e);
+    git_oid_cpy(oid, &e->id);
+    *out = *e;
+    git_index_free(index);
+    git_repository_free(r);
+}
+
+/* The index is replaced by a rename on every write */
+static ino_t index_inode(const char *repo)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/.git/index", repo);
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_ino;
+}
+
+int main(void)
+{
+    git_libgit2_init();
+    char repo_tmp[] = REPO_TEMPLATE;
+    char *repo = mkdtemp(repo_tmp);
+    assert(repo);
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "./git2 init %s", repo);
+    assert(system(cmd) == 0);
+
+    char *data = malloc(FILE_SIZE);
+    fill_random(data, FILE_SIZE, 1);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" FILE_NAME, repo);
+    write_file(path, data, FILE_SIZE, -PAST_SECONDS);
+    add(repo);
+
+    /* the entry carries full stat data */
+    git_oid first, oid;
+    git_index_entry e;
+    index_entry(repo, &first, &e);
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert(e.ino == (uint32_t)st.st_ino && e.dev == (uint32_t)st.st_dev);
+    assert(e.mtime.nanoseconds == (uint32_t)st.st_mtim.tv_nsec);
+    assert(e.file_size == FILE_SIZE);
+
+    /* an unchanged file is skipped without touching the index */
+    ino_t ino = index_inode(repo);
+    add(repo);
+    assert(index_inode(repo) == ino);
+    index_entry(repo, &oid, &e);
+    assert(git_oid_cmp(&oid, &first) == 0);
+
+    /* same size and mtime, new content: the ctime gives it away */
+    fill_random(data, FILE_SIZE, 2);
+    write_file(path, data, FILE_SIZE, -PAST_SECONDS);
+    add(repo);
+    git_oid second;
+    index_entry(repo, &second, &e);
+    assert(git_oid_cmp(&second, &first) != 0);
+
+    /* an mtime not older than the index is racy and always re-read */
+    write_file(path, data, FILE_SIZE, FUTURE_SECONDS);
+    add(repo);
+    ino = index_inode(repo);
+    add(repo);
+    assert(index_inode(repo) != ino);
+    index_entry(repo, &oid, &e);
+    assert(git_oid_cmp(&oid, &second) == 0);
+
+    free(data);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", repo);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "bup_odb.h"
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_SIZE 3000000
+#define MAX_PIECE 70000
+#define SMALL_INFLIGHT 65536
+#define EMPTY_TREE "4b825dc642cb6eb9a060e54bf8d69288fbee4904"
+#define REPO_TEMPLATE "wstream_repoXXXXXX"
+
+static void fill_random(char *buf, size_t len)
+{
+    srand(31337);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char)(rand() % 256);
+}
+
+static char *make_repo(char *tmpl, int threads)
+{
+    char *path = mkdtemp(tmpl);
+    assert(path);
+    git_repository *repo = NULL;
+    assert(git_repository_init(&repo, path, 0) == 0);
+    assert(bup_odb_init_config(repo) == 0);
+    git_config *cfg = NULL;
+    assert(git_repository_config(&cfg, repo) == 0);
+    assert(git_config_set_int32(cfg, "bup.threads", threads) == 0);
+    assert(git_config_set_int64(cfg, "bup.maxInflight", SMALL_INFLIGHT) == 0);
+    git_config_free(cfg);
+    git_repository_free(repo);
+    return path;
+}
+
+/* Write data in pieces of varying size, down to single bytes */
+static void stream_blob(git_odb_backend *backend, const char *data,
+                        size_t len, git_oid *oid)
+{
+    git_odb_stream *stream = NULL;
+    assert(backend->writestream(&stream, backend, len, GIT_OBJECT_BLOB) == 0);
+    size_t ofs = 0;
+    srand(7);
+    while (ofs < len) {
+        size_t n = ofs < 16 ? 1 : (size_t)rand() % MAX_PIECE + 1;
+        if (n > len - ofs)
+            n = len - ofs;
+        assert(stream->write(stream, data + ofs, n) == 0);
+        ofs += n;
+    }
+    assert(stream->finalize_write(stream, oid) == 0);
+    stream->free(stream);
+}
+
+static void check_repo(const char *path, const char *data)
+{
+    git_odb_backend *backend = NULL;
+    assert(bup_odb_backend_new(&backend, path) == 0);
+    git_oid streamed, written;
+    stream_blob(backend, data, BLOB_SIZE, &streamed);
+    assert(backend->write(backend, &written, data, BLOB_SIZE,
+                          GIT_OBJECT_BLOB) == 0);
+    /* the same chunks and list however the bytes arrive */
+    assert(git_oid_cmp(&streamed, &written) == 0);
+    git_odb_stream *unsized = NULL;
+    git_oid piped;
+    assert(backend->writestream(&unsized, backend, BUP_STREAM_SIZE_UNKNOWN,
+                                GIT_OBJECT_BLOB) == 0);
+    assert(unsized->write(unsized, data, BLOB_SIZE) == 0);
+    assert(unsized->finalize_write(unsized, &piped) == 0);
+    unsized->free(unsized);
+    assert(git_oid_cmp(&piped, &written) == 0);
+    char *buf = malloc(BLOB_SIZE);
+    size_t len = 0;
+    assert(bup_odb_read_into(backend, &streamed, buf, BLOB_SIZE, &len) == 0);
+    assert(len == BLOB_SIZE && memcmp(buf, data, BLOB_SIZE) == 0);
+    free(buf);
+
+    /* short and long streams are refused */
+    git_odb_stream *stream = NULL;
+    git_oid oid;
+    assert(backend->writestream(&stream, backend, BLOB_SIZE,
+                                GIT_OBJECT_BLOB) == 0);
+    assert(stream->write(stream, data, BLOB_SIZE / 2) == 0);
+    assert(stream->finalize_write(stream, &oid) < 0);
+    stream->free(stream);
+    assert(backend->writestream(&stream, backend, 10, GIT_OBJECT_BLOB) == 0);
+    assert(stream->write(stream, data, 11) < 0);
+    stream->free(stream);
+    /* and an abandoned one just releases its open chunk */
+    assert(backend->writestream(&stream, backend, BLOB_SIZE,
+                                GIT_OBJECT_BLOB) == 0);
+    assert(stream->write(stream, data, MAX_PIECE) == 0);
+    stream->free(stream);
+
+    /* other types are written as they are */
+    assert(backend->writestream(&stream, backend, 0, GIT_OBJECT_TREE) == 0);
+    assert(stream->finalize_write(stream, &oid) == 0);
+    stream->free(stream);
+    char hex[GIT_OID_HEXSZ + 1];
+    assert(strcmp(git_oid_tostr(hex, sizeof(hex), &oid), EMPTY_TREE) == 0);
+    backend->free(backend);
+}
+
+int main(void)
+{
+    git_libgit2_init();
+
+    char *data = malloc(BLOB_SIZE);
+    fill_random(data, BLOB_SIZE);
+
+    char serial_tmp[] = REPO_TEMPLATE;
+    char parallel_tmp[] = REPO_TEMPLATE;
+    char *serial = make_repo(serial_tmp, 1);
+    char *parallel = make_repo(parallel_tmp, 4);
+    check_repo(serial, data);
+    check_repo(parallel, data);
+
+    free(data);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s", serial, parallel);
+    system(cmd);
+    git_libgit2_shutdown();
+    return 0;
+}